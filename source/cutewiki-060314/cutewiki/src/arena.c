@@ -0,0 +1,167 @@
+/*
+ * arena.c - memory that lives as long as a request
+ *
+ * Copyright 2005 Martin Doering
+ *
+ * This file is distributed under the GPL, version 2 or at your
+ * option any later version.  See doc/license.txt for details.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+
+
+struct arena_block {
+    struct arena_block	*next;
+    size_t		size;
+};
+
+/* the block header keeps the data aligned for any type */
+#define	ARENA_ALIGN	(sizeof(ArenaBlock))
+#define	ARENA_DATA(b)	((char*)((b) + 1))
+
+
+
+/*
+ * arena_new_block - get another block from the system
+ */
+static ArenaBlock *
+arena_new_block(size_t size)
+{
+    ArenaBlock *block;
+
+    block = malloc(sizeof(ArenaBlock) + size);
+    if (block == NULL)
+	return NULL;
+    block->size = size;
+    block->next = NULL;
+    return block;
+}
+
+
+
+/*
+ * arena_alloc - get memory, which is freed by arena_reset()
+ *
+ * Most allocations just move a pointer in the current block.  Big
+ * ones get a block of their own, so the current block is not wasted.
+ */
+void *
+arena_alloc(Arena* arena, size_t size)
+{
+    ArenaBlock	*block;
+    char	*mem;
+
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (size <= (size_t)(arena->end - arena->next)) {
+	mem = arena->next;
+	arena->next += size;
+	return mem;
+    }
+
+    if (size > ARENA_BLOCK_SIZE / 4) {
+	block = arena_new_block(size);
+	if (block == NULL)
+	    return NULL;
+	if (arena->blocks) {
+	    block->next = arena->blocks->next;
+	    arena->blocks->next = block;
+	}
+	else {
+	    arena->blocks = block;
+	    arena->next = arena->end = ARENA_DATA(block) + size;
+	}
+	return ARENA_DATA(block);
+    }
+
+    block = arena_new_block(ARENA_BLOCK_SIZE);
+    if (block == NULL)
+	return NULL;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->next = ARENA_DATA(block) + size;
+    arena->end = ARENA_DATA(block) + ARENA_BLOCK_SIZE;
+    return ARENA_DATA(block);
+}
+
+
+
+/*
+ * arena_strndup - copy at most len chars of a string
+ */
+char *
+arena_strndup(Arena* arena, const char* string, size_t len)
+{
+    char *copy;
+
+    copy = arena_alloc(arena, len + 1);
+    if (copy == NULL)
+	return NULL;
+    memcpy(copy, string, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+
+
+/*
+ * arena_strdup - copy a string
+ */
+char *
+arena_strdup(Arena* arena, const char* string)
+{
+    if (string == NULL)
+	return NULL;
+    return arena_strndup(arena, string, strlen(string));
+}
+
+
+
+/*
+ * arena_reset - free everything allocated since the last reset
+ *
+ * One block is kept for the next request.
+ */
+void
+arena_reset(Arena* arena)
+{
+    ArenaBlock	*block, *next, *keep;
+
+    keep = NULL;
+    for (block = arena->blocks; block != NULL; block = next) {
+	next = block->next;
+	if (keep == NULL && block->size == ARENA_BLOCK_SIZE)
+	    keep = block;
+	else
+	    free(block);
+    }
+
+    arena->blocks = keep;
+    if (keep) {
+	keep->next = NULL;
+	arena->next = ARENA_DATA(keep);
+	arena->end = ARENA_DATA(keep) + ARENA_BLOCK_SIZE;
+    }
+    else
+	arena->next = arena->end = NULL;
+}
+
+
+
+/*
+ * arena_exit - give all memory back to the system
+ */
+void
+arena_exit(Arena* arena)
+{
+    arena_reset(arena);
+    free(arena->blocks);
+    arena->blocks = NULL;
+    arena->next = arena->end = NULL;
+}
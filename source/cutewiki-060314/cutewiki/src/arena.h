@@ -0,0 +1,37 @@
+/*
+ * arena.h - memory that lives as long as a request
+ *
+ * Copyright 2005 Martin Doering
+ *
+ * This file is distributed under the GPL, version 2 or at your
+ * option any later version.  See doc/license.txt for details.
+ */
+
+
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+
+#define	ARENA_BLOCK_SIZE	(64*1024)
+
+
+typedef struct arena_block ArenaBlock;
+
+typedef struct {
+    ArenaBlock	*blocks;		/* the current block first */
+    char	*next;			/* free part of the current block */
+    char	*end;
+} Arena;
+
+
+
+void*	arena_alloc (Arena*, size_t);
+char*	arena_strdup (Arena*, const char*);
+char*	arena_strndup (Arena*, const char*, size_t);
+void	arena_reset (Arena*);
+void	arena_exit (Arena*);
+
+#endif
@@ -0,0 +1,329 @@
+/*
+ * cache.c - keep the small static files of the server in memory
+ *
+ * Stylesheets, icons and images are read with every page view. They
+ * are loaded once when the directories are registered and then sent
+ * from memory. An entry is checked against its file now and then and
+ * is read again when the file changed.
+ *
+ * Copyright 2005 Martin Doering
+ *
+ * This file is distributed under the GPL, version 2 or at your
+ * option any later version.  See doc/license.txt for details.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "types.h"
+#include "hash.h"
+#include "http.h"
+#include "svr.h"
+#include "cache.h"
+#include "metrics.h"
+
+
+
+typedef struct cache_entry {
+    char	*path;			/* also the key in the hash */
+    char	*data;			/* NULL if the file does not exist */
+    int		len;
+    int		size;			/* memory taken from the limit */
+    ino_t	ino;
+    time_t	mtime;
+    time_t	checked;		/* last compared with the file */
+    char	etag[CACHE_ETAG_LEN];
+} CacheEntry;
+
+static Hash	*cache_files = NULL;
+static int	cache_limit = 0;	/* bytes, 0 if switched off */
+static int	cache_used = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/*
+ * cache_etag - make the entity tag of a file
+ *
+ * It changes with every new version of the file, whether it is sent
+ * from the cache or not.
+ */
+void
+cache_etag(char * etag, struct stat * sbuf)
+{
+    snprintf(etag, CACHE_ETAG_LEN, "\"%lx-%lx-%lx\"",
+             (unsigned long) sbuf->st_ino, (unsigned long) sbuf->st_size,
+             (unsigned long) sbuf->st_mtime);
+}
+
+
+
+/*
+ * cache_drop - forget a cached file
+ */
+static void
+cache_drop(CacheEntry * entry)
+{
+    hash_remove(cache_files, entry->path);
+    cache_used -= entry->size;
+    free(entry->data);
+    free(entry->path);
+    free(entry);
+}
+
+
+
+/*
+ * cache_init - set the memory used for cached files
+ *
+ * Called again, when the configuration is read anew. Files are sent
+ * without the lock of the handlers, so the table must exist, before
+ * the limit tells them to use it. With a lower limit files are
+ * dropped, until the rest fits.
+ */
+void
+cache_init(int limit)
+{
+    CacheEntry	**list, **ptr;
+
+    pthread_mutex_lock(&cache_lock);
+    if (cache_files == NULL && limit > 0)
+        cache_files = hash_new();
+    if (cache_files && cache_used > limit) {
+        list = (CacheEntry **) hash_get_list(cache_files);
+        for (ptr = list; ptr && *ptr && cache_used > limit; ptr++)
+            cache_drop(*ptr);
+        free(list);
+    }
+    cache_limit = limit;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+
+/*
+ * cache_load - read a file into the cache
+ *
+ * Returns NULL, if the file is too big or the cache is full.
+ */
+static CacheEntry *
+cache_load(char * path, struct stat * sbuf)
+{
+    CacheEntry	*entry;
+    int		fd, len;
+
+    if (!S_ISREG(sbuf->st_mode) || sbuf->st_size > CACHE_MAX_FILE ||
+        cache_used + sbuf->st_size > cache_limit)
+        return NULL;
+
+    entry = malloc(sizeof(CacheEntry));
+    if (entry == NULL)
+        return NULL;
+    bzero(entry, sizeof(CacheEntry));
+    entry->path = strdup(path);
+    entry->data = malloc(sbuf->st_size + 1);
+    fd = open(path, O_RDONLY);
+    if (entry->path == NULL || entry->data == NULL || fd < 0) {
+        if (fd >= 0)
+            close(fd);
+        free(entry->path);
+        free(entry->data);
+        free(entry);
+        return NULL;
+    }
+    len = 0;
+    while (len < sbuf->st_size) {
+        int	got;
+
+        got = read(fd, entry->data + len, sbuf->st_size - len);
+        if (got <= 0)
+            break;
+        len += got;
+    }
+    close(fd);
+
+    entry->len = len;
+    entry->size = len;
+    entry->ino = sbuf->st_ino;
+    entry->mtime = sbuf->st_mtime;
+    entry->checked = time(NULL);
+    cache_etag(entry->etag, sbuf);
+    cache_used += len;
+    hash_insert(cache_files, entry->path, entry);
+    return entry;
+}
+
+
+
+/*
+ * cache_cacheable - check, if a file would be kept in the cache
+ */
+static bool
+cache_cacheable(char * path)
+{
+    struct stat	sbuf;
+
+    return stat(path, &sbuf) == 0 && S_ISREG(sbuf.st_mode) &&
+           sbuf.st_size <= CACHE_MAX_FILE;
+}
+
+
+
+/*
+ * cache_missing - remember, that a variant of a file does not exist
+ *
+ * Only done for variants of files, that are cached themselves, so any
+ * names asked for by clients can not fill the cache.
+ */
+static CacheEntry *
+cache_missing(char * path, char * plain)
+{
+    CacheEntry	*entry;
+    int		size = sizeof(CacheEntry) + strlen(path) + 1;
+
+    if (cache_used + size > cache_limit || !cache_cacheable(plain))
+        return NULL;
+    entry = malloc(sizeof(CacheEntry));
+    if (entry == NULL)
+        return NULL;
+    bzero(entry, sizeof(CacheEntry));
+    entry->path = strdup(path);
+    if (entry->path == NULL) {
+        free(entry);
+        return NULL;
+    }
+    entry->size = size;
+    entry->checked = time(NULL);
+    cache_used += size;
+    hash_insert(cache_files, entry->path, entry);
+    return entry;
+}
+
+
+
+/*
+ * cache_load_dir - put the small files of a directory into the cache
+ */
+void
+cache_load_dir(char * dir)
+{
+    DIR		*dp;
+    struct dirent *de;
+    struct stat	sbuf;
+    char	path[HTTP_MAX_URL];
+
+    if (cache_limit == 0)
+        return;
+    dp = opendir(dir);
+    if (dp == NULL)
+        return;
+    pthread_mutex_lock(&cache_lock);
+    while ((de = readdir(dp)) != NULL) {
+        if (*de->d_name == '.')
+            continue;
+        snprintf(path, HTTP_MAX_URL, "%s/%s", dir, de->d_name);
+        if (stat(path, &sbuf) == 0 && hash_find(cache_files, path) == NULL)
+            cache_load(path, &sbuf);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    closedir(dp);
+}
+
+
+
+/*
+ * cache_lookup - find a file and make sure it is still current
+ *
+ * The file is only looked at every CACHE_CHECK_INTERVAL seconds.
+ * Files not yet known are added, as long as there is room. A missing
+ * variant is remembered as well, as long as the plain file is there.
+ */
+static CacheEntry *
+cache_lookup(char * path, char * plain)
+{
+    CacheEntry	*entry;
+    struct stat	sbuf;
+    time_t	now = time(NULL);
+
+    entry = hash_find(cache_files, path);
+    if (entry && now - entry->checked < CACHE_CHECK_INTERVAL)
+        return entry;
+
+    if (stat(path, &sbuf) < 0) {
+        if (entry && entry->data == NULL && plain && cache_cacheable(plain)) {
+            entry->checked = now;
+            return entry;
+        }
+        if (entry)
+            cache_drop(entry);
+        return plain ? cache_missing(path, plain) : NULL;
+    }
+    if (entry && (entry->data == NULL || entry->mtime != sbuf.st_mtime ||
+                  entry->ino != sbuf.st_ino || entry->len != sbuf.st_size)) {
+        cache_drop(entry);
+        entry = NULL;
+    }
+    if (entry == NULL)
+        return cache_load(path, &sbuf);
+    entry->checked = now;
+    return entry;
+}
+
+
+
+/*
+ * cache_send - answer the request for a file from the cache
+ *
+ * An encoding is given for a compressed variant of a file, which is
+ * often missing. Its name is the one of the plain file with one more
+ * extension. Returns 1 if the file is known not to exist and -1, if
+ * it is not cached, so it has to be sent from the disk.
+ */
+int
+cache_send(httpd * server, char * path, char * type, char * encoding)
+{
+    CacheEntry	*entry;
+    char	plain[HTTP_MAX_URL];
+    char	*ext;
+
+    if (cache_limit == 0)
+        return -1;
+
+    *plain = '\0';
+    ext = strrchr(path, '.');
+    if (encoding && ext && ext - path < HTTP_MAX_URL) {
+        strncpy(plain, path, ext - path);
+        plain[ext - path] = '\0';
+    }
+    pthread_mutex_lock(&cache_lock);
+    entry = cache_lookup(path, *plain ? plain : NULL);
+    if (entry == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        __sync_fetch_and_add(&metrics->cacheMisses, 1);
+        return -1;
+    }
+    if (entry->data == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return 1;
+    }
+    __sync_fetch_and_add(&metrics->cacheHits, 1);
+    svr_add_fileheaders(server, type, entry->etag, encoding);
+    if (http_check_cached(server, entry->etag, entry->mtime) == 0) {
+        svr_send_err304(server);
+    }
+    else {
+        http_send_headers(server, entry->len, entry->mtime);
+        http_write(server, entry->data, entry->len);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
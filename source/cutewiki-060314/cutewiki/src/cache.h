@@ -0,0 +1,32 @@
+/*
+ * cache.h - keep the small static files of the server in memory
+ *
+ * Copyright 2005 Martin Doering
+ *
+ * This file is distributed under the GPL, version 2 or at your
+ * option any later version.  See doc/license.txt for details.
+ */
+
+
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <sys/stat.h>
+
+#include "types.h"
+#include "http.h"
+
+
+#define	CACHE_MAX_FILE		(64*1024)	/* bigger files use sendfile */
+#define	CACHE_CHECK_INTERVAL	2		/* seconds between stat()s */
+#define	CACHE_ETAG_LEN		64
+
+
+
+void	cache_init (int);
+void	cache_load_dir (char*);
+int	cache_send (httpd*, char*, char*, char*);
+void	cache_etag (char*, struct stat*);
+
+#endif
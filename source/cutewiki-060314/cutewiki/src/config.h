@@ -16,3 +16,14 @@
 
 /* Time in minutes a page will get locked while beeing edited by someone. */
 #define WIKI_EDITTIMEOUT 10
+
+/* Kilobytes of small static files kept in memory (cache_size) and seconds
+ * browsers may keep them before asking again (cache_maxage). */
+#define WIKI_CACHE_SIZE 2048
+#define WIKI_CACHE_MAXAGE 86400
+
+/* Kilobytes of rendered pages kept in memory (page_cache_size). */
+#define WIKI_PAGE_CACHE_SIZE 4096
+
+/* Client addresses allowed to read /Metrics (metrics_allow). */
+#define WIKI_METRICS_ALLOW "127.0.0.1"
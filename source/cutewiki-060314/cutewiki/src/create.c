@@ -121,7 +121,9 @@ create_infopage()
 		     "|| Parameter  | actual Value |\n"
 		     "| Page count  | [PageCount]  |\n"
 		     "| Memory consumption | [MainMemory] |\n"
-		     "| Disk usage  | [DiskUsage]  |", "",
+		     "| Disk usage  | [DiskUsage]  |\n\n"
+		     "Requests per path: \n\n"
+		     "[RouteCalls]", "",
 		     "WikiAdmin", "", "", "", "",
 		     0, true, false);
 }
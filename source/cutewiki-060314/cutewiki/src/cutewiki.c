@@ -13,8 +13,11 @@
 #include <locale.h>
 #include <crypt.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
+#include <sys/wait.h>
+#include <pthread.h>
 
 #include "var.h"
 #include "cutewiki.h"
@@ -27,11 +30,15 @@
 #include "robot.h"
 #include "tar.h"
 #include "svr.h"
+#include "log.h"
 #include "var.h"
 #include "misc.h"
 #include "html.h"
 #include "request.h"
 #include "rcs.h"
+#include "metrics.h"
+#include "trace.h"
+#include "pagecache.h"
 
 
 
@@ -40,7 +47,11 @@ struct Wiki {
     Config * cfg;
     char * description;
     char * hostname;
+    char * metrics_allow;       /* addresses allowed to read /Metrics */
     int    port;
+    char * fastcgi;             /* Unix socket of FastCGI or NULL */
+    int    threads;             /* number of worker threads */
+    int    processes;           /* number of worker processes */
     char * pagedir;
     char * filedir;
     char * imagedir;
@@ -63,10 +74,23 @@ struct Wiki {
     char * password;
     time_t starttime;
     int    calls;               /* number of page calls */
+    char ** argv;               /* to start the program again */
+    int    readyFd;             /* tells the process before, we run */
 };
 
 struct Wiki * wiki;
 
+/* the renderer nests deeply and keeps big buffers on the stack */
+#define WIKI_STACK_SIZE (16*1024*1024)
+
+/* handed over to a new program by wiki_upgrade() */
+#define WIKI_ENV_LISTEN         "CUTEWIKI_LISTEN_FD"
+#define WIKI_ENV_READY          "CUTEWIKI_READY_FD"
+#define WIKI_ENV_INDEX          "CUTEWIKI_INDEX"
+#define WIKI_INDEX_FILE         ".index"
+#define WIKI_UPGRADE_TIMEOUT    60      /* seconds for the new one to start */
+#define WIKI_COMPACT_INTERVAL   60      /* seconds between change log checks */
+
 
 
 /*
@@ -244,7 +268,7 @@ int
 wiki_get_pagemode()
 {
     int retval = MODE_HTML;
-    char * mode = var_get_val(server->variables, "mode");
+    char * mode = var_get_val(&server->variables, VAR_MODE);
 
     if (mode) {
         if (!strcmp("htm", mode))
@@ -295,7 +319,7 @@ wiki_get_pagename (char * dir)
 static bool
 wiki_is_authenticated()
 {
-    if (var_get_val(server->variables, "action") != NULL) {
+    if (var_get_val(&server->variables, VAR_ACTION) != NULL) {
         /* we had been logged off, force authenticate the user */
 	svr_force_auth(server, wiki_get_wikiname());
 	out_write_error("401",  /* not authorized */
@@ -344,6 +368,96 @@ wiki_check_method (int wanted)
     return true;
 }
 
+/*
+ * wiki_check_etag - answer with a 304, if the client has the page
+ *
+ * The entity tag sums up the page with its links, the reader, the
+ * cookies shown in the menu and the encoding. Pages with macros or
+ * lists get none. Returns true, if nothing has to be rendered.
+ *
+ * The key of the rendering in the page cache and the tag without the
+ * encoding are left in key and tag, which stay empty without ETag.
+ */
+static bool
+wiki_check_etag(char * name, int mode, char * key, char * tag)
+{
+    Page *	page;
+    char *	user;
+    char *	enc;
+    char	buf[HTTP_MAX_URL];
+    unsigned int sum, view;
+    struct stat	sbuf;
+
+    *key = *tag = 0;
+    if (request_get_method(server) != HTTP_GET)
+        return false;
+    page = pagelist_find_page(name);
+    if (page == NULL || !page_is_seen(page) || page_is_category(page) ||
+        page_is_dynamic(page))
+        return false;
+
+    user = user_get_logname();
+    view = get_checksum(CHECKSUM_START, page_find_title(user));
+    view = get_checksum(view, var_get_val(&server->variables,
+                                          VAR_CUTEWIKI_CATEGORY));
+    view = get_checksum(view, var_get_val(&server->variables,
+                                          VAR_CUTEWIKI_SEARCH));
+    sum = page_get_checksum(page);
+    sum = get_checksum(sum, user);
+    sum = get_checksum(sum, page_find_title(user));
+    sum = get_checksum(sum, var_get_val(&server->variables,
+                                        VAR_CUTEWIKI_CATEGORY));
+    sum = get_checksum(sum, var_get_val(&server->variables,
+                                        VAR_CUTEWIKI_SEARCH));
+
+    /* images are shown, if their file exists */
+    if (stat(wiki->imagedir, &sbuf) < 0)
+        sbuf.st_mtime = 0;
+
+    enc = "";
+    if (server->deflateLevel > 0) {
+        server->response.vary = true;
+        if (server->request.acceptEncoding & HTTP_ENC_GZIP)
+            enc = "-gz";
+        else if (server->request.acceptEncoding & HTTP_ENC_DEFLATE)
+            enc = "-df";
+    }
+
+    snprintf(key, PAGECACHE_KEY_LEN, "%s %d %s %x", name, mode, user, view);
+    snprintf(tag, PAGECACHE_TAG_LEN, "%x-%lx-%lx-%d", sum,
+             (long)wiki->starttime, (long)sbuf.st_mtime, mode);
+    snprintf(buf, HTTP_MAX_URL, "ETag: \"%s%s\"", tag, enc);
+    svr_add_header(server, buf);
+    if (http_check_match(server, buf + 6) == 0) {
+        svr_send_err304(server);
+        return true;
+    }
+    return false;
+}
+
+
+
+/*
+ * wiki_write_page - render a page or send it from the page cache
+ *
+ * Without a key from wiki_check_etag() the page is always rendered.
+ */
+static void
+wiki_write_page(char * name, int mode, char * key, char * tag)
+{
+    if (*key == 0) {
+        out_write_page(name, mode);
+        return;
+    }
+    if (pagecache_send(server, key, tag))
+        return;
+    pagecache_begin(server);
+    out_write_page(name, mode);
+    pagecache_end(server, key, tag, name);
+}
+
+
+
 /*
  * wiki_handle_get - show a wiki page in normal interactive form
  */
@@ -351,13 +465,15 @@ static void
 wiki_handle_page()
 {
     char* name;
+    char key[PAGECACHE_KEY_LEN];
+    char tag[PAGECACHE_TAG_LEN];
 
     if (!user_is_authenticated()) {
 	html_login_page();
 	return;
     }
 
-    if (var_get_val(server->variables, "logoff") != NULL) {
+    if (var_get_val(&server->variables, VAR_LOGOFF) != NULL) {
         user_logoff(server);
 	html_login_page();
 	return;
@@ -366,14 +482,15 @@ wiki_handle_page()
 
     name = wiki_get_pagename("/Wiki/");
     if (is_wikiword(name)) {
-	var_set(&server->variables, "page", name);
-	out_write_page(name, MODE_NORMAL);
+	var_put(&server->arena, &server->variables, VAR_PAGE, name);
+	if (!wiki_check_etag(name, MODE_NORMAL, key, tag))
+	    wiki_write_page(name, MODE_NORMAL, key, tag);
     } else {
         name = "StartPage";
         out_write_page(name, MODE_NORMAL);
         svr_set_response(server, "404");    /* not found */
     }
-    wiki->calls++;
+    __sync_fetch_and_add(&wiki->calls, 1);
 }
 
 
@@ -385,6 +502,8 @@ static void
 wiki_handle_print()
 {
     char* name;
+    char key[PAGECACHE_KEY_LEN];
+    char tag[PAGECACHE_TAG_LEN];
 
     if (!user_is_authenticated()) {
 	html_login_page();
@@ -395,13 +514,14 @@ wiki_handle_print()
 
     name = wiki_get_pagename("/Print/");
     if (is_wikiword(name)) {
-	var_set(&server->variables, "page", name);
-	out_write_page(name, MODE_PRINT);
+	var_put(&server->arena, &server->variables, VAR_PAGE, name);
+	if (!wiki_check_etag(name, MODE_PRINT, key, tag))
+	    wiki_write_page(name, MODE_PRINT, key, tag);
     } else {
 	svr_set_response(server, "404");    /* not found */
 	out_write_page("StartPage", MODE_NORMAL);
     }
-    wiki->calls++;
+    __sync_fetch_and_add(&wiki->calls, 1);
 }
 
 
@@ -424,13 +544,13 @@ wiki_handle_text()
 
     name = wiki_get_pagename("/Text/");
     if (is_wikiword(name)) {
-	var_set(&server->variables, "page", name);
+	var_put(&server->arena, &server->variables, VAR_PAGE, name);
 	out_write_page("SourcePage", MODE_ASCII);
     } else {
 	svr_set_response(server, "404");    /* not found */
 	out_write_page("StartPage", MODE_NORMAL);
     }
-    wiki->calls++;
+    __sync_fetch_and_add(&wiki->calls, 1);
 }
 
 
@@ -458,7 +578,7 @@ wiki_handle_rtf()
 	svr_set_response(server, "404");    /* not found */
 	out_write_page("StartPage", MODE_NORMAL);
     }
-    wiki->calls++;
+    __sync_fetch_and_add(&wiki->calls, 1);
 }
 
 
@@ -483,13 +603,13 @@ wiki_handle_hist()
 
     name = wiki_get_pagename("/History/");
     if (is_wikiword(name)) {
-	var_set(&server->variables, "page", name);
+	var_put(&server->arena, &server->variables, VAR_PAGE, name);
 	out_write_page("HistoryPage", MODE_NORMAL);
     } else {
 	svr_set_response(server, "404");    /* not found */
 	out_write_page("StartPage", MODE_NORMAL);
     }
-    wiki->calls++;
+    __sync_fetch_and_add(&wiki->calls, 1);
 }
 
 
@@ -514,13 +634,13 @@ wiki_handle_diff()
 
     name = wiki_get_pagename("/Diff/");
     if (is_wikiword(name)) {
-	var_set(&server->variables, "page", name);
+	var_put(&server->arena, &server->variables, VAR_PAGE, name);
 	out_write_page("DiffPage", MODE_NORMAL);
     } else {
 	svr_set_response(server, "404");    /* not found */
 	out_write_page("StartPage", MODE_NORMAL);
     }
-    wiki->calls++;
+    __sync_fetch_and_add(&wiki->calls, 1);
 }
 
 
@@ -546,13 +666,13 @@ wiki_handle_reverse()
 
     name = wiki_get_pagename("/Reverse/");
     if (is_wikiword(name)) {
-	var_set(&server->variables, "page", name);
+	var_put(&server->arena, &server->variables, VAR_PAGE, name);
 	out_write_page("ReversePage", MODE_NORMAL);
     } else {
 	svr_set_response(server, "404");    /* not found */
 	out_write_page("StartPage", MODE_NORMAL);
     }
-    wiki->calls++;
+    __sync_fetch_and_add(&wiki->calls, 1);
 }
 
 
@@ -578,13 +698,13 @@ wiki_handle_edit()
 
     name = wiki_get_pagename("/Edit/");
     if (is_wikiword(name)) {
-	var_set(&server->variables, "page", name);
+	var_put(&server->arena, &server->variables, VAR_PAGE, name);
 	out_write_page("EditPage", MODE_EDIT);
     } else {
 	svr_set_response(server, "404");    /* not found */
 	out_write_page("StartPage", MODE_NORMAL);
     }
-    wiki->calls++;
+    __sync_fetch_and_add(&wiki->calls, 1);
 }
 
 
@@ -606,7 +726,7 @@ wiki_handle_raw()
     /* get URI and decode it to ISO-8859-1 */
     name = wiki_get_pagename("/Page/");
     rep_out_page(name);
-    wiki->calls++;
+    __sync_fetch_and_add(&wiki->calls, 1);
 }
 
 
@@ -627,7 +747,7 @@ wiki_handle_meta()
     /* get URI and decode it to ISO-8859-1 */
     name = wiki_get_pagename("/Meta/");
     rep_out_meta(name);
-    wiki->calls++;
+    __sync_fetch_and_add(&wiki->calls, 1);
 }
 #endif
 
@@ -719,7 +839,7 @@ wiki_handle_save()
         return;
 
     /* If page was submitted, then try to save it */
-    name = var_get_val(server->variables, "page");
+    name = var_get_val(&server->variables, VAR_PAGE);
     if (name == NULL) {
 	out_write_error("406",  /* not acceptable */
 			"There is no page name in the POST data!",
@@ -735,7 +855,7 @@ wiki_handle_save()
     }
 
     /* if the text was empty, then delete the page */
-    text = var_get_val(server->variables, "text");
+    text = var_get_val(&server->variables, VAR_TEXT);
     if (text == NULL || strlen(text) == 0) {
 	if (page_del(pagelist_find_page(name))) {
 	    out_write_page("DeletePage", MODE_HTML);
@@ -744,16 +864,16 @@ wiki_handle_save()
     }
 
     user = user_get_logname();
-    title = var_get_val(server->variables, "title");
-    group = var_get_val(server->variables, "group");
-    type = var_get_val(server->variables, "pagetype");
-    topic = var_get_val(server->variables, "topic");
-    password = var_get_val(server->variables, "password");
-    userid = var_get_val(server->variables, "userid");
+    title = var_get_val(&server->variables, VAR_TITLE);
+    group = var_get_val(&server->variables, VAR_GROUP);
+    type = var_get_val(&server->variables, VAR_PAGETYPE);
+    topic = var_get_val(&server->variables, VAR_TOPIC);
+    password = var_get_val(&server->variables, VAR_PASSWORD);
+    userid = var_get_val(&server->variables, VAR_USERID);
 
-    seqno = var_get_int(server->variables, "seqno");
-    priv = var_get_bool(server->variables, "private");
-    hidden = var_get_bool(server->variables, "hidden");
+    seqno = var_get_int(&server->variables, VAR_SEQNO);
+    priv = var_get_bool(&server->variables, VAR_PRIVATE);
+    hidden = var_get_bool(&server->variables, VAR_HIDDEN);
 
     /* now really change the page, given all the data */
     saved = page_edit(name, title, text, topic, user, userid, password,
@@ -786,12 +906,12 @@ wiki_handle_pwreset()
         return;
 
     /* Handle password reset */
-    username = var_get_val(server->variables, "pwreset");
+    username = var_get_val(&server->variables, VAR_PWRESET);
     if (username != NULL && user_reset_password(username))
 	out_write_page(username, MODE_HTML);
     else
 	out_write_page("StartPage", MODE_HTML);
-    wiki->calls++;
+    __sync_fetch_and_add(&wiki->calls, 1);
 }
 
 static void
@@ -806,7 +926,7 @@ wiki_handle_search()
         return;
 
     out_write_page("SearchPage", MODE_NORMAL);
-    wiki->calls++;
+    __sync_fetch_and_add(&wiki->calls, 1);
 }
 
 
@@ -828,12 +948,12 @@ wiki_handle_support()
         return;
 
     /* Handle support bot */
-    question = var_get_val(server->variables, "question");
+    question = var_get_val(&server->variables, VAR_QUESTION);
     if (question != NULL)
 	out_write_page("SupportPage", MODE_HTML);
     else
 	out_write_page("StartPage", MODE_HTML);
-    wiki->calls++;
+    __sync_fetch_and_add(&wiki->calls, 1);
 }
 
 
@@ -853,21 +973,135 @@ wiki_handle_filter()
 
     /* unset the cookie and cutewiki-category variable */
     svr_expire_cookie(server, "cutewiki-category");
-    var_del(&server->variables, "cutewiki-category");
+    var_del(&server->variables, VAR_CUTEWIKI_CATEGORY);
 
     name = wiki_get_pagename("/FilterOff/");
     if (is_wikiword(name)) {
-	var_set(&server->variables, "page", name);
+	var_put(&server->arena, &server->variables, VAR_PAGE, name);
 	out_write_page("CategoryPage", MODE_NORMAL);
     } else {
 	svr_set_response(server, "404");    /* not found */
 	out_write_page("StartPage", MODE_NORMAL);
     }
-    wiki->calls++;
+    __sync_fetch_and_add(&wiki->calls, 1);
+}
+
+
+
+
+
+
+/*
+ * wiki_metrics_allowed - check, if the client is in metrics_allow
+ *
+ * A collector can not log in, so it is known by its address.
+ */
+static bool
+wiki_metrics_allowed()
+{
+    char	*cp = wiki->metrics_allow;
+    size_t	len;
+
+    while (*cp) {
+        len = strcspn(cp, " ,\t");
+        if (len > 0 && len == strlen(server->client_ip) &&
+            strncmp(cp, server->client_ip, len) == 0)
+            return true;
+        cp += len;
+        cp += strspn(cp, " ,\t");
+    }
+    return false;
 }
 
 
 
+/*
+ * wiki_handle_metrics - tell the counters of the server to a collector
+ */
+static void
+wiki_handle_metrics()
+{
+    if (!wiki_check_method(HTTP_GET))
+        return;
+
+    if (!wiki_metrics_allowed()) {
+        svr_send_err403(server);
+        return;
+    }
+
+    svr_set_contenttype(server, "text/plain; version=0.0.4");
+    metrics_write(server);
+    metrics_gauge(server, "cutewiki_pages", "Pages of the wiki.",
+                  pagelist_get_count());
+    metrics_gauge(server, "cutewiki_page_text_bytes",
+                  "Bytes of page names, titles, links and loaded texts.",
+                  pagelist_get_textbytes());
+    metrics_gauge(server, "cutewiki_start_time_seconds",
+                  "Start of the wiki since the epoch.", wiki->starttime);
+}
+
+
+
+/*
+ * wiki_handle_trace - give the recorded spans to an administrator
+ */
+static void
+wiki_handle_trace()
+{
+    if (!user_is_authenticated()) {
+	html_login_page();
+	return;
+    }
+
+    if (!wiki_check_method(HTTP_GET))
+        return;
+
+    if (!user_is_admin()) {
+        svr_send_err403(server);
+        return;
+    }
+    svr_set_contenttype(server, "application/json");
+    trace_write(server);
+}
+
+
+
+/*
+ * wiki_configure - pass the settings, that may change, to the server
+ */
+static void
+wiki_configure()
+{
+    wiki->description = cfg_check_str(wiki->cfg, "General", "description", true);
+    wiki->hostname = cfg_check_str(wiki->cfg, "General", "hostname", true);
+    wiki->metrics_allow = cfg_get_str(wiki->cfg, "General", "metrics_allow",
+                                      WIKI_METRICS_ALLOW);
+    svr_set_keepalive(server,
+                      cfg_check_int(wiki->cfg, "General", "keepalive_timeout",
+                                    HTTP_KEEPALIVE_TIMEOUT, false),
+                      cfg_check_int(wiki->cfg, "General", "keepalive_requests",
+                                    HTTP_KEEPALIVE_MAX, false));
+    svr_set_limits(server,
+                   cfg_check_int(wiki->cfg, "General", "header_timeout",
+                                 HTTP_HEADER_TIMEOUT, false),
+                   cfg_check_int(wiki->cfg, "General", "body_timeout",
+                                 HTTP_BODY_TIMEOUT, false),
+                   cfg_check_int(wiki->cfg, "General", "send_timeout",
+                                 HTTP_SEND_TIMEOUT, false),
+                   cfg_check_int(wiki->cfg, "General", "client_connections",
+                                 HTTP_CLIENT_MAX, false));
+    svr_set_cache(server,
+                  cfg_check_int(wiki->cfg, "Files", "cache_size",
+                                WIKI_CACHE_SIZE, false) * 1024,
+                  cfg_check_int(wiki->cfg, "Files", "cache_maxage",
+                                WIKI_CACHE_MAXAGE, false));
+    svr_set_compression(server,
+                        cfg_check_int(wiki->cfg, "General", "compression",
+                                      HTTP_DEFLATE_LEVEL, false));
+    pagecache_init(cfg_check_int(wiki->cfg, "General", "page_cache_size",
+                                 WIKI_PAGE_CACHE_SIZE, false) * 1024);
+    trace_set(cfg_check_int(wiki->cfg, "General", "trace", 0, false) != 0);
+}
 
 
 
@@ -875,6 +1109,8 @@ static void
 wiki_init(char * wikiname)
 {
     struct utsname name;
+    char * env;
+    int sock;
 
     /* First initialize general settings */
     wiki = malloc(sizeof(struct Wiki));
@@ -886,23 +1122,34 @@ wiki_init(char * wikiname)
         exit (1);
     }
 
-    /* Read in essential settings, exit if not set. */
+    /* Read in essential settings, exit if not set. Those, which can
+     * not change until the next start, outlive the configuration. */
     wiki->calls = 0;
-    wiki->description = cfg_check_str(wiki->cfg, "General", "description", true);
-    wiki->hostname = cfg_check_str(wiki->cfg, "General", "hostname", true);
-    wiki->port = cfg_check_int(wiki->cfg, "General","port", 8080, true);
-    wiki->filedir = cfg_check_str(wiki->cfg, "Files", "filedir", true);
-    wiki->imagedir = cfg_check_str(wiki->cfg, "Files", "imagedir", true);
-    wiki->pagedir = cfg_check_str(wiki->cfg, "Files", "pagedir", true);
-    wiki->accesslog = cfg_check_str(wiki->cfg, "Files", "accesslog", true);
-    wiki->errorlog = cfg_check_str(wiki->cfg, "Files", "errorlog", true);
+    wiki->fastcgi = cfg_get_str(wiki->cfg, "General", "fastcgi", NULL);
+    if (wiki->fastcgi) {
+        wiki->fastcgi = strdup(wiki->fastcgi);
+        fprintf(stderr, "Info:  In [General] fastcgi is %s!\n", wiki->fastcgi);
+    }
+    wiki->port = cfg_check_int(wiki->cfg, "General","port", 8080,
+                               wiki->fastcgi == NULL);
+    wiki->threads = cfg_check_int(wiki->cfg, "General","threads", 4, false);
+    if (wiki->threads < 1)
+        wiki->threads = 1;
+    wiki->processes = cfg_check_int(wiki->cfg, "General","processes", 1, false);
+    wiki->filedir = strdup(cfg_check_str(wiki->cfg, "Files", "filedir", true));
+    wiki->imagedir = strdup(cfg_check_str(wiki->cfg, "Files", "imagedir", true));
+    wiki->pagedir = strdup(cfg_check_str(wiki->cfg, "Files", "pagedir", true));
+    wiki->accesslog = strdup(cfg_check_str(wiki->cfg, "Files", "accesslog", true));
+    wiki->errorlog = strdup(cfg_check_str(wiki->cfg, "Files", "errorlog", true));
 
 #if 0
-    wiki->wordsdir = cfg_check_str(wiki->cfg, "Files", "wordsdir", true);
+    wiki->wordsdir = strdup(cfg_check_str(wiki->cfg, "Files", "wordsdir", true));
 #endif
 #if 0
     /* Iitialize replication settings */
-    wiki->repl_host = cfg_check_str(wiki->cfg, "Replication", "hostname", NULL);
+    wiki->repl_host = cfg_check_str(wiki->cfg, "Replication", "hostname", false);
+    if (wiki->repl_host)
+        wiki->repl_host = strdup(wiki->repl_host);
     wiki->repl_port = cfg_check_int(wiki->cfg, "Replication","port", 1);
     if (wiki->repl_port == 1) {
         fprintf(stderr, "Error: No Port specified in [Replication] section. Exiting!\n");
@@ -916,13 +1163,36 @@ wiki_init(char * wikiname)
     strncpy(wiki->release, name.release, 64);
     strncpy(wiki->machine, name.machine, 64);
 
-    /* Create a server instance and set it up */
-    server = svr_new(NULL, wiki->port);
+    /* The workers of several processes listen on their own, but
+     * inherit a Unix socket. After wiki_upgrade() the socket of the
+     * process before is taken over. */
+    sock = (wiki->processes > 1) ? HTTP_SHARED_PORT : HTTP_OWN_PORT;
+    env = getenv(WIKI_ENV_LISTEN);
+    if (env != NULL) {
+        if (wiki->processes > 1 && wiki->fastcgi == NULL) {
+            fprintf(stderr, "Error: The number of processes changes only with a restart!\n");
+            exit(1);
+        }
+        sock = atoi(env);
+        unsetenv(WIKI_ENV_LISTEN);
+    }
+    env = getenv(WIKI_ENV_READY);
+    wiki->readyFd = env ? atoi(env) : -1;
+    unsetenv(WIKI_ENV_READY);
+
+    /* Create a server instance and set it up, the counters are shared
+     * with the worker processes */
+    metrics_init();
+    if (wiki->fastcgi)
+        server = svr_new_fcgi(wiki->fastcgi, sock);
+    else
+        server = svr_new(NULL, wiki->port, sock);
     if (server == NULL) {
         perror("Can't create server");
         exit(1);
     }
     svr_set_filebase(server, wiki->pagedir);
+    wiki_configure();
     svr_set_errorlog(server, stderr);
     svr_set_accesslog(server, stdout);
 
@@ -938,6 +1208,14 @@ wiki_init(char * wikiname)
     else
 	svr_set_accesslog(server, wiki->accessfd);
 
+    /* several processes write the logs, each line must go at once */
+    if (wiki->processes > 1) {
+        if (wiki->errorfd)
+            setvbuf(wiki->errorfd, NULL, _IOLBF, 0);
+        if (wiki->accessfd)
+            setvbuf(wiki->accessfd, NULL, _IOLBF, 0);
+    }
+
     /* handle the different content */
     svr_register_dirhandler(server,"/", NULL, wiki_handle_page);
     svr_register_dirhandler(server,"/Wiki", NULL, wiki_handle_page);
@@ -961,6 +1239,25 @@ wiki_init(char * wikiname)
     svr_register_dir(server,"/Files", NULL, wiki->filedir);
     svr_register_dir(server,"/Images", NULL, wiki->imagedir);
     svr_register_filehandler(server,"/Files", "changes.rss", HTTP_FALSE, NULL, wiki_handle_rss);
+    svr_register_filehandler(server,"/", "Metrics", HTTP_FALSE, NULL, wiki_handle_metrics);
+    svr_register_filehandler(server,"/", "Trace", HTTP_FALSE, NULL, wiki_handle_trace);
+
+    /* these only read the pages and run at the same time */
+    svr_set_reader(server, "/", NULL);
+    svr_set_reader(server, "/Wiki", NULL);
+    svr_set_reader(server, "/Edit", NULL);
+    svr_set_reader(server, "/Reverse", NULL);
+    svr_set_reader(server, "/Print", NULL);
+    svr_set_reader(server, "/Text", NULL);
+    svr_set_reader(server, "/History", NULL);
+    svr_set_reader(server, "/Diff", NULL);
+    svr_set_reader(server, "/Richtext", NULL);
+    svr_set_reader(server, "/Search", NULL);
+    svr_set_reader(server, "/FilterOff", NULL);
+    svr_set_reader(server, "/Backup", NULL);
+    svr_set_reader(server, "/Files", "changes.rss");
+    svr_set_reader(server, "/", "Metrics");
+    svr_set_reader(server, "/", "Trace");
 
 #if 0
     svr_register_filehandler(server,"/Files", "allpages.tar", HTTP_FALSE, NULL, wiki_handle_tar);
@@ -969,19 +1266,26 @@ wiki_init(char * wikiname)
     svr_register_dirhandler(server,"/Meta", NULL, wiki_handle_meta);
 #endif
 
-    out = &htm;                /* set to normal HTML output */
-
     /* Avoid of crash, if too many requests are pending */
     signal(SIGPIPE, SIG_IGN);
 
 }
 
-static void
-wiki_loop()
+/*
+ * wiki_worker - serve connections with an own request context
+ */
+static void *
+wiki_worker(void * master)
 {
     struct timeval timeout;
     int    result;
 
+    server = svr_clone((httpd *) master);
+    if (server == NULL) {
+        fprintf(stderr, "Error: Can not create a worker context!\n");
+        return NULL;
+    }
+
     /* Go into our service loop */
     timeout.tv_sec = 15;
     timeout.tv_usec = 0;
@@ -1004,6 +1308,397 @@ wiki_loop()
         svr_process_request(server);
         svr_end_request(server);
     }
+
+    svr_del(server);
+    return NULL;
+}
+
+/*
+ * wiki_reload - read the configuration again
+ *
+ * The new one is swapped in, while no handler runs. The port or the
+ * FastCGI socket, the directories and the number of threads and
+ * processes stay, until the wiki is started again. The logs are
+ * opened again, so they can be rotated.
+ */
+static void
+wiki_reload()
+{
+    Config * cfg;
+    Config * old;
+
+    cfg = cfg_read_mycfg(wiki->wikiname);
+    if (cfg == NULL ||
+        cfg_check_str(cfg, "General", "description", false) == NULL ||
+        cfg_check_str(cfg, "General", "hostname", false) == NULL) {
+        fprintf(stderr, "Error: Keeping the configuration as it was!\n");
+        if (cfg)
+            cfg_del(cfg);
+        return;
+    }
+
+    svr_lock(server);
+    old = wiki->cfg;
+    wiki->cfg = cfg;
+    wiki_configure();
+    svr_unlock(server);
+    svr_reconfigure(server);
+    cfg_del(old);
+
+    log_reopen(wiki->errorfd, wiki->errorlog);
+    log_reopen(wiki->accessfd, wiki->accesslog);
+    fprintf(stderr, "Info:  Configuration '%s' read again.\n", wiki->wikiname);
+}
+
+
+
+/*
+ * wiki_ready - tell the process, that started us, we serve now
+ */
+static void
+wiki_ready()
+{
+    if (wiki->readyFd < 0)
+        return;
+    write(wiki->readyFd, "", 1);
+    close(wiki->readyFd);
+    wiki->readyFd = -1;
+}
+
+
+
+/*
+ * wiki_upgrade - start the program again, maybe a new version of it
+ *
+ * The new process gets the listening socket and an index of the
+ * pages, so it does not read the files of all pages. We serve on,
+ * until it is ready. From now on both note their page changes in the
+ * change log, so no change of the requests still running gets lost.
+ * Returns true, if the new process took over.
+ */
+static bool
+wiki_upgrade()
+{
+    char index[MAX_PATH];
+    char buf[16];
+    struct pollfd wait;
+    sigset_t signals;
+    int ready[2];
+    bool started = false;
+    bool saved;
+    pid_t pid;
+    long i;
+
+    snprintf(index, MAX_PATH, "%s/%s", wiki->pagedir, WIKI_INDEX_FILE);
+    svr_lock(server);
+    if (!pagelist_is_shared()) {
+        pagelist_share(pagelist_new_id());
+        svr_set_sync(server, pagelist_sync, pagelist_is_behind);
+        svr_reconfigure(server);
+    }
+    saved = pagelist_save_index(index);
+    svr_unlock(server);
+    if (!saved) {
+        fprintf(stderr, "Error: Can not write the page index %s!\n", index);
+        return false;
+    }
+    if (pipe(ready) < 0)
+        return false;
+
+    /* the child of a threaded process must not allocate memory */
+    if (server->serverSock >= 0) {
+        snprintf(buf, sizeof(buf), "%d", server->serverSock);
+        setenv(WIKI_ENV_LISTEN, buf, 1);
+    }
+    snprintf(buf, sizeof(buf), "%d", ready[1]);
+    setenv(WIKI_ENV_READY, buf, 1);
+    setenv(WIKI_ENV_INDEX, index, 1);
+    sigemptyset(&signals);
+
+    pid = fork();
+    if (pid == 0) {
+        /* the connections must be closed, when we are done with them */
+        for (i = sysconf(_SC_OPEN_MAX); i > 2; i--) {
+            if (i != ready[1] && i != server->serverSock)
+                close(i);
+        }
+        pthread_sigmask(SIG_SETMASK, &signals, NULL);
+        execvp(wiki->argv[0], wiki->argv);
+        _exit(1);
+    }
+    unsetenv(WIKI_ENV_LISTEN);
+    unsetenv(WIKI_ENV_READY);
+    unsetenv(WIKI_ENV_INDEX);
+    close(ready[1]);
+    if (pid < 0) {
+        perror("Can't start the new program");
+        close(ready[0]);
+        return false;
+    }
+
+    /* all processes, that will accept, close the pipe when ready */
+    wait.fd = ready[0];
+    wait.events = POLLIN;
+    while (poll(&wait, 1, WIKI_UPGRADE_TIMEOUT * 1000) > 0 &&
+           read(ready[0], buf, sizeof(buf)) > 0)
+        started = true;
+    close(ready[0]);
+    if (!started) {
+        fprintf(stderr, "Error: The new process %d did not start, serving on.\n", pid);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return false;
+    }
+    fprintf(stderr, "Info:  Process %d took over.\n", pid);
+    return true;
+}
+
+
+
+/*
+ * wiki_finish - let the running requests finish and stop
+ *
+ * No connection waits longer than its deadlines, but a handler may
+ * take its time.
+ */
+static void
+wiki_finish()
+{
+    int waited, max;
+
+    max = (server->keepAliveTimeout + server->bodyTimeout +
+           server->sendTimeout) * 10;
+    svr_stop(server);
+    for (waited = 0; svr_connections(server) > 0 && waited < max; waited++)
+        usleep(100000);
+    fprintf(stderr, "Info:  CuteWiki finished the running requests.\n");
+    exit(0);
+}
+
+
+
+/*
+ * wiki_save_trace - write the recorded spans next to the error log
+ *
+ * Each process writes its own file, named by its process id.
+ */
+static void
+wiki_save_trace()
+{
+    char path[MAX_PATH];
+
+    snprintf(path, MAX_PATH, "%s.%d.json", wiki->errorlog, (int) getpid());
+    if (trace_save(path))
+        fprintf(stderr, "Info:  Trace written to %s.\n", path);
+    else
+        fprintf(stderr, "Error: Can not write the trace to %s!\n", path);
+}
+
+
+
+/*
+ * wiki_loop - start the worker pool and wait for it
+ *
+ * The signals are only taken by this thread, so the lines still
+ * waiting for the log writer get written before the wiki stops.
+ * SIGHUP reads the configuration again, SIGQUIT stops after the
+ * running requests, SIGUSR1 writes the trace and SIGUSR2 hands over
+ * to a new program.
+ */
+static void
+wiki_loop()
+{
+    pthread_t * workers;
+    pthread_attr_t attr;
+    sigset_t signals;
+    int i, sig;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGQUIT);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if (svr_start(server) < 0) {
+        perror("Can't start server");
+        exit(1);
+    }
+
+    workers = malloc(wiki->threads * sizeof(pthread_t));
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WIKI_STACK_SIZE);
+
+    for (i = 0; i < wiki->threads; i++) {
+        if (pthread_create(&workers[i], &attr, wiki_worker, server) != 0) {
+            fprintf(stderr, "Error: Can not start worker thread %d!\n", i);
+            exit(1);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    wiki_ready();
+
+    while (1) {
+        sigwait(&signals, &sig);
+        if (sig == SIGHUP)
+            wiki_reload();
+        else if (sig == SIGQUIT)
+            wiki_finish();
+        else if (sig == SIGUSR1)
+            wiki_save_trace();
+        else if (sig == SIGUSR2) {
+            /* the master of several processes does it */
+            if (wiki->processes == 1 && wiki_upgrade())
+                wiki_finish();
+        }
+        else
+            break;
+    }
+    fprintf(stderr, "Info:  CuteWiki stopped by signal %d.\n", sig);
+    exit(0);        /* the logs are flushed at exit */
+}
+
+/*
+ * wiki_spawn - fork a worker process
+ *
+ * The worker opens its own socket on the port, the kernel spreads the
+ * connections over all of them. A FastCGI socket is shared instead.
+ * The worker inherits the pages as the master read them, and takes
+ * over all changes made since then.
+ */
+static pid_t
+wiki_spawn(int id)
+{
+    sigset_t signals;
+    pid_t pid;
+
+    pid = fork();
+    if (pid != 0) {
+        if (pid < 0)
+            perror("Can't start worker process");
+        return pid;
+    }
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGCHLD);
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+    pagelist_share(id);
+    if (svr_share_port(server) < 0) {
+        perror("Can't listen on the port");
+        exit(1);
+    }
+    wiki_loop();
+    exit(0);
+}
+
+/*
+ * wiki_prefork - serve the wiki with several processes
+ *
+ * The master only starts the workers and starts them again, if they
+ * die. Each worker runs the threads of wiki_loop(). Page changes are
+ * passed on by the change log of the page directory. The master takes
+ * them over every WIKI_COMPACT_INTERVAL seconds, so that new workers
+ * start with them, and starts a new log, when the old one grew too big.
+ * The signals of wiki_loop() are passed on to the workers, on SIGUSR2
+ * the workers of the new program listen on the port, before the old
+ * ones finish.
+ */
+static void
+wiki_prefork()
+{
+    pid_t * workers;
+    time_t * started;
+    sigset_t signals;
+    pid_t pid;
+    int i, sig;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGQUIT);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if (!pagelist_share(0)) {
+        fprintf(stderr, "Error: Can not write the change log in %s!\n", wiki->pagedir);
+        exit(1);
+    }
+    svr_set_sync(server, pagelist_sync, pagelist_is_behind);
+
+    /* the workers bind the port on their own */
+    if (wiki->fastcgi == NULL)
+        svr_close_port(server);
+    workers = calloc(wiki->processes, sizeof(pid_t));
+    started = calloc(wiki->processes, sizeof(time_t));
+    for (i = 0; i < wiki->processes; i++) {
+        started[i] = time(NULL);
+        workers[i] = wiki_spawn(pagelist_new_id());
+    }
+
+    /* the workers tell it, when they listen */
+    if (wiki->readyFd >= 0) {
+        close(wiki->readyFd);
+        wiki->readyFd = -1;
+    }
+
+    alarm(WIKI_COMPACT_INTERVAL);
+    while (1) {
+        sigwait(&signals, &sig);
+        if (sig == SIGALRM) {
+            pagelist_compact();
+            alarm(WIKI_COMPACT_INTERVAL);
+            continue;
+        }
+        if (sig == SIGHUP) {
+            wiki_reload();
+            for (i = 0; i < wiki->processes; i++)
+                kill(workers[i], SIGHUP);
+            continue;
+        }
+        if (sig == SIGUSR1) {
+            for (i = 0; i < wiki->processes; i++)
+                kill(workers[i], SIGUSR1);
+            continue;
+        }
+        if (sig == SIGUSR2) {
+            if (wiki_upgrade())
+                break;
+            continue;
+        }
+        if (sig != SIGCHLD)
+            break;
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            for (i = 0; i < wiki->processes; i++) {
+                if (workers[i] != pid)
+                    continue;
+                fprintf(stderr, "Warning: Worker process %d died, starting a new one.\n", pid);
+                if (started[i] == time(NULL))
+                    sleep(1);   /* do not spin, if it dies at once */
+                started[i] = time(NULL);
+                workers[i] = wiki_spawn(pagelist_new_id());
+            }
+        }
+    }
+
+    /* after an upgrade the workers finish their requests */
+    if (sig == SIGUSR2)
+        sig = SIGQUIT;
+    fprintf(stderr, "Info:  CuteWiki stopped by signal %d.\n", sig);
+    for (i = 0; i < wiki->processes; i++) {
+        if (workers[i] > 0)
+            kill(workers[i], sig == SIGQUIT ? SIGQUIT : SIGTERM);
+    }
+    for (i = 0; i < wiki->processes; i++) {
+        if (workers[i] > 0)
+            waitpid(workers[i], NULL, 0);
+    }
+    exit(0);
 }
 
 static void
@@ -1027,6 +1722,8 @@ wiki_exit()
 int
 main(int argc, char *argv[])
 {
+    char * index;
+
     if (argc != 2) {
         fprintf(stderr,"usage: cutewiki <wikiname> \n");
         exit(1);
@@ -1040,11 +1737,25 @@ main(int argc, char *argv[])
 
     //svr_init();
     wiki_init(argv[1]);
+    wiki->argv = argv;
     user_init();
     rcs_init();
-    pagelist_init(wiki->pagedir);
+
+    /* started by wiki_upgrade(), the process before serves on */
+    index = getenv(WIKI_ENV_INDEX);
+    pagelist_init(wiki->pagedir, index);
+    if (index != NULL) {
+        unsetenv(WIKI_ENV_INDEX);
+        if (wiki->processes == 1) {
+            pagelist_share(pagelist_new_id());
+            svr_set_sync(server, pagelist_compact, pagelist_is_behind);
+        }
+    }
     fprintf(stderr, "Info:  CuteWiki started with configuration '%s'.\n", wiki->wikiname);
-    wiki_loop();
+    if (wiki->processes > 1)
+        wiki_prefork();
+    else
+        wiki_loop();
     pagelist_exit();
     user_exit();
     wiki_exit();
@@ -39,7 +39,7 @@
 #define MAX_TIMELEN     128
 
 
-extern httpd	*server;        /* this is our webserver instance */
+extern __thread httpd	*server;        /* this worker's webserver instance */
 
 /*
  * Infos about one Image file
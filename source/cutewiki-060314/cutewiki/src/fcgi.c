@@ -0,0 +1,610 @@
+/*
+ * fcgi.c - the FastCGI responder for a front end on a Unix socket
+ *
+ * Copyright 2005 Martin Doering
+ *
+ * This file is distributed under the GPL, version 2 or at your
+ * option any later version.  See doc/license.txt for details.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "fcgi.h"
+#include "http.h"
+
+
+
+/*
+ * The reactor reads the records of a connection into raw. The params
+ * of a request are turned into an HTTP request in conn->in, the STDIN
+ * stream is its body, so the workers parse it like any other request.
+ * The response is cut into STDOUT records by fcgi_flush(), while the
+ * headers, the body and the file are sent.
+ *
+ * A connection carries one request at a time, a front end like nginx
+ * pools connections instead of multiplexing them. Further requests
+ * are refused with FCGI_CANT_MPX_CONN, as FCGI_MPXS_CONNS tells.
+ */
+
+/* the length of the body, filled in when STDIN has ended */
+#define	FCGI_LENGTH_HEADER	"Content-Length: 0000000000\r\n"
+#define	FCGI_LENGTH_DIGITS	10
+
+
+
+fcgiConn *
+fcgi_new(void)
+{
+    fcgiConn	*fcgi;
+
+    fcgi = malloc(sizeof(fcgiConn));
+    if (fcgi == NULL)
+        return NULL;
+    bzero(fcgi, sizeof(fcgiConn));
+    fcgi->rawSize = HTTP_READ_BUF_LEN;
+    fcgi->raw = malloc(fcgi->rawSize);
+    if (fcgi->raw == NULL) {
+        free(fcgi);
+        return NULL;
+    }
+    return fcgi;
+}
+
+
+
+void
+fcgi_del(fcgiConn *fcgi)
+{
+    free(fcgi->raw);
+    free(fcgi->params);
+    free(fcgi);
+}
+
+
+
+/*
+ * fcgi_header - put the header of a record in front of its content
+ */
+static void
+fcgi_header(char *dst, int type, int id, int len)
+{
+    dst[0] = FCGI_VERSION_1;
+    dst[1] = type;
+    dst[2] = (id >> 8) & 0xff;
+    dst[3] = id & 0xff;
+    dst[4] = (len >> 8) & 0xff;
+    dst[5] = len & 0xff;
+    dst[6] = 0;                 /* no padding */
+    dst[7] = 0;
+}
+
+
+
+/*
+ * fcgi_end_request - put an FCGI_END_REQUEST record into dst
+ *
+ * Returns the length of the record.
+ */
+static int
+fcgi_end_request(char *dst, int id, int status)
+{
+    fcgi_header(dst, FCGI_END_REQUEST, id, 8);
+    bzero(dst + FCGI_HEADER_LEN, 8);    /* the application status is 0 */
+    dst[FCGI_HEADER_LEN + 4] = status;
+    return FCGI_HEADER_LEN + 8;
+}
+
+
+
+/*
+ * fcgi_reply - answer a record, while no response is being sent
+ *
+ * The answers are small, a socket not taking them at once is given up.
+ */
+static int
+fcgi_reply(httpConn *conn, const char *rec, int len)
+{
+    int		sent;
+
+    while ((sent = write(conn->sock, rec, len)) < 0 && errno == EINTR)
+        ;
+    return (sent == len) ? 0 : -1;
+}
+
+
+
+/*
+ * fcgi_get_length - read the length of a name or value of a pair
+ */
+static char *
+fcgi_get_length(char *cp, char *last, int *len)
+{
+    unsigned char *ucp = (unsigned char *) cp;
+
+    if (cp >= last)
+        return NULL;
+    if ((*ucp & 0x80) == 0) {
+        *len = *ucp;
+        return cp + 1;
+    }
+    if (last - cp < 4)
+        return NULL;
+    *len = ((ucp[0] & 0x7f) << 24) | (ucp[1] << 16) | (ucp[2] << 8) | ucp[3];
+    return cp + 4;
+}
+
+
+
+/*
+ * fcgi_next_pair - read the next name-value pair of a stream
+ *
+ * Returns the position behind it or NULL at the end.
+ */
+static char *
+fcgi_next_pair(char *cp, char *last, char **name, int *nameLen,
+               char **value, int *valueLen)
+{
+    cp = fcgi_get_length(cp, last, nameLen);
+    if (cp != NULL)
+        cp = fcgi_get_length(cp, last, valueLen);
+    if (cp == NULL || *nameLen > last - cp ||
+        *valueLen > last - cp - *nameLen)
+        return NULL;
+    *name = cp;
+    *value = cp + *nameLen;
+    return *value + *valueLen;
+}
+
+
+
+/*
+ * fcgi_param - find a param of the request
+ */
+static char *
+fcgi_param(fcgiConn *fcgi, const char *key, int *len)
+{
+    char	*cp, *last, *name, *value;
+    int		nameLen, keyLen = strlen(key);
+
+    cp = fcgi->params;
+    last = cp + fcgi->paramsLen;
+    while ((cp = fcgi_next_pair(cp, last, &name, &nameLen,
+                                &value, len)) != NULL) {
+        if (nameLen == keyLen && memcmp(name, key, keyLen) == 0)
+            return value;
+    }
+    *len = 0;
+    return NULL;
+}
+
+
+
+/*
+ * fcgi_append - add bytes to a buffer
+ *
+ * A byte is kept free to terminate the request. Returns -1, if the
+ * buffer would grow beyond max.
+ */
+static int
+fcgi_append(char **buf, int *len, int *size, int max,
+            const char *data, int dataLen)
+{
+    char	*new;
+    int		newSize;
+
+    if (*len + dataLen >= *size) {
+        if (*len + dataLen >= max)
+            return -1;
+        newSize = *size ? *size : HTTP_READ_BUF_LEN;
+        while (newSize <= *len + dataLen)
+            newSize *= 2;
+        new = realloc(*buf, newSize);
+        if (new == NULL)
+            return -1;
+        *buf = new;
+        *size = newSize;
+    }
+    memcpy(*buf + *len, data, dataLen);
+    *len += dataLen;
+    return 0;
+}
+
+
+
+/*
+ * fcgi_add - add bytes to the request in conn->in
+ */
+static int
+fcgi_add(httpConn *conn, const char *data, int len)
+{
+    return fcgi_append(&conn->in, &conn->inLen, &conn->inSize,
+                       conn->headLen + HTTP_MAX_BODY, data, len);
+}
+
+
+
+/*
+ * fcgi_add_header - add a header line, that can not break the request
+ */
+static int
+fcgi_add_header(httpConn *conn, const char *name, int nameLen,
+                const char *value, int valueLen)
+{
+    char	*cp;
+    int		start = conn->inLen;
+
+    if (fcgi_add(conn, name, nameLen) < 0 || fcgi_add(conn, ": ", 2) < 0 ||
+        fcgi_add(conn, value, valueLen) < 0 || fcgi_add(conn, "\r\n", 2) < 0)
+        return -1;
+    for (cp = conn->in + start; cp < conn->in + conn->inLen - 2; cp++) {
+        if (*cp == '\r' || *cp == '\n')
+            *cp = ' ';
+        else if (cp < conn->in + start + nameLen && *cp == '_')
+            *cp = '-';
+    }
+    return 0;
+}
+
+
+
+/*
+ * fcgi_make_request - write the HTTP request the params stand for
+ *
+ * REQUEST_URI is the path as the client asked for it. The headers of
+ * the client are passed on as HTTP_* params.
+ */
+static int
+fcgi_make_request(httpConn *conn)
+{
+    fcgiConn	*fcgi = conn->fcgi;
+    char	*cp, *last, *name, *value, *method, *uri, *protocol;
+    int		nameLen, valueLen, methodLen, uriLen, protocolLen, len;
+
+    conn->inLen = 0;
+    method = fcgi_param(fcgi, "REQUEST_METHOD", &methodLen);
+    uri = fcgi_param(fcgi, "REQUEST_URI", &uriLen);
+    protocol = fcgi_param(fcgi, "SERVER_PROTOCOL", &protocolLen);
+    if (method == NULL || uri == NULL)
+        return -1;
+    if (protocol == NULL) {
+        protocol = "HTTP/1.0";
+        protocolLen = 8;
+    }
+    if (fcgi_add(conn, method, methodLen) < 0 || fcgi_add(conn, " ", 1) < 0 ||
+        fcgi_add(conn, uri, uriLen) < 0 || fcgi_add(conn, " ", 1) < 0 ||
+        fcgi_add(conn, protocol, protocolLen) < 0 ||
+        fcgi_add(conn, "\r\n", 2) < 0)
+        return -1;
+    for (cp = conn->in; cp < conn->in + conn->inLen - 2; cp++) {
+        if (*cp == '\r' || *cp == '\n')
+            *cp = ' ';
+    }
+
+    value = fcgi_param(fcgi, "REMOTE_ADDR", &valueLen);
+    len = (valueLen < HTTP_IP_ADDR_LEN) ? valueLen : HTTP_IP_ADDR_LEN - 1;
+    memcpy(conn->client_ip, value ? value : "", len);
+    conn->client_ip[len] = 0;
+
+    cp = fcgi->params;
+    last = cp + fcgi->paramsLen;
+    while ((cp = fcgi_next_pair(cp, last, &name, &nameLen,
+                                &value, &valueLen)) != NULL) {
+        if (nameLen == 12 && memcmp(name, "CONTENT_TYPE", 12) == 0) {
+            if (fcgi_add_header(conn, "Content-Type", 12,
+                                value, valueLen) < 0)
+                return -1;
+            continue;
+        }
+        if (nameLen <= 5 || memcmp(name, "HTTP_", 5) != 0 ||
+            (nameLen == 19 && memcmp(name, "HTTP_CONTENT_LENGTH", 19) == 0) ||
+            (nameLen == 17 && memcmp(name, "HTTP_CONTENT_TYPE", 17) == 0))
+            continue;
+        if (fcgi_add_header(conn, name + 5, nameLen - 5,
+                            value, valueLen) < 0)
+            return -1;
+    }
+
+    fcgi->lengthAt = conn->inLen + strlen(FCGI_LENGTH_HEADER) -
+        FCGI_LENGTH_DIGITS - 2;
+    if (fcgi_add(conn, FCGI_LENGTH_HEADER, strlen(FCGI_LENGTH_HEADER)) < 0 ||
+        fcgi_add(conn, "\r\n", 2) < 0)
+        return -1;
+    conn->headLen = conn->inLen;
+    fcgi->paramsLen = 0;
+    return 0;
+}
+
+
+
+/*
+ * fcgi_get_values - tell the front end, what the responder can do
+ */
+static int
+fcgi_get_values(httpConn *conn, char *content, int len)
+{
+    char	rec[FCGI_HEADER_LEN + 32];
+    char	*cp, *name, *value;
+    int		nameLen, valueLen, recLen = FCGI_HEADER_LEN;
+
+    cp = content;
+    while ((cp = fcgi_next_pair(cp, content + len, &name, &nameLen,
+                                &value, &valueLen)) != NULL) {
+        if (nameLen == 15 && memcmp(name, "FCGI_MPXS_CONNS", 15) == 0) {
+            rec[recLen++] = 15;
+            rec[recLen++] = 1;
+            memcpy(rec + recLen, "FCGI_MPXS_CONNS0", 16);
+            recLen += 16;
+            break;
+        }
+    }
+    fcgi_header(rec, FCGI_GET_VALUES_RESULT, 0, recLen - FCGI_HEADER_LEN);
+    return fcgi_reply(conn, rec, recLen);
+}
+
+
+
+/*
+ * fcgi_record - take a record of the connection
+ *
+ * Returns -1 if the connection is to be closed, 1 if the request is
+ * complete and 0 else.
+ */
+static int
+fcgi_record(httpConn *conn, int type, int id, char *content, int len)
+{
+    fcgiConn	*fcgi = conn->fcgi;
+    char	rec[FCGI_HEADER_LEN + 8];
+    char	digits[FCGI_LENGTH_DIGITS + 1];
+    int		role;
+
+    if (id == 0) {
+        /* management records concern the connection */
+        if (type == FCGI_GET_VALUES)
+            return fcgi_get_values(conn, content, len);
+        fcgi_header(rec, FCGI_UNKNOWN_TYPE, 0, 8);
+        bzero(rec + FCGI_HEADER_LEN, 8);
+        rec[FCGI_HEADER_LEN] = type;
+        return fcgi_reply(conn, rec, sizeof(rec));
+    }
+
+    switch (type) {
+    case FCGI_BEGIN_REQUEST:
+        if (len < 8)
+            return -1;
+        role = ((content[0] & 0xff) << 8) | (content[1] & 0xff);
+        if (fcgi->requestId != 0)
+            return fcgi_reply(conn, rec, fcgi_end_request(rec, id,
+                                                          FCGI_CANT_MPX_CONN));
+        if (role != FCGI_RESPONDER)
+            return fcgi_reply(conn, rec, fcgi_end_request(rec, id,
+                                                          FCGI_UNKNOWN_ROLE));
+        fcgi->requestId = id;
+        fcgi->keepConn = (content[2] & FCGI_KEEP_CONN) != 0;
+        fcgi->paramsLen = 0;
+        conn->inLen = 0;
+        conn->headLen = 0;
+        return 0;
+
+    case FCGI_ABORT_REQUEST:
+        if (id != fcgi->requestId)
+            return 0;
+        fcgi->requestId = 0;
+        conn->inLen = 0;
+        conn->headLen = 0;
+        if (fcgi_reply(conn, rec, fcgi_end_request(rec, id,
+                                                   FCGI_REQUEST_COMPLETE)) < 0)
+            return -1;
+        return fcgi->keepConn ? 0 : -1;
+
+    case FCGI_PARAMS:
+        if (id != fcgi->requestId || conn->headLen > 0)
+            return 0;
+        if (len > 0)
+            return fcgi_append(&fcgi->params, &fcgi->paramsLen,
+                               &fcgi->paramsSize, HTTP_MAX_LEN, content, len);
+        return fcgi_make_request(conn);
+
+    case FCGI_STDIN:
+        if (id != fcgi->requestId)
+            return 0;
+        if (conn->headLen == 0)
+            return -1;          /* the body before the params */
+        if (len > 0)
+            return fcgi_add(conn, content, len);
+        snprintf(digits, sizeof(digits), "%0*d", FCGI_LENGTH_DIGITS,
+                 conn->inLen - conn->headLen);
+        memcpy(conn->in + fcgi->lengthAt, digits, FCGI_LENGTH_DIGITS);
+        return 1;
+    }
+    return 0;                   /* FCGI_DATA is not used by responders */
+}
+
+
+
+/*
+ * fcgi_read - read the records the front end has sent so far
+ *
+ * Returns -1, if the connection was closed or broken.
+ */
+int
+fcgi_read(httpConn *conn)
+{
+    fcgiConn	*fcgi = conn->fcgi;
+    char	*new;
+    int		len;
+
+    while (1) {
+        if (fcgi->rawLen == fcgi->rawSize) {
+            if (fcgi->rawSize >= FCGI_MAX_RECORD)
+                return 0;       /* fcgi_complete() makes room */
+            new = realloc(fcgi->raw, fcgi->rawSize * 2);
+            if (new == NULL)
+                return -1;
+            fcgi->raw = new;
+            fcgi->rawSize *= 2;
+        }
+        len = read(conn->sock, fcgi->raw + fcgi->rawLen,
+                   fcgi->rawSize - fcgi->rawLen);
+        if (len > 0) {
+            fcgi->rawLen += len;
+            continue;
+        }
+        if (len == 0)
+            return -1;
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        return -1;
+    }
+}
+
+
+
+/*
+ * fcgi_complete - take the records received, until a request is complete
+ *
+ * Like svr_conn_complete(), it returns the length of the request in
+ * conn->in, 0 if more records are needed and -1 on errors.
+ */
+int
+fcgi_complete(httpConn *conn)
+{
+    fcgiConn	*fcgi = conn->fcgi;
+    unsigned char *head;
+    int		off = 0, len, padding, result = 0;
+
+    while (result == 0 && fcgi->rawLen - off >= FCGI_HEADER_LEN) {
+        head = (unsigned char *) fcgi->raw + off;
+        len = (head[4] << 8) | head[5];
+        padding = head[6];
+        if (head[0] != FCGI_VERSION_1)
+            return -1;
+        if (fcgi->rawLen - off < FCGI_HEADER_LEN + len + padding)
+            break;
+        result = fcgi_record(conn, head[1], (head[2] << 8) | head[3],
+                             fcgi->raw + off + FCGI_HEADER_LEN, len);
+        off += FCGI_HEADER_LEN + len + padding;
+    }
+    fcgi->rawLen -= off;
+    memmove(fcgi->raw, fcgi->raw + off, fcgi->rawLen);
+    if (result < 0)
+        return -1;
+    return (result > 0) ? conn->inLen : 0;
+}
+
+
+
+/*
+ * fcgi_fill - put the next part of the response into a record
+ *
+ * The headers, the body and the file are taken as they come. When
+ * all is sent, the end of the request follows. Returns 0, if there
+ * is nothing to send, and -1, if the file was truncated meanwhile.
+ */
+static int
+fcgi_fill(httpConn *conn)
+{
+    fcgiConn	*fcgi = conn->fcgi;
+    httpPart	*part;
+    char	*dst = fcgi->out + FCGI_HEADER_LEN;
+    int		len = 0, n;
+
+    n = conn->hdrLen - conn->hdrSent;
+    if (n > FCGI_MAX_CONTENT)
+        n = FCGI_MAX_CONTENT;
+    memcpy(dst, conn->hdr + conn->hdrSent, n);
+    conn->hdrSent += n;
+    len += n;
+
+    n = conn->outLen - conn->outSent;
+    if (n > FCGI_MAX_CONTENT - len)
+        n = FCGI_MAX_CONTENT - len;
+    memcpy(dst + len, conn->out + conn->outSent, n);
+    conn->outSent += n;
+    len += n;
+
+    while (conn->fileFd >= 0 && len < FCGI_MAX_CONTENT) {
+        part = &conn->parts[conn->partNext];
+        n = FCGI_MAX_CONTENT - len;
+        if (part->headLen > 0) {
+            if (n > part->headLen)
+                n = part->headLen;
+            memcpy(dst + len, conn->partHeads + part->head, n);
+            part->head += n;
+            part->headLen -= n;
+        }
+        else if (part->off < part->end) {
+            if (n > part->end - part->off)
+                n = part->end - part->off;
+            n = pread(conn->fileFd, dst + len, n, part->off);
+            if (n <= 0)
+                return -1;
+            part->off += n;
+        }
+        else {
+            if (++conn->partNext >= conn->partCount)
+                http_close_file(conn);
+            continue;
+        }
+        len += n;
+    }
+
+    if (len > 0) {
+        fcgi_header(fcgi->out, FCGI_STDOUT, fcgi->requestId, len);
+        fcgi->outLen = FCGI_HEADER_LEN + len;
+        return 1;
+    }
+    if (!fcgi->ended)
+        return 0;
+
+    /* an empty record ends the stream */
+    fcgi_header(fcgi->out, FCGI_STDOUT, fcgi->requestId, 0);
+    fcgi->outLen = FCGI_HEADER_LEN +
+        fcgi_end_request(fcgi->out + FCGI_HEADER_LEN, fcgi->requestId,
+                         FCGI_REQUEST_COMPLETE);
+    fcgi->ended = false;
+    fcgi->requestId = 0;
+    return 1;
+}
+
+
+
+/*
+ * fcgi_flush - send as much of the response as possible in records
+ *
+ * Only one record is kept, the rest of the response waits in the body
+ * or the spill file like for a slow client. Returns 1 if all was
+ * sent, 0 if the socket is full and -1 on errors.
+ */
+int
+fcgi_flush(httpConn *conn)
+{
+    fcgiConn	*fcgi = conn->fcgi;
+    ssize_t	len;
+
+    while (1) {
+        if (fcgi->outSent == fcgi->outLen) {
+            fcgi->outLen = fcgi->outSent = 0;
+            len = fcgi_fill(conn);
+            if (len <= 0)
+                return (len < 0) ? -1 : 1;
+        }
+        len = write(conn->sock, fcgi->out + fcgi->outSent,
+                    fcgi->outLen - fcgi->outSent);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (len <= 0)
+            return -1;
+        fcgi->outSent += len;
+    }
+}
@@ -0,0 +1,69 @@
+/*
+ * fcgi.h - the FastCGI responder for a front end on a Unix socket
+ *
+ * Copyright 2005 Martin Doering
+ *
+ * This file is distributed under the GPL, version 2 or at your
+ * option any later version.  See doc/license.txt for details.
+ */
+
+
+
+#ifndef FCGI_H
+#define FCGI_H
+
+#include "types.h"
+#include "http.h"
+
+
+#define	FCGI_VERSION_1		1
+#define	FCGI_HEADER_LEN		8
+#define	FCGI_MAX_CONTENT	65535
+#define	FCGI_MAX_RECORD		(FCGI_HEADER_LEN + FCGI_MAX_CONTENT + 255)
+
+/* record types */
+#define	FCGI_BEGIN_REQUEST	1
+#define	FCGI_ABORT_REQUEST	2
+#define	FCGI_END_REQUEST	3
+#define	FCGI_PARAMS		4
+#define	FCGI_STDIN		5
+#define	FCGI_STDOUT		6
+#define	FCGI_GET_VALUES		9
+#define	FCGI_GET_VALUES_RESULT	10
+#define	FCGI_UNKNOWN_TYPE	11
+
+#define	FCGI_RESPONDER		1	/* the only role taken */
+#define	FCGI_KEEP_CONN		1	/* flag of FCGI_BEGIN_REQUEST */
+
+/* protocol status of FCGI_END_REQUEST */
+#define	FCGI_REQUEST_COMPLETE	0
+#define	FCGI_CANT_MPX_CONN	1
+#define	FCGI_UNKNOWN_ROLE	3
+
+
+/* what a FastCGI connection needs besides the HTTP one */
+typedef struct fcgi_conn {
+    char	*raw;			/* records received */
+    int		rawLen;
+    int		rawSize;
+    char	*params;		/* the PARAMS stream of the request */
+    int		paramsLen;
+    int		paramsSize;
+    int		requestId;		/* being read or answered, 0 if none */
+    bool	keepConn;		/* the front end keeps the connection */
+    bool	ended;			/* the response is complete */
+    int		lengthAt;		/* Content-Length to fill in conn->in */
+    char	out[FCGI_HEADER_LEN + FCGI_MAX_CONTENT];	/* being sent */
+    int		outLen;
+    int		outSent;
+} fcgiConn;
+
+
+
+fcgiConn *fcgi_new (void);
+void	fcgi_del (fcgiConn*);
+int	fcgi_read (httpConn*);
+int	fcgi_complete (httpConn*);
+int	fcgi_flush (httpConn*);
+
+#endif
@@ -15,9 +15,12 @@
 
 
 #include <stdio.h>
+#include <sys/types.h>
+#include <sys/time.h>
 
 #include "types.h"
 #include "var.h"
+#include "timer.h"
 
 
 #define	LEVEL_NOTICE	"notice"
@@ -27,21 +30,44 @@
 #define	HTTP_PORT 		80
 //#define HTTP_MAX_LEN		10240*10
 #define HTTP_MAX_LEN		10240*100
+#define HTTP_MAX_BODY		(64*1024*1024)	/* largest request body accepted */
 #define HTTP_MAX_URL		1024
 #define HTTP_MAX_HEADERS	1024
 #define HTTP_MAX_AUTH		128
 #define	HTTP_IP_ADDR_LEN	17
 #define	HTTP_TIME_STRING_LEN	40
 #define	HTTP_READ_BUF_LEN	4096
+#define	HTTP_FLUSH_LEN		(256*1024)	/* send bigger bodies in parts */
+#define	HTTP_SPILL_LEN		(1024*1024)	/* unsent body kept in memory */
+#define	HTTP_SPILL_FILE		"/tmp/cutewiki.XXXXXX"
+#define	HTTP_CHUNK_HEAD		10		/* room for a chunk size line */
 #define	HTTP_ANY_ADDR		NULL
+#define	HTTP_OWN_PORT		-1	/* bind and listen on the port */
+#define	HTTP_SHARED_PORT	-2	/* only bind, the workers listen */
+#define	HTTP_KEEPALIVE_TIMEOUT	15	/* seconds an idle connection lives */
+#define	HTTP_KEEPALIVE_MAX	100	/* requests per connection */
+#define	HTTP_HEADER_TIMEOUT	10	/* seconds to send the headers */
+#define	HTTP_BODY_TIMEOUT	60	/* seconds to send the body */
+#define	HTTP_SEND_TIMEOUT	120	/* seconds to take the response */
+#define	HTTP_CLIENT_MAX		32	/* connections of one address */
+#define	HTTP_DEFLATE_LEVEL	6	/* zlib level for dynamic output */
+#define	HTTP_MAX_RANGES		8	/* parts of a Range request */
 
 #define	HTTP_GET		1
 #define	HTTP_POST		2
+#define	HTTP_HEAD		3
+
+/* content codings */
+#define	HTTP_ENC_UNKNOWN	-1	/* decided with the first byte */
+#define	HTTP_ENC_NONE		0
+#define	HTTP_ENC_GZIP		1
+#define	HTTP_ENC_DEFLATE	2
 
 #define	HTTP_TRUE		1
 #define HTTP_FALSE		0
 
 #define HTTP_METHOD_ERROR "\n<B>ERROR : Method Not Implemented</B>\n\n"
+#define HTTP_ENCODING_ERROR "\n<B>ERROR : Transfer-Encoding Not Implemented</B>\n\n"
 
 
 
@@ -53,13 +79,19 @@ typedef struct http_content{
     char 	*data;
     char  	*path;
     int		(*preload)();
+    bool	reader;			/* only reads the shared state */
     struct	http_content 	*next;
 } httpContent;
 
 typedef struct {
-    int	length;
+    off_t	length;
+    off_t	contentLength;		/* given by the handler, -1 if unknown */
+    int	modTime;
+    int	encoding;		/* HTTP_ENC_* of the body */
     httpContent	*content;
+    struct http_route *route;	/* NULL if none was found */
     bool utf8;
+    bool vary;			/* body depends on Accept-Encoding */
     bool headersSent;
     char headers[HTTP_MAX_HEADERS];
     char response[HTTP_MAX_URL];
@@ -67,6 +99,18 @@ typedef struct {
 } httpRes;
 
 
+/* registered content, compiled for the lookup by path */
+typedef struct http_route {
+    char	*key;			/* directory or path of an entry */
+    int		len;
+    unsigned int hash;
+    bool	isDir;
+    httpContent	*entry;			/* the entry or the wildcard */
+    httpContent	*index;			/* index entry of a directory */
+    unsigned long hits;
+    struct metrics_route *metrics;
+} httpRoute;
+
 typedef struct http_dir{
     char	*name;
     struct	http_dir *children;
@@ -75,35 +119,140 @@ typedef struct http_dir{
 } httpDir;
 
 
+/* a byte range as asked for, resolved with the size of the file */
+typedef struct {
+    off_t	first;			/* -1 for the last bytes */
+    off_t	last;			/* -1 up to the end, else included */
+} httpRange;
+
 typedef	struct {
     int		method;
+    int		version;		/* 10 for HTTP/1.0, 11 for HTTP/1.1 */
+    bool	keepAlive;		/* client wants a persistent connection */
+    int		acceptEncoding;		/* HTTP_ENC_* bits the client takes */
     int 	contentLength;
+    bool	transferEncoding;	/* body in chunks, not supported */
     int 	authLength;
-    char	path[HTTP_MAX_URL];
-    char  	userAgent[HTTP_MAX_URL];
-    char   	referer[HTTP_MAX_URL];
-    char   	ifModified[HTTP_MAX_URL];
-    char   	contentType[HTTP_MAX_URL];
+    char	*path;			/* the values point into the request */
+    char  	*userAgent;
+    char   	*referer;
+    char   	*ifModified;
+    char   	*ifNoneMatch;
+    char   	*ifRange;
+    char   	*contentType;
+    int		rangeCount;		/* 0 sends the whole file */
+    httpRange	ranges[HTTP_MAX_RANGES];
     char   	authUser[HTTP_MAX_AUTH];
     char   	authPassword[HTTP_MAX_AUTH];
-    time_t      starttime;
+    struct timeval started;		/* for time measurement */
 } httpReq;
 
+/* connection states */
+#define	HTTP_CONN_READ		1	/* reading the request */
+#define	HTTP_CONN_BUSY		2	/* a worker handles the request */
+#define	HTTP_CONN_WRITE		3	/* sending the response */
+
+/* what the timer of a connection waits for */
+#define	HTTP_WAIT_IDLE		1	/* the next request */
+#define	HTTP_WAIT_HEADER	2	/* the rest of the headers */
+#define	HTTP_WAIT_BODY		3	/* the rest of the body */
+#define	HTTP_WAIT_SEND		4	/* the client taking the response */
+
+/* a part of the file sent after the body */
+typedef struct {
+    off_t	off;			/* next byte to send */
+    off_t	end;
+    int		head;			/* its header in partHeads */
+    int		headLen;
+} httpPart;
+
+typedef struct http_conn {
+    int		sock;
+    int		state;
+    char	client_ip[HTTP_IP_ADDR_LEN];
+    char	*in;			/* bytes received */
+    int		inLen;
+    int		inSize;
+    int		scanned;		/* searched for the end of headers */
+    int		headLen;		/* length of the request headers */
+    int		reqLen;			/* length of the complete request */
+    int		bodyPending;		/* body bytes not yet read */
+    char	saved;			/* byte behind the request */
+    int		requests;		/* number of requests served */
+    bool	keepAlive;		/* keep it open after the response */
+    unsigned int addr;			/* of the client, for its limit */
+    Timer	timer;			/* deadline kept by the reactor */
+    int		waiting;		/* HTTP_WAIT_* of the timer */
+    unsigned long deadline;		/* http_clock() a worker gives up */
+    char	hdr[HTTP_MAX_HEADERS * 4];	/* response headers */
+    int		hdrLen;
+    int		hdrSent;
+    char	*out;			/* response body to be sent */
+    int		outLen;
+    int		outSize;
+    int		outSent;
+    int		outKept;		/* left over by the last partial send */
+    bool	chunked;		/* body is sent in chunks */
+    int		chunkStart;		/* offset of the open chunk */
+    bool	broken;			/* client went away while sending */
+    int		fileFd;			/* file sent after the body or -1 */
+    int		spillFd;		/* body the client did not take or -1 */
+    off_t	spillLen;
+    httpPart	parts[HTTP_MAX_RANGES + 1];	/* and the end of a multipart */
+    int		partCount;
+    int		partNext;		/* the part being sent */
+    char	*partHeads;		/* headers of the parts of a multipart */
+    struct fcgi_conn *fcgi;		/* FastCGI state, NULL for HTTP */
+    struct	http_conn *next;		/* in the queues of the reactor */
+    struct	http_conn *prevConn;		/* list of all connections */
+    struct	http_conn *nextConn;
+} httpConn;
+
+struct http_reactor;
+struct z_stream_s;
+
 typedef struct {
     int		port;
     int 	serverSock;
     int 	clientSock;
     int 	readBufRemain;
     int 	startTime;
+    int		keepAliveTimeout;
+    int		keepAliveMax;
+    int		headerTimeout;
+    int		bodyTimeout;
+    int		sendTimeout;
+    int		clientMax;		/* connections of one address */
+    int		cacheMaxAge;		/* seconds clients keep static files */
+    int		deflateLevel;		/* 0 switches compression off */
+    int		generation;		/* counts the changes of the settings */
     char	client_ip[HTTP_IP_ADDR_LEN];
     char 	fileBasePath[HTTP_MAX_URL];
-    char 	readBuf[HTTP_READ_BUF_LEN + 1];
     char 	*host;
+    char	*fcgiPath;		/* Unix socket of FastCGI or NULL */
     char 	*readBufPtr;
+    bool	clone;
+    struct z_stream_s *zstream;		/* compressor of the worker */
+    int		zstreamEnc;
+    char	*utfBuf;		/* UTF-8 text before compression */
+    int		utfSize;
+    char	*copy;			/* of the body, see http_copy_body() */
+    int		copyLen;		/* -1 if it failed */
+    int		copySize;
+    bool	copying;
+    httpConn	*conn;			/* connection of the request */
+    struct http_reactor *reactor;
+    void	(*sync)();		/* run before the handlers */
+    bool	(*behind)();		/* true, if sync has work to do */
     httpReq	request;
     httpRes 	response;
-    Var*        variables;
+    Vars        variables;
+    Arena	arena;			/* freed at the end of the request */
     httpDir	*content;
+    httpRoute	*routes;		/* hash table of the content */
+    httpRoute	**routeList;		/* the routes sorted by path */
+    int		routeMask;
+    int		routeCount;
     FILE	*accessLog;
     FILE	*errorLog;
 } httpd;
@@ -111,17 +260,27 @@ typedef struct {
 
 
 /* prototypes */
-void 	http_to_utf (char *, const char *);
+int 	http_to_utf (char *, const char *, int);
 char*	http_escape (char*);
 
-void 	http_send_headers (httpd*, int,int);
+void 	http_send_headers (httpd*, off_t, int);
+void 	http_build_headers (httpd*, off_t);
+void 	http_end_response (httpd*);
+int 	http_flush (httpConn*);
 void 	http_send_file (httpd*, char*);
+bool 	http_check_range (httpd*, char*, int);
+void 	http_send_range (httpd*, char*);
+void 	http_close_file (httpConn*);
 void 	http_store_data (httpd*, char*);
 
-int 	http_read_buf (httpd*, char*, int);
-int 	http_read_char (httpd*, char*);
-int 	http_read_line (httpd*, char*, int);
+void 	http_write (httpd*, const char*, int);
+void 	http_write_utf (httpd*, const char*, int);
+void 	http_copy_body (httpd*, bool);
+int 	http_read_body (httpd*, char*, int);
+unsigned long http_clock (void);
 int 	http_check_modified (httpd*, int);
+int 	http_check_match (httpd*, char*);
+int 	http_check_cached (httpd*, char*, int);
 
 
 
@@ -0,0 +1,257 @@
+/*
+ * log.c - write the access and error log from a background thread
+ *
+ * The workers put their lines into a ring of slots without taking a
+ * lock.  A writer thread takes them out in order, adds the date it
+ * formats once a second and writes them in batches.
+ *
+ * Copyright 2005 Martin Doering
+ *
+ * This file is distributed under the GPL, version 2 or at your
+ * option any later version.  See doc/license.txt for details.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "types.h"
+#include "log.h"
+
+
+
+#define	LOG_MAX_FILES		4		/* flushed after a batch */
+
+typedef struct {
+    volatile unsigned long seq;		/* turn of the slot */
+    FILE	*fp;
+    time_t	when;
+    int		type;
+    int		headLen;		/* text before the date */
+    char	text[LOG_LINE_LEN];
+} LogSlot;
+
+static LogSlot log_ring[LOG_SLOTS];
+static volatile unsigned long log_head;	/* next slot to fill */
+static unsigned long log_tail;		/* next slot to write */
+static volatile bool log_running;
+
+/* the writer's side, it is only entered by one thread at a time */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static time_t log_dateTime[2] = { -1, -1 };
+static char log_date[2][40];
+
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+
+
+/*
+ * log_init - number the slots for their first turn
+ */
+static void
+log_init(void)
+{
+    unsigned long i;
+
+    for (i = 0; i < LOG_SLOTS; i++)
+	log_ring[i].seq = i;
+    atexit(log_flush);
+}
+
+
+
+/*
+ * log_get_date - the date of a line, formatted once a second
+ */
+static char *
+log_get_date(int type, time_t when)
+{
+    struct tm	timeBuf;
+
+    if (log_dateTime[type] != when) {
+	localtime_r(&when, &timeBuf);
+	strftime(log_date[type], sizeof(log_date[type]),
+		 type == LOG_ACCESS ? "%d/%b/%Y:%T %Z" : "%a %b %d %T %Y",
+		 &timeBuf);
+	log_dateTime[type] = when;
+    }
+    return log_date[type];
+}
+
+
+
+/*
+ * log_flush - write all lines put into the ring so far
+ */
+void
+log_flush(void)
+{
+    LogSlot	*slot;
+    FILE	*files[LOG_MAX_FILES];
+    int		count = 0, i;
+
+    pthread_mutex_lock(&log_lock);
+    while (1) {
+	slot = &log_ring[log_tail & (LOG_SLOTS - 1)];
+	if ((long)(slot->seq - (log_tail + 1)) < 0)
+	    break;                      /* not yet filled */
+	__sync_synchronize();
+
+	fwrite(slot->text, 1, slot->headLen, slot->fp);
+	fprintf(slot->fp, "[%s] ", log_get_date(slot->type, slot->when));
+	fputs(slot->text + slot->headLen, slot->fp);
+	for (i = 0; i < count && files[i] != slot->fp; i++)
+	    ;
+	if (i == count) {
+	    if (count == LOG_MAX_FILES)
+		fflush(files[--count]);
+	    files[count++] = slot->fp;
+	}
+
+	__sync_synchronize();
+	slot->seq = log_tail + LOG_SLOTS;
+	log_tail++;
+    }
+    for (i = 0; i < count; i++)
+	fflush(files[i]);
+    pthread_mutex_unlock(&log_lock);
+}
+
+
+
+/*
+ * log_writer - write the lines in batches
+ */
+static void *
+log_writer(void *arg)
+{
+    struct timespec	pause;
+
+    pause.tv_sec = 0;
+    pause.tv_nsec = LOG_INTERVAL * 1000000L;
+    while (1) {
+	log_flush();
+	nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+
+
+/*
+ * log_start - start the writer thread
+ *
+ * Until it runs, log_line() writes the lines itself.
+ */
+int
+log_start(void)
+{
+    pthread_t	thread;
+
+    pthread_once(&log_once, log_init);
+    if (log_running)
+	return 0;
+    if (pthread_create(&thread, NULL, log_writer, NULL) != 0)
+	return -1;
+    pthread_detach(thread);
+    log_running = true;
+    return 0;
+}
+
+
+
+/*
+ * log_line - queue a line for a log file
+ *
+ * The date of the line is written between head and the formatted
+ * text.  If the ring is full, the caller waits for the writer.
+ */
+void
+log_line(FILE *fp, int type, const char *head, const char *format, ...)
+{
+    LogSlot	*slot;
+    unsigned long pos;
+    long	diff;
+    va_list	args;
+    int		len;
+
+    if (fp == NULL)
+	return;
+    pthread_once(&log_once, log_init);
+
+    /* take the next free slot */
+    pos = log_head;
+    while (1) {
+	slot = &log_ring[pos & (LOG_SLOTS - 1)];
+	diff = (long)(slot->seq - pos);
+	if (diff == 0) {
+	    if (__sync_bool_compare_and_swap(&log_head, pos, pos + 1))
+		break;
+	}
+	else if (diff < 0) {
+	    /* the ring is full */
+	    if (log_running)
+		usleep(1000);
+	    else
+		log_flush();
+	}
+	pos = log_head;
+    }
+
+    slot->fp = fp;
+    slot->type = type;
+    slot->when = time(NULL);
+    len = snprintf(slot->text, LOG_LINE_LEN - 1, "%s", head);
+    if (len > LOG_LINE_LEN - 2)
+	len = LOG_LINE_LEN - 2;
+    slot->headLen = len;
+    va_start(args, format);
+    len += vsnprintf(slot->text + len, LOG_LINE_LEN - 1 - len, format, args);
+    va_end(args);
+    if (len > LOG_LINE_LEN - 2)
+	len = LOG_LINE_LEN - 2;
+    slot->text[len++] = '\n';
+    slot->text[len] = 0;
+
+    /* hand it to the writer */
+    __sync_synchronize();
+    slot->seq = pos + 1;
+
+    if (!log_running)
+	log_flush();
+}
+
+
+
+/*
+ * log_reopen - let a log go to the file at path again
+ *
+ * After the file was moved away, the following lines start a new
+ * one. The stream stays the same, so the lines in the ring still
+ * find it.
+ */
+int
+log_reopen(FILE *fp, const char *path)
+{
+    int		fd;
+
+    if (fp == NULL)
+	return -1;
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+	return -1;
+
+    pthread_mutex_lock(&log_lock);
+    fflush(fp);
+    dup2(fd, fileno(fp));
+    pthread_mutex_unlock(&log_lock);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,34 @@
+/*
+ * log.h - write the access and error log from a background thread
+ *
+ * Copyright 2005 Martin Doering
+ *
+ * This file is distributed under the GPL, version 2 or at your
+ * option any later version.  See doc/license.txt for details.
+ */
+
+
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+
+
+#define	LOG_SLOTS		1024		/* lines waiting, power of 2 */
+#define	LOG_LINE_LEN		1280
+#define	LOG_INTERVAL		100		/* ms between writes */
+
+/* kinds of lines, they differ in the date format */
+#define	LOG_ACCESS		0
+#define	LOG_ERROR		1
+
+
+
+int	log_start (void);
+void	log_line (FILE*, int, const char*, const char*, ...)
+		__attribute__ ((format (printf, 4, 5)));
+void	log_flush (void);
+int	log_reopen (FILE*, const char*);
+
+#endif
@@ -29,7 +29,7 @@ write_category(const char * name)
     char* category;
 
     /* Handle the hidden category setting */
-    category = var_get_val(server->variables, "cutewiki-category");
+    category = var_get_val(&server->variables, VAR_CUTEWIKI_CATEGORY);
     svr_puts(server, "<input type=\"hidden\" name=\"category\" value=\"");
     xml_puts(category);
     svr_puts(server, "\">\n");
@@ -68,7 +68,7 @@ write_search()
     char* searchstring;
 
     /* Handle search form data */
-    searchstring = var_get_val(server->variables, "cutewiki-search");
+    searchstring = var_get_val(&server->variables, VAR_CUTEWIKI_SEARCH);
     svr_printf(server, "<input type=\"text\" size=\"30\" name=\"cutewiki-search\" value=\"");
     xml_puts(searchstring);
 
@@ -0,0 +1,283 @@
+/*
+ * metrics.c - counters and latency histograms of the server
+ *
+ * The requests of each route, the static file and page caches and the RCS
+ * commands are counted as they happen, with atomic additions only.
+ * The counters live in memory shared by the worker processes, so
+ * any process tells the numbers of all. They are written in the
+ * text format of Prometheus.
+ *
+ * Copyright 2005 Martin Doering
+ *
+ * This file is distributed under the GPL, version 2 or at your
+ * option any later version.  See doc/license.txt for details.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+
+#include "types.h"
+#include "http.h"
+#include "svr.h"
+#include "metrics.h"
+
+
+
+static Metrics	metrics_local;		/* if memory can not be shared */
+Metrics		*metrics = &metrics_local;
+
+/* the routes by their slot, given out in the order of the route
+ * table, which is the same in all processes */
+static char	*metrics_keys[METRICS_MAX_ROUTES] = { "-" };
+static int	metrics_routes = 1;
+
+static char	*metrics_commands[METRICS_RCS_COMMANDS] =
+{ "ci", "rlog", "rcsdiff" };
+
+
+
+/*
+ * metrics_init - put the counters into memory shared with children
+ *
+ * Must be called before the worker processes are started.
+ */
+void
+metrics_init()
+{
+    Metrics	*shared;
+
+#ifdef MAP_ANONYMOUS
+    shared = mmap(NULL, sizeof(Metrics), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared != MAP_FAILED)
+        metrics = shared;
+#endif
+}
+
+
+
+/*
+ * metrics_route - give the counters of a route
+ *
+ * Routes beyond METRICS_MAX_ROUTES are counted with those requests,
+ * which have no route.
+ */
+MetricsRoute *
+metrics_route(char * key)
+{
+    if (metrics_routes == METRICS_MAX_ROUTES)
+        return &metrics->routes[0];
+    metrics_keys[metrics_routes] = key;
+    return &metrics->routes[metrics_routes++];
+}
+
+
+
+/*
+ * metrics_bucket - find the bucket of a time
+ */
+static int
+metrics_bucket(unsigned long usec)
+{
+    int		shift;
+
+    if (usec < (1UL << METRICS_MIN_SHIFT))
+        return 0;
+    shift = sizeof(long) * 8 - 1 - __builtin_clzl(usec);
+    if (shift >= METRICS_MAX_SHIFT)
+        return METRICS_BUCKETS - 1;
+    return ((shift - METRICS_MIN_SHIFT) << METRICS_SUB_BITS) +
+        ((usec >> (shift - METRICS_SUB_BITS)) &
+         ((1 << METRICS_SUB_BITS) - 1)) + 1;
+}
+
+
+
+/*
+ * metrics_bound - the upper bound of a bucket in microseconds
+ */
+static unsigned long
+metrics_bound(int bucket)
+{
+    int		shift, sub;
+
+    if (bucket == 0)
+        return 1UL << METRICS_MIN_SHIFT;
+    bucket--;
+    shift = METRICS_MIN_SHIFT + (bucket >> METRICS_SUB_BITS);
+    sub = bucket & ((1 << METRICS_SUB_BITS) - 1);
+    return ((1UL << METRICS_SUB_BITS) + sub + 1) <<
+        (shift - METRICS_SUB_BITS);
+}
+
+
+
+/*
+ * metrics_time - count a time in microseconds
+ */
+void
+metrics_time(MetricsHist * hist, long usec)
+{
+    if (usec < 0)
+        usec = 0;
+    __sync_fetch_and_add(&hist->buckets[metrics_bucket(usec)], 1);
+    __sync_fetch_and_add(&hist->usecs, usec);
+    __sync_fetch_and_add(&hist->count, 1);
+}
+
+
+
+/*
+ * metrics_since - the microseconds passed since a time
+ */
+long
+metrics_since(struct timeval * since)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - since->tv_sec) * 1000000L +
+        now.tv_usec - since->tv_usec;
+}
+
+
+
+/*
+ * metrics_request - count a request with its status and duration
+ *
+ * Route is NULL, if the request found none.
+ */
+void
+metrics_request(MetricsRoute * route, int status, long usec, off_t bytes)
+{
+    if (route == NULL)
+        route = &metrics->routes[0];
+    status /= 100;
+    if (status < 1 || status > 5)
+        status = 0;
+    __sync_fetch_and_add(&metrics->status[status], 1);
+    __sync_fetch_and_add(&route->bytes, bytes);
+    metrics_time(&route->time, usec);
+}
+
+
+
+/*
+ * metrics_write_hist - write the lines of a histogram
+ */
+static void
+metrics_write_hist(httpd * server, char * name, char * label,
+                   MetricsHist * hist)
+{
+    unsigned long sum = 0, bound;
+    int		i;
+
+    for (i = 0; i < METRICS_BUCKETS - 1; i++) {
+        sum += hist->buckets[i];
+        bound = metrics_bound(i);
+        svr_printf(server, "%s_bucket{%s,le=\"%lu.%06lu\"} %lu\n", name,
+                   label, bound / 1000000, bound % 1000000, sum);
+    }
+    svr_printf(server, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, label,
+               sum + hist->buckets[i]);
+    svr_printf(server, "%s_sum{%s} %lu.%06lu\n", name, label,
+               hist->usecs / 1000000, hist->usecs % 1000000);
+    svr_printf(server, "%s_count{%s} %lu\n", name, label, hist->count);
+}
+
+
+
+/*
+ * metrics_write - write all counters of the server
+ *
+ * Routes and commands show up after their first use.
+ */
+void
+metrics_write(httpd * server)
+{
+    char	label[HTTP_MAX_URL + 16];
+    int		i;
+
+    svr_puts(server,
+             "# HELP cutewiki_request_duration_seconds Time from reading "
+             "a request to the end of its handler.\n"
+             "# TYPE cutewiki_request_duration_seconds histogram\n");
+    for (i = 0; i < metrics_routes; i++) {
+        if (metrics->routes[i].time.count == 0)
+            continue;
+        snprintf(label, sizeof(label), "route=\"%s\"", metrics_keys[i]);
+        metrics_write_hist(server, "cutewiki_request_duration_seconds",
+                           label, &metrics->routes[i].time);
+    }
+
+    svr_puts(server,
+             "# HELP cutewiki_response_bytes_total Bytes of the response "
+             "bodies.\n"
+             "# TYPE cutewiki_response_bytes_total counter\n");
+    for (i = 0; i < metrics_routes; i++) {
+        if (metrics->routes[i].time.count == 0)
+            continue;
+        svr_printf(server, "cutewiki_response_bytes_total{route=\"%s\"} %lu\n",
+                   metrics_keys[i], metrics->routes[i].bytes);
+    }
+
+    svr_puts(server,
+             "# HELP cutewiki_responses_total Responses by the class of "
+             "their status.\n"
+             "# TYPE cutewiki_responses_total counter\n");
+    for (i = 1; i <= 5; i++)
+        svr_printf(server, "cutewiki_responses_total{code=\"%dxx\"} %lu\n",
+                   i, metrics->status[i]);
+
+    svr_printf(server,
+               "# HELP cutewiki_cache_hits_total Static files sent from "
+               "memory.\n"
+               "# TYPE cutewiki_cache_hits_total counter\n"
+               "cutewiki_cache_hits_total %lu\n"
+               "# HELP cutewiki_cache_misses_total Static files not in "
+               "memory.\n"
+               "# TYPE cutewiki_cache_misses_total counter\n"
+               "cutewiki_cache_misses_total %lu\n",
+               metrics->cacheHits, metrics->cacheMisses);
+
+    svr_printf(server,
+               "# HELP cutewiki_page_cache_hits_total Pages sent as they "
+               "were rendered before.\n"
+               "# TYPE cutewiki_page_cache_hits_total counter\n"
+               "cutewiki_page_cache_hits_total %lu\n"
+               "# HELP cutewiki_page_cache_misses_total Pages rendered, "
+               "which could have been kept.\n"
+               "# TYPE cutewiki_page_cache_misses_total counter\n"
+               "cutewiki_page_cache_misses_total %lu\n",
+               metrics->pageHits, metrics->pageMisses);
+
+    svr_puts(server,
+             "# HELP cutewiki_rcs_duration_seconds Time of the RCS "
+             "commands run.\n"
+             "# TYPE cutewiki_rcs_duration_seconds histogram\n");
+    for (i = 0; i < METRICS_RCS_COMMANDS; i++) {
+        if (metrics->rcs[i].count == 0)
+            continue;
+        snprintf(label, sizeof(label), "command=\"%s\"", metrics_commands[i]);
+        metrics_write_hist(server, "cutewiki_rcs_duration_seconds",
+                           label, &metrics->rcs[i]);
+    }
+}
+
+
+
+/*
+ * metrics_gauge - write a value of the moment
+ */
+void
+metrics_gauge(httpd * server, char * name, char * help, unsigned long value)
+{
+    svr_printf(server, "# HELP %s %s\n# TYPE %s gauge\n%s %lu\n",
+               name, help, name, name, value);
+}
@@ -0,0 +1,73 @@
+/*
+ * metrics.h - counters and latency histograms of the server
+ *
+ * Copyright 2005 Martin Doering
+ *
+ * This file is distributed under the GPL, version 2 or at your
+ * option any later version.  See doc/license.txt for details.
+ */
+
+
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <sys/time.h>
+
+#include "types.h"
+#include "http.h"
+
+
+/* The buckets of a histogram are log-linear: each power of two from
+ * 2^METRICS_MIN_SHIFT to 2^METRICS_MAX_SHIFT microseconds is split in
+ * 2^METRICS_SUB_BITS equal parts. One bucket below and one above. */
+#define	METRICS_SUB_BITS	1
+#define	METRICS_MIN_SHIFT	7		/* 128 us */
+#define	METRICS_MAX_SHIFT	24		/* 16.8 s */
+#define	METRICS_BUCKETS		(((METRICS_MAX_SHIFT - METRICS_MIN_SHIFT) \
+				  << METRICS_SUB_BITS) + 2)
+
+#define	METRICS_MAX_ROUTES	64		/* routes counted apart */
+
+/* the RCS commands run */
+#define	METRICS_RCS_CI		0
+#define	METRICS_RCS_RLOG	1
+#define	METRICS_RCS_RCSDIFF	2
+#define	METRICS_RCS_COMMANDS	3
+
+
+typedef struct {
+    unsigned long	count;
+    unsigned long	usecs;		/* sum of the times */
+    unsigned long	buckets[METRICS_BUCKETS];
+} MetricsHist;
+
+typedef struct metrics_route {
+    MetricsHist		time;
+    unsigned long	bytes;		/* of the response bodies */
+} MetricsRoute;
+
+/* all counters, shared by the processes of a server */
+typedef struct {
+    MetricsRoute	routes[METRICS_MAX_ROUTES];	/* 0 without a route */
+    unsigned long	status[6];	/* by the first digit, 0 if none */
+    unsigned long	cacheHits;
+    unsigned long	cacheMisses;
+    unsigned long	pageHits;	/* rendered pages sent again */
+    unsigned long	pageMisses;
+    MetricsHist		rcs[METRICS_RCS_COMMANDS];
+} Metrics;
+
+extern Metrics	*metrics;
+
+
+
+void	metrics_init (void);
+MetricsRoute *metrics_route (char*);
+void	metrics_time (MetricsHist*, long);
+long	metrics_since (struct timeval*);
+void	metrics_request (MetricsRoute*, int, long, off_t);
+void	metrics_write (httpd*);
+void	metrics_gauge (httpd*, char*, char*, unsigned long);
+
+#endif
@@ -14,8 +14,14 @@
 #include <unistd.h>
 #include <time.h>
 #include <sys/time.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "cutewiki.h"
+#include "misc.h"
 
 
 
@@ -30,6 +36,25 @@ get_time ()
 
 
 
+/*
+ * get_checksum - add a string to a running FNV-1a sum
+ *
+ * Start with CHECKSUM_START. A NULL string is summed up differently
+ * than an empty one.
+ */
+unsigned int
+get_checksum(unsigned int sum, const char * str)
+{
+    if (str == NULL)
+        return (sum ^ 0xff) * 16777619u;
+
+    while (*str)
+        sum = (sum ^ (unsigned char)*str++) * 16777619u;
+    return (sum ^ 0xfe) * 16777619u;
+}
+
+
+
 /*
  * Get full path of image file
  */
@@ -259,12 +284,100 @@ xml_putc(char ch)
 void
 xml_puts(char * str)
 {
-    if (str != NULL) {
-        char ch;
+    if (str != NULL)
+        xml_putsn(str, strlen(str));
+}
 
-        while ((ch = *str++)) {
-            xml_putc(ch);
-        }
+
+
+/* the chars xml_putc() does not just copy */
+static const char xml_special[256] = {
+    ['&'] = 1, ['\"'] = 1, ['<'] = 1, ['>'] = 1, ['%'] = 1, [0x0d] = 1
+};
+
+
+
+/*
+ * xml_plain - count the chars at the start, which need no escaping
+ *
+ * With SSE2 or AVX2 16 or 32 chars are looked at in one go, the rest
+ * char by char.
+ */
+static int
+xml_plain(const char * str, int len)
+{
+    int		i = 0;
+
+#if defined(__AVX2__)
+    const __m256i amp = _mm256_set1_epi8('&');
+    const __m256i quot = _mm256_set1_epi8('\"');
+    const __m256i lt = _mm256_set1_epi8('<');
+    const __m256i gt = _mm256_set1_epi8('>');
+    const __m256i pct = _mm256_set1_epi8('%');
+    const __m256i cr = _mm256_set1_epi8(0x0d);
+    __m256i	v, hit;
+    unsigned int mask;
+
+    for (; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (str + i));
+        hit = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, quot)),
+            _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, lt), _mm256_cmpeq_epi8(v, gt)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, pct), _mm256_cmpeq_epi8(v, cr))));
+        mask = _mm256_movemask_epi8(hit);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#elif defined(__SSE2__)
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i quot = _mm_set1_epi8('\"');
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i pct = _mm_set1_epi8('%');
+    const __m128i cr = _mm_set1_epi8(0x0d);
+    __m128i	v, hit;
+    unsigned int mask;
+
+    for (; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (str + i));
+        hit = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, quot)),
+            _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+                _mm_or_si128(_mm_cmpeq_epi8(v, pct), _mm_cmpeq_epi8(v, cr))));
+        mask = _mm_movemask_epi8(hit);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < len; i++)
+        if (xml_special[(unsigned char) str[i]])
+            break;
+    return i;
+}
+
+
+
+/*
+ * xml_putsn - outputs len characters of a string to the server
+ *
+ * Runs of chars needing no escaping are sent at once.
+ */
+void
+xml_putsn(char * str, int len)
+{
+    int		run;
+
+    while (len > 0) {
+        run = xml_plain(str, len);
+        if (run > 0)
+            svr_write(server, str, run);
+        if (run == len)
+            break;
+        xml_putc(str[run]);     /* the special char ending the run */
+        str += run + 1;
+        len -= run + 1;
     }
 }
 
@@ -16,15 +16,19 @@
 
 #include "types.h"
 
+#define CHECKSUM_START	2166136261u	/* FNV-1a offset basis */
+
 
 
 /* Misc functions */
 int             get_time();
 bool		is_image(char * image);
 bool            is_wikiword(const char* tptr);
+unsigned int	get_checksum(unsigned int sum, const char * str);
 void 		convert_to_wikiword(char * string);
 char*		make_spaced_title(const char* title);
 void            xml_putc(char ch);
 void            xml_puts(char * str);
+void            xml_putsn(char * str, int len);
 
 #endif
@@ -23,12 +23,12 @@
 #include "misc.h"
 
 
-/* Avoid passing it all the time */
-
-static int numfoot;                 	/* counted number of footnotes */
-static char * footnote [100];		/* pointer to footnotes */
-static int tableheader = 0;		/* header or normal table row */
-static int indentlevel = 0;
+/* Avoid passing it all the time, each thread writes its own page */
+static __thread int numfoot;		/* counted number of footnotes */
+static __thread Footnote * footnotes;	/* list of the footnotes */
+static __thread Footnote ** lastnote;	/* set by html_page_header() */
+static __thread int tableheader = 0;	/* header or normal table row */
+static __thread int indentlevel = 0;
 
 /* internal prototypes */
 void	html_ruler_begin();
@@ -56,18 +56,29 @@ html_puts(char * str)
 }
 
 
+
+/*
+ * html_putsn - outputs len characters of a string to the server
+ */
+void
+html_putsn(char * str, int len)
+{
+    xml_putsn(str, len);
+}
+
+
 static void
 html_footnotes()
 {
     int i;
+    Footnote *note;
 
     html_ruler_begin();
 
     svr_puts(server, "<div class=\"footnotes\">\n");
-    for (i=1; i<=numfoot; i++) {
+    for (i=1, note=footnotes; note; i++, note=note->next) {
         svr_printf(server, "<a name=\"%d\">[%d]</a> ", i, i);
-        html_puts(footnote[i]);
-        free(footnote[i]);
+        html_puts(note->text);
         svr_puts(server, "<br>\n");
     }
     svr_puts(server, "</div>\n");
@@ -89,6 +100,8 @@ void
 html_page_header(Page * page, int mode)
 {
     numfoot = 0;        /* reset footnote counter */
+    footnotes = NULL;
+    lastnote = &footnotes;
     char * topic = page_get_topic(page);
     char * topictitle = page_find_title(topic);
     char * name = page_get_name(page);
@@ -195,7 +208,7 @@ html_page_footer(Page * page, int mode)
 
     svr_puts(server, "<i>");
     if (mode == MODE_EDIT) {
-	char* title = var_get_val(server->variables, "page");
+	char* title = var_get_val(&server->variables, VAR_PAGE);
 #if GERMAN
 	svr_printf(server, "<b>Sie bearbeiten die Wiki-Seite \'%s\'</b>", title);
 #else
@@ -203,7 +216,7 @@ html_page_footer(Page * page, int mode)
 #endif
     }
     else if (mode == MODE_ASCII) {
-	char* title = var_get_val(server->variables, "page");
+	char* title = var_get_val(&server->variables, VAR_PAGE);
 #if GERMAN
 	svr_printf(server, "<b>Der Quelltext der Wiki-Seite \'%s\'</b>", title);
 #else
@@ -373,7 +386,13 @@ html_Footnote(char * note)
     html_puts(note);
     svr_printf(server, "\" href=\"#%d\">[%d]</a></sup>", numfoot, numfoot);
 
-    footnote[numfoot] = strdup(note);
+    /* the notes are listed at the end of the page */
+    *lastnote = arena_alloc(&server->arena, sizeof(Footnote));
+    if (*lastnote) {
+        (*lastnote)->text = arena_strdup(&server->arena, note);
+        (*lastnote)->next = NULL;
+        lastnote = &(*lastnote)->next;
+    }
 }
 
 void
@@ -590,6 +609,7 @@ html_image(char * image)
 Output htm = {
     html_putc,
     html_puts,
+    html_putsn,
     html_page_header,
     html_page_footer,
     html_ParaBegin,
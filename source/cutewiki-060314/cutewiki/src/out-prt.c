@@ -23,12 +23,13 @@
 
 /* Avoid passing it all the time */
 
-/* Footnotes */
-static int numfoot;                 /* counted number of footnotes */
-static char * footnote [100];       /* pointer to footnotes */
+/* Footnotes, each thread writes its own page */
+static __thread int numfoot;		/* counted number of footnotes */
+static __thread Footnote * footnotes;	/* list of the footnotes */
+static __thread Footnote ** lastnote;	/* set by print_page_header() */
 
-static int tableheader = 0;     /* header or normal table row */
-static int indentlevel = 0;
+static __thread int tableheader = 0;	/* header or normal table row */
+static __thread int indentlevel = 0;
 
 
 /* internal prototypes */
@@ -55,18 +56,29 @@ print_puts(char * str)
 }
 
 
+
+/*
+ * print_putsn - outputs len characters of a string to the server
+ */
+void
+print_putsn(char * str, int len)
+{
+    xml_putsn(str, len);
+}
+
+
 static void
 print_footnotes()
 {
     int i;
+    Footnote *note;
 
     print_ruler_begin();
 
     svr_puts(server, "<div class=\"footnotes\">\n");
-    for (i=1; i<=numfoot; i++) {
+    for (i=1, note=footnotes; note; i++, note=note->next) {
         svr_printf(server, "<a name=\"%d\">[%d]</a> ", i, i);
-        print_puts(footnote[i]);
-        free(footnote[i]);
+        print_puts(note->text);
         svr_puts(server, "<br>\n");
     }
     svr_puts(server, "</div>\n");
@@ -89,6 +101,8 @@ void
 print_page_header(Page * page, int mode)
 {
     numfoot = 0;        /* reset footnote counter */
+    footnotes = NULL;
+    lastnote = &footnotes;
     char * topic = page_get_topic(page);
     char * topictitle = page_find_title(topic);
 //    char * name = page_get_name(page);
@@ -312,7 +326,14 @@ print_footnote(char * note)
     svr_puts(server, "<sup><a class=\"footnote\" title=\"");
     print_puts(note);
     svr_printf(server, "\" href=\"#%d\">[%d]</a></sup>", numfoot, numfoot);
-    footnote[numfoot] = strdup(note);
+
+    /* the notes are listed at the end of the page */
+    *lastnote = arena_alloc(&server->arena, sizeof(Footnote));
+    if (*lastnote) {
+        (*lastnote)->text = arena_strdup(&server->arena, note);
+        (*lastnote)->next = NULL;
+        lastnote = &(*lastnote)->next;
+    }
 }
 
 void
@@ -480,6 +501,7 @@ print_image(char * image)
 Output prt = {
     print_putc,
     print_puts,
+    print_putsn,
     print_page_header,
     print_page_footer,
     print_ParaBegin,
@@ -24,8 +24,8 @@
  * so that a reader of an RSS feed does not get the whole page
  * to read - therefore he get's a link.  :-)
  */
-bool ready;		/* true, when first paragraph printed */
-bool first_heading;      /* print just the first heading */
+__thread bool ready;		/* true, when first paragraph printed */
+__thread bool first_heading;      /* print just the first heading */
 
 
 /*
@@ -86,6 +86,20 @@ rss_puts(char * str)
 
 
 
+/*
+ * rss_putsn - outputs len characters of a string to the server
+ */
+void
+rss_putsn(char * str, int len)
+{
+    if (!ready) {
+	while (len-- > 0)
+	    rss_putc(*str++);
+    }
+}
+
+
+
 /*
  * rss_PageHeader
  *
@@ -328,6 +342,7 @@ rss_image(char * image)
 Output rss = {
     rss_putc,
     rss_puts,
+    rss_putsn,
     rss_page_header,
     rss_page_footer,
     rss_ParaBegin,
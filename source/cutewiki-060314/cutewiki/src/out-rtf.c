@@ -37,14 +37,15 @@ enum TextModes
 };
 
 
-static int cellcnt;             /* cell count in one table row */
-static int textmode = NORM;
-static int blockindent = 0;
+/* each thread writes its own page */
+static __thread int cellcnt;             /* cell count in one table row */
+static __thread int textmode = NORM;
+static __thread int blockindent = 0;
 
-static int listindent = 0;
-static int listnum[5] = {0,0,0,0,0};         /* save state for different indent levels */
-static int listmode[5] = {NORM, NORM, NORM, NORM, NORM};         /* save state for different indent levels */
-static int tablehead = 0;
+static __thread int listindent = 0;
+static __thread int listnum[5] = {0,0,0,0,0};         /* save state for different indent levels */
+static __thread int listmode[5] = {NORM, NORM, NORM, NORM, NORM};         /* save state for different indent levels */
+static __thread int tablehead = 0;
 
 
 
@@ -91,6 +92,20 @@ rtf_puts(char * str)
         }
     }
 }
+
+
+
+/*
+ * rtf_putsn - outputs len characters of a string to the server
+ */
+void
+rtf_putsn(char * str, int len)
+{
+    while (len-- > 0)
+        rtf_putc(*str++);
+}
+
+
 /*
  * rtf_Puts - outputs a string to the server
  */
@@ -648,6 +663,7 @@ rtf_image(char * image)
 Output rtf = {
     rtf_putc,
     rtf_puts,
+    rtf_putsn,
     rtf_page_header,
     rtf_page_footer,
     rtf_ParaBegin,
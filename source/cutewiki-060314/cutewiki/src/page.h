@@ -21,6 +21,9 @@
  */
 typedef struct Page Page;
 
+/* the text of a page parsed for output, see parser.c */
+typedef struct parse_code ParseCode;
+
 typedef enum
 {
     PT_NORMAL,  		/* page is a normal wiki page */
@@ -62,6 +65,9 @@ struct Page
     /* information which is not saved */
     char*       editor;         /* person who loaded an editform */
     time_t	edittime;	/* the time the form was load */
+    bool	dynamic;	/* has macros or lists */
+    ParseCode *	code;		/* parsed text, until it changes */
+    int		textusers;	/* readers of the loaded text */
 };
 #endif
 
@@ -83,6 +89,9 @@ bool		page_check_password (Page * page, char * password);
 void		page_set_password(Page * self, const char * password);
 char *		page_get_groupname(Page * self);
 char* 		page_get_text(Page * page);
+size_t		page_get_textsize(Page * page);
+ParseCode *	page_get_code(Page * self);
+void		page_set_code(Page * self, ParseCode * code);
 time_t		page_get_time(Page * self);
 bool            page_get_textfilename(Page * self, char * fn);
 bool		page_get_rcsfilename(Page * self, char * fn);
@@ -102,9 +111,13 @@ bool		page_is_edited(Page * self);
 bool            page_is_saveable(Page * self, int seqno);
 bool            page_is_seen(Page * self);
 bool		page_is_category(Page * self);
+bool		page_is_dynamic(Page * self);
+unsigned int	page_get_checksum(Page * self);
 
 bool		page_has_changed(Page * self);
 bool            page_save_meta(Page * page);
+bool		page_output_index(Page * page, FILE* file);
+Page *		page_input_index(FILE* file);
 bool 		page_edit(const char* name, const char* title,
 			  const char* text, const char * topic,
 			  const char* owner, const char* userid,
@@ -112,6 +125,7 @@ bool 		page_edit(const char* name, const char* title,
 			  const char * pagetype,
 			  int seqno, bool private, bool hidden);
 bool 		page_load_text(Page * page, bool* loaded);
+void		page_reload(Page * page, int seqno);
 bool 		page_unload_text(Page* page, bool loaded);
 bool		page_load_meta(Page* page);
 void		page_scan_links(Page* page);
@@ -12,6 +12,9 @@
 #include <dirent.h>
 #include <fnmatch.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
 
 #define PAGE_PRIVATE
 
@@ -22,12 +25,26 @@
 #include "create.h"
 #include "parser.h"
 #include "misc.h"
+#include "pagecache.h"
 
 
 /* Variable for all Pages */
 static Hash * pagetab;
 char* pagepath;
 
+/* the change log shared by the processes of the wiki */
+static int	changes_fd = -1;
+static off_t	changes_read;		/* taken over so far */
+static int	changes_id;		/* marks the own entries */
+static int	changes_next = 1;	/* first id not given out */
+static bool	changes_kept;		/* the log goes on from an index */
+static bool	changes_indexed;	/* an index points into the log */
+
+#define CHANGES_FILE	".changes"
+#define CHANGES_NEXT	"0 N"		/* the log goes on in a new file */
+#define CHANGES_MAX	(1024*1024)	/* bytes before a new log is started */
+#define INDEX_MAGIC	"cutewiki-index 1"
+
 
 
 static int
@@ -155,9 +172,12 @@ pagelist_insert_page (const char* name, int flags)
 	page = (Page*)hash_find(pagetab, name);
 	if (page == NULL) {
 	    page = page_new(name, flags);
-	    if (page)
+	    if (page) {
 		/* insert the new page into the page table */
 		hash_insert(pagetab, page->name, page);
+		/* links to it are no longer broken */
+		pagecache_drop_linking(page->name);
+	    }
 	}
         return page;
     }
@@ -173,6 +193,8 @@ pagelist_insert_page (const char* name, int flags)
 bool
 pagelist_remove_page (const char* name)
 {
+    pagecache_drop(name);
+    pagecache_drop_linking(name);
     return hash_remove(pagetab, name);
 }
 
@@ -600,6 +622,40 @@ pagelist_get_usedmemory()
 
 
 
+/*
+ * pagelist_get_textbytes - count the bytes of the strings of all pages
+ *
+ * Names, titles, owners, links and the texts loaded at the moment.
+ */
+size_t
+pagelist_get_textbytes()
+{
+    Page ** list = pagelist();
+    size_t bytes = 0;
+    size_t i, j;
+
+    if (list == NULL)
+        return bytes;
+
+    for (i = 0; list[i] != NULL; i++) {
+        Page * page = list[i];
+
+        bytes += strlen(page->name) + 1;
+        if (page->title != NULL)
+            bytes += strlen(page->title) + 1;
+        if (page->owner != NULL)
+            bytes += strlen(page->owner) + 1;
+        bytes += page_get_textsize(page);
+        for (j = 0; j < page->linkcnt; j++)
+            bytes += strlen(page->links[j]) + 1;
+    }
+    free(list);
+
+    return bytes;
+}
+
+
+
 size_t
 pagelist_get_useddisk()
 {
@@ -659,11 +715,105 @@ load_wiki_file(struct dirent *dirent, char * dirpath)
 
 
 
+/*
+ * pagelist_load_index - take the pages from an index
+ *
+ * The index is written by the process running before, which goes on
+ * to note its changes in the change log. They are taken over from
+ * the position it had read so far.
+ */
+static void
+pagelist_load_index(const char* fn)
+{
+    char	buf[1024];
+    char	name[MAX_WIKINAME];
+    long	offset;
+    int		next;
+    size_t	count = 0;
+    FILE *	file;
+
+    file = fopen(fn, "r");
+    if (file == NULL ||
+        fgets(buf, (int)sizeof(buf), file) == NULL ||
+        strncmp(buf, INDEX_MAGIC "\n", sizeof(INDEX_MAGIC)) != 0 ||
+        fgets(buf, (int)sizeof(buf), file) == NULL ||
+        sscanf(buf, "changes: %ld %d", &offset, &next) != 2) {
+        fprintf(stderr, "Error: Can not read the page index %s!\n", fn);
+        exit(1);
+    }
+
+    /* create all pages first, the groups point to them */
+    while (fgets(buf, (int)sizeof(buf), file)) {
+        if (sscanf(buf, "page: %255s", name) == 1) {
+            pagelist_insert_page(name, 0);
+            count++;
+        }
+    }
+
+    rewind(file);
+    fgets(buf, (int)sizeof(buf), file);
+    fgets(buf, (int)sizeof(buf), file);
+    while (count > 0 && page_input_index(file) != NULL)
+        count--;
+    fclose(file);
+    if (count > 0) {
+        fprintf(stderr, "Error: The page index %s is broken!\n", fn);
+        exit(1);
+    }
+
+    changes_read = offset;
+    changes_next = next;
+    changes_kept = true;
+}
+
+
+
+/*
+ * pagelist_save_index - write all pages to an index
+ *
+ * A new process reads it instead of all files of the pages. All
+ * changes made afterwards have to go to the change log.
+ */
+bool
+pagelist_save_index(const char* fn)
+{
+    char	tmp[MAX_PATH + 4];
+    Page **	list;
+    size_t	i;
+    FILE *	file;
+    bool	ok = true;
+
+    pagelist_sync();
+    changes_indexed = true;
+    snprintf(tmp, sizeof(tmp), "%s.new", fn);
+    file = fopen(tmp, "w");
+    if (file == NULL)
+        return false;
+
+    fprintf(file, INDEX_MAGIC "\n");
+    fprintf(file, "changes: %ld %d\n", (long)changes_read, changes_next);
+    list = pagelist();
+    for (i = 0; list[i] != NULL && ok; i++)
+        ok = page_output_index(list[i], file);
+    free(list);
+
+    if (fclose(file) != 0 || !ok || rename(tmp, fn) != 0) {
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+
+
 /*
  * page_init - initializes structures for holding pages
+ *
+ * With an index from the process running before the files of the
+ * pages are not read at all.
  */
 void
-pagelist_init(const char* pathname)
+pagelist_init(const char* pathname, const char* index)
 {
     Page ** list;
     size_t i;
@@ -675,6 +825,11 @@ pagelist_init(const char* pathname)
     pagepath = strdup(pathname);
     pagetab = hash_new();
 
+    if (index) {
+        pagelist_load_index(index);
+        return;
+    }
+
     snprintf(dirpath, MAX_PATH, "%s", pathname);
     dir = opendir(dirpath);
     if (dir == NULL) {
@@ -703,6 +858,336 @@ pagelist_init(const char* pathname)
 
 
 
+/*
+ * pagelist_share - keep the pages of several processes in step
+ *
+ * Every process notes the pages it changes in the change log of the
+ * page directory and takes over the notes of the others with
+ * pagelist_sync(). The master starts a new log with id 0 before it
+ * forks, the workers get their own ids from pagelist_new_id(). After
+ * an index was loaded, the log of the process before is continued.
+ * pagelist_compact() starts a new log, when it grew too big.
+ */
+bool
+pagelist_share(int id)
+{
+    char	fn[MAX_PATH];
+
+    changes_id = id;
+    if (changes_fd >= 0)
+        return true;
+
+    snprintf(fn, MAX_PATH, "%s/%s", pagepath, CHANGES_FILE);
+    if (changes_kept) {
+        changes_fd = open(fn, O_RDWR | O_CREAT | O_APPEND, 0644);
+    }
+    else {
+        changes_fd = open(fn, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        changes_read = 0;
+    }
+    return changes_fd >= 0;
+}
+
+
+
+/*
+ * pagelist_new_id - give out an id for the change log
+ */
+int
+pagelist_new_id()
+{
+    return changes_next++;
+}
+
+
+
+bool
+pagelist_is_shared()
+{
+    return changes_fd >= 0;
+}
+
+
+
+/*
+ * pagelist_lock_changes - lock or unlock a change log
+ *
+ * Notes are written with a shared lock, a new log is started with an
+ * exclusive one. The locks are those of the process, its handlers do
+ * not run at the same time.
+ */
+static void
+pagelist_lock_changes(int fd, int type)
+{
+    struct flock lock;
+
+    bzero(&lock, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &lock) < 0 && errno == EINTR)
+        ;
+}
+
+
+
+/*
+ * pagelist_note - append a line to the change log
+ *
+ * Lines written at once with O_APPEND do not get mixed up. When the
+ * log was replaced meanwhile, the line goes to the new one. The own
+ * log is read on to its end and changed over by pagelist_sync().
+ */
+static void
+pagelist_note(const char * fmt, ...)
+{
+    char	line[3 * MAX_WIKINAME];
+    char	fn[MAX_PATH];
+    struct stat	sbuf;
+    va_list	args;
+    int		len, fd;
+
+    if (changes_fd < 0 || changes_id == 0)
+        return;
+
+    len = snprintf(line, sizeof(line), "%d ", changes_id);
+    va_start(args, fmt);
+    len += vsnprintf(line + len, sizeof(line) - len, fmt, args);
+    va_end(args);
+    if (len >= (int)sizeof(line))
+        return;
+
+    fd = changes_fd;
+    pagelist_lock_changes(fd, F_RDLCK);
+    if (fstat(fd, &sbuf) == 0 && sbuf.st_nlink == 0) {
+        pagelist_lock_changes(fd, F_UNLCK);
+        snprintf(fn, MAX_PATH, "%s/%s", pagepath, CHANGES_FILE);
+        fd = open(fn, O_WRONLY | O_APPEND);
+        if (fd < 0)
+            return;
+        pagelist_lock_changes(fd, F_RDLCK);
+    }
+    write(fd, line, len);
+    pagelist_lock_changes(fd, F_UNLCK);
+    if (fd != changes_fd)
+        close(fd);
+}
+
+
+
+void
+pagelist_note_saved(Page * page)
+{
+    pagelist_note("S %s %d\n", page->name, page->seqno);
+}
+
+void
+pagelist_note_editor(Page * page)
+{
+    if (page->editor)
+        pagelist_note("E %s %ld %s\n",
+                      page->name, (long)page->edittime, page->editor);
+}
+
+void
+pagelist_note_deleted(const char * name)
+{
+    pagelist_note("D %s\n", name);
+}
+
+
+
+/*
+ * pagelist_forget - drop a page, another process has deleted
+ */
+static void
+pagelist_forget(Page * page)
+{
+    Page ** list;
+    size_t i;
+
+    pagelist_remove_page(page->name);
+    list = pagelist();
+    for (i = 0; list[i] != NULL; i++) {
+        if (list[i]->group == page)
+            list[i]->group = NULL;
+    }
+    free(list);
+    page_free(page);
+}
+
+
+
+/*
+ * pagelist_apply - take over a line of the change log
+ */
+static void
+pagelist_apply(const char * line)
+{
+    char	name[MAX_WIKINAME];
+    char	editor[MAX_WIKINAME];
+    char	kind;
+    int		id, seqno;
+    long	when;
+    Page *	page;
+
+    if (sscanf(line, "%d %c %255s", &id, &kind, name) != 3 ||
+        id == changes_id)
+        return;
+
+    switch (kind) {
+    case 'S':
+        if (sscanf(line, "%*d %*c %*s %d", &seqno) != 1)
+            break;
+        page = pagelist_insert_page(name, 0);
+        if (page)
+            page_reload(page, seqno);
+        break;
+
+    case 'E':
+        page = pagelist_find_page(name);
+        if (page == NULL ||
+            sscanf(line, "%*d %*c %*s %ld %255s", &when, editor) != 2)
+            break;
+        free(page->editor);
+        page->editor = strdup(editor);
+        page->edittime = when;
+        break;
+
+    case 'D':
+        page = pagelist_find_page(name);
+        if (page)
+            pagelist_forget(page);
+        break;
+    }
+}
+
+
+
+/*
+ * pagelist_next_changes - go on with the log, that replaced this one
+ */
+static void
+pagelist_next_changes()
+{
+    char	fn[MAX_PATH];
+
+    close(changes_fd);
+    snprintf(fn, MAX_PATH, "%s/%s", pagepath, CHANGES_FILE);
+    changes_fd = open(fn, O_RDWR | O_APPEND);
+    changes_read = 0;
+    if (changes_fd < 0)
+        fprintf(stderr, "Error: Can not open the change log %s!\n", fn);
+}
+
+
+
+/*
+ * pagelist_sync - take over the changes of the other processes
+ *
+ * Usually the log has not grown, then this is a single fstat().
+ */
+void
+pagelist_sync()
+{
+    struct stat	sbuf;
+    char	buf[4096];
+    char	*line, *end;
+    ssize_t	len;
+
+    if (changes_fd < 0)
+        return;
+
+    while (fstat(changes_fd, &sbuf) == 0 && sbuf.st_size > changes_read) {
+        len = pread(changes_fd, buf, sizeof(buf) - 1, changes_read);
+        if (len <= 0)
+            break;
+        buf[len] = '\0';
+
+        line = buf;
+        while ((end = strchr(line, '\n')) != NULL) {
+            *end = '\0';
+            if (strcmp(line, CHANGES_NEXT) == 0)
+                break;
+            pagelist_apply(line);
+            line = end + 1;
+        }
+        if (end != NULL) {
+            pagelist_next_changes();
+            if (changes_fd < 0)
+                return;
+            continue;
+        }
+        if (line == buf)
+            break;              /* the line is still being written */
+        changes_read += line - buf;
+    }
+}
+
+
+
+/*
+ * pagelist_is_behind - see, if pagelist_sync() has to take over changes
+ *
+ * It does not change anything, so the readers may ask at once.
+ */
+bool
+pagelist_is_behind()
+{
+    struct stat	sbuf;
+
+    return changes_fd >= 0 && fstat(changes_fd, &sbuf) == 0 &&
+        sbuf.st_size > changes_read;
+}
+
+
+
+/*
+ * pagelist_compact - take over all changes and start a new log
+ *
+ * Without it, the log would grow as long as the wiki runs, and a new
+ * worker would take over all changes made since the start. Only the
+ * process, whose pages the others start with, may do it. That is the
+ * master or a process on its own, and not after it wrote an index
+ * pointing into the log. The others follow to the new log, when they
+ * read the line CHANGES_NEXT in the old one.
+ */
+void
+pagelist_compact()
+{
+    char	fn[MAX_PATH];
+    char	tmp[MAX_PATH + 4];
+    struct stat	sbuf;
+    int		fd;
+
+    pagelist_sync();
+    if (changes_fd < 0 || changes_indexed ||
+        fstat(changes_fd, &sbuf) < 0 || sbuf.st_size < CHANGES_MAX)
+        return;
+
+    /* no notes are written to the old log from now on */
+    pagelist_lock_changes(changes_fd, F_WRLCK);
+    pagelist_sync();
+    snprintf(fn, MAX_PATH, "%s/%s", pagepath, CHANGES_FILE);
+    snprintf(tmp, sizeof(tmp), "%s.new", fn);
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd >= 0 && rename(tmp, fn) < 0) {
+        close(fd);
+        unlink(tmp);
+        fd = -1;
+    }
+    if (fd < 0) {
+        pagelist_lock_changes(changes_fd, F_UNLCK);
+        return;
+    }
+    write(changes_fd, CHANGES_NEXT "\n", sizeof(CHANGES_NEXT));
+    pagelist_lock_changes(changes_fd, F_UNLCK);
+    close(changes_fd);
+    changes_fd = fd;
+    changes_read = 0;
+}
+
+
+
 void
 pagelist_exit()
 {
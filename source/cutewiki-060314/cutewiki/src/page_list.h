@@ -18,8 +18,18 @@
 
 extern char* pagepath;
 
-void	 	pagelist_init(const char* pathname);
+void	 	pagelist_init(const char* pathname, const char* index);
 void	 	pagelist_exit();
+bool		pagelist_save_index(const char* fn);
+bool		pagelist_share(int id);
+bool		pagelist_is_shared();
+int		pagelist_new_id();
+void		pagelist_sync();
+bool		pagelist_is_behind();
+void		pagelist_compact();
+void		pagelist_note_saved(Page * page);
+void		pagelist_note_editor(Page * page);
+void		pagelist_note_deleted(const char * name);
 
 Page *          pagelist_insert_page(const char* name, int flags);
 Page * 		pagelist_find_page(const char* title);
@@ -27,6 +37,7 @@ bool		pagelist_remove_page(const char* name);
 
 size_t		pagelist_get_count();
 size_t	 	pagelist_get_usedmemory();
+size_t		pagelist_get_textbytes();
 size_t		pagelist_get_useddisk();
 
 Page**  	pagelist();
@@ -0,0 +1,303 @@
+/*
+ * pagecache.c - keep rendered pages in memory
+ *
+ * Most views are reads of pages, which did not change. A page is
+ * kept as it was rendered for a mode and a reader, who sees it with
+ * their menu and cookies, and is sent again without being parsed.
+ *
+ * An entry is found by the page, the mode and the reader. It holds
+ * the entity tag of the page, which sums up all a rendering depends
+ * on, and is only used while the tag is the same. Besides, entries
+ * are dropped as soon as their page is saved, or a page they link to
+ * comes or goes, which flips the link between InternalLink and
+ * BrokenLink. The least recently used ones give way to new ones.
+ *
+ * Readers use the cache at the same time, pagecache_lock guards it.
+ *
+ * Copyright 2005 Martin Doering
+ *
+ * This file is distributed under the GPL, version 2 or at your
+ * option any later version.  See doc/license.txt for details.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#define PAGE_PRIVATE
+
+#include "types.h"
+#include "cutewiki.h"
+#include "hash.h"
+#include "page.h"
+#include "page_list.h"
+#include "http.h"
+#include "svr.h"
+#include "metrics.h"
+#include "pagecache.h"
+
+
+
+typedef struct pagecache_entry {
+    struct pagecache_entry *prev;	/* recently used first */
+    struct pagecache_entry *next;
+    char	*key;			/* also the key in the hash */
+    char	*page;
+    char	tag[PAGECACHE_TAG_LEN];
+    char	*type;
+    char	*headers;		/* added while rendering */
+    char	*data;
+    int		len;
+    int		size;			/* memory taken from the limit */
+} PageCacheEntry;
+
+static Hash	*pagecache_pages = NULL;
+static PageCacheEntry *pagecache_first = NULL;
+static PageCacheEntry *pagecache_last = NULL;
+static int	pagecache_limit = 0;	/* bytes, 0 if switched off */
+static int	pagecache_used = 0;
+static __thread int pagecache_headers;	/* length before rendering */
+static pthread_mutex_t pagecache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/*
+ * pagecache_unlink - take an entry out of the list
+ */
+static void
+pagecache_unlink(PageCacheEntry * entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        pagecache_first = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        pagecache_last = entry->prev;
+}
+
+
+
+/*
+ * pagecache_push - put an entry in front of the list
+ */
+static void
+pagecache_push(PageCacheEntry * entry)
+{
+    entry->prev = NULL;
+    entry->next = pagecache_first;
+    if (pagecache_first)
+        pagecache_first->prev = entry;
+    else
+        pagecache_last = entry;
+    pagecache_first = entry;
+}
+
+
+
+/*
+ * pagecache_remove - forget an entry
+ */
+static void
+pagecache_remove(PageCacheEntry * entry)
+{
+    pagecache_unlink(entry);
+    hash_remove(pagecache_pages, entry->key);
+    pagecache_used -= entry->size;
+    free(entry->key);
+    free(entry->page);
+    free(entry->type);
+    free(entry->headers);
+    free(entry->data);
+    free(entry);
+}
+
+
+
+/*
+ * pagecache_init - set the memory used for rendered pages
+ */
+void
+pagecache_init(int limit)
+{
+    pthread_mutex_lock(&pagecache_lock);
+    pagecache_limit = limit;
+    if (pagecache_pages == NULL && limit > 0)
+        pagecache_pages = hash_new();
+    while (pagecache_last && pagecache_used > pagecache_limit)
+        pagecache_remove(pagecache_last);
+    pthread_mutex_unlock(&pagecache_lock);
+}
+
+
+
+/*
+ * pagecache_send - answer with a page rendered before
+ *
+ * Returns false, if there is no entry with the tag.
+ */
+bool
+pagecache_send(httpd * server, char * key, char * tag)
+{
+    PageCacheEntry *entry;
+
+    if (pagecache_limit == 0)
+        return false;
+
+    pthread_mutex_lock(&pagecache_lock);
+    entry = hash_find(pagecache_pages, key);
+    if (entry == NULL || strcmp(entry->tag, tag) != 0) {
+        pthread_mutex_unlock(&pagecache_lock);
+        __sync_fetch_and_add(&metrics->pageMisses, 1);
+        return false;
+    }
+    __sync_fetch_and_add(&metrics->pageHits, 1);
+    pagecache_unlink(entry);
+    pagecache_push(entry);
+
+    /* the body is only copied to the connection, nothing waits */
+    svr_set_contenttype(server, entry->type);
+    if (entry->headers)
+        svr_add_header(server, entry->headers);
+    http_send_headers(server, 0, 0);
+    http_write(server, entry->data, entry->len);
+    pthread_mutex_unlock(&pagecache_lock);
+    return true;
+}
+
+
+
+/*
+ * pagecache_begin - keep a copy of the page about to be rendered
+ */
+void
+pagecache_begin(httpd * server)
+{
+    if (pagecache_limit == 0)
+        return;
+    pagecache_headers = strlen(server->response.headers);
+    http_copy_body(server, true);
+}
+
+
+
+/*
+ * pagecache_end - keep the page just rendered
+ *
+ * Only complete pages sent with success are kept. A page must not
+ * take more than a quarter of the memory.
+ */
+void
+pagecache_end(httpd * server, char * key, char * tag, const char * name)
+{
+    PageCacheEntry *entry;
+    char	*headers;
+    int		size;
+
+    if (pagecache_limit == 0)
+        return;
+    http_copy_body(server, false);
+    if (server->copyLen <= 0 || server->conn->broken ||
+        atoi(server->response.response) != 200)
+        return;
+
+    headers = server->response.headers + pagecache_headers;
+    size = sizeof(PageCacheEntry) + server->copyLen + strlen(key) +
+        strlen(name) + strlen(headers) + strlen(server->response.contentType);
+    if (size > pagecache_limit / 4)
+        return;
+
+    pthread_mutex_lock(&pagecache_lock);
+    entry = hash_find(pagecache_pages, key);
+    if (entry)
+        pagecache_remove(entry);
+    while (pagecache_last && pagecache_used + size > pagecache_limit)
+        pagecache_remove(pagecache_last);
+
+    entry = malloc(sizeof(PageCacheEntry));
+    if (entry == NULL) {
+        pthread_mutex_unlock(&pagecache_lock);
+        return;
+    }
+    bzero(entry, sizeof(PageCacheEntry));
+    entry->key = strdup(key);
+    entry->page = strdup(name);
+    entry->type = strdup(server->response.contentType);
+    entry->headers = *headers ? strdup(headers) : NULL;
+    entry->data = malloc(server->copyLen);
+    if (entry->key == NULL || entry->page == NULL || entry->type == NULL ||
+        (*headers && entry->headers == NULL) || entry->data == NULL) {
+        free(entry->key);
+        free(entry->page);
+        free(entry->type);
+        free(entry->headers);
+        free(entry->data);
+        free(entry);
+        pthread_mutex_unlock(&pagecache_lock);
+        return;
+    }
+    strncpy(entry->tag, tag, PAGECACHE_TAG_LEN - 1);
+    memcpy(entry->data, server->copy, server->copyLen);
+    entry->len = server->copyLen;
+    entry->size = size;
+    pagecache_used += size;
+    hash_insert(pagecache_pages, entry->key, entry);
+    pagecache_push(entry);
+    pthread_mutex_unlock(&pagecache_lock);
+}
+
+
+
+/*
+ * pagecache_drop - forget all renderings of a page
+ */
+void
+pagecache_drop(const char * name)
+{
+    PageCacheEntry *entry, *next;
+
+    pthread_mutex_lock(&pagecache_lock);
+    for (entry = pagecache_first; entry; entry = next) {
+        next = entry->next;
+        if (strcmp(entry->page, name) == 0)
+            pagecache_remove(entry);
+    }
+    pthread_mutex_unlock(&pagecache_lock);
+}
+
+
+
+/*
+ * pagecache_drop_linking - forget the pages with a link to a page
+ *
+ * Called, when the page is created or deleted.
+ */
+void
+pagecache_drop_linking(const char * name)
+{
+    PageCacheEntry *entry, *next;
+    Page	*page;
+    size_t	i;
+
+    pthread_mutex_lock(&pagecache_lock);
+    for (entry = pagecache_first; entry; entry = next) {
+        next = entry->next;
+        page = pagelist_find_page(entry->page);
+        if (page == NULL) {
+            pagecache_remove(entry);
+            continue;
+        }
+        for (i = 0; i < page->linkcnt; i++) {
+            if (strncmp(page->links[i], name, MAX_WIKINAME) == 0) {
+                pagecache_remove(entry);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&pagecache_lock);
+}
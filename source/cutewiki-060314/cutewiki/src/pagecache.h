@@ -0,0 +1,32 @@
+/*
+ * pagecache.h - keep rendered pages in memory
+ *
+ * Copyright 2005 Martin Doering
+ *
+ * This file is distributed under the GPL, version 2 or at your
+ * option any later version.  See doc/license.txt for details.
+ */
+
+
+
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include "types.h"
+#include "cutewiki.h"
+#include "http.h"
+
+
+#define	PAGECACHE_KEY_LEN	(MAX_WIKINAME * 2 + 32)
+#define	PAGECACHE_TAG_LEN	64
+
+
+
+void	pagecache_init (int);
+bool	pagecache_send (httpd*, char*, char*);
+void	pagecache_begin (httpd*);
+void	pagecache_end (httpd*, char*, char*, const char*);
+void	pagecache_drop (const char*);
+void	pagecache_drop_linking (const char*);
+
+#endif
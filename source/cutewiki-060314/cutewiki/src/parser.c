@@ -1,6 +1,12 @@
 /*
  * parser.c - The parser for cutewiki's ASCII pages
  *
+ * A page is parsed once into a ParseCode, a flat array of steps with
+ * their strings, which is kept with the page until its text changes.
+ * Rendering runs the steps against an output driver. What depends on
+ * the reader or on other pages, like WikiWord links, macros and
+ * lists, stays a step of its own and is looked up while running.
+ *
  * Copyright 2002 Martin Doering
  *
  * This file is distributed under the GPL, version 2 or at your
@@ -13,6 +19,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <sys/stat.h>
 
 #include "cutewiki.h"
 #include "page.h"
@@ -24,6 +31,7 @@
 #include "parser.h"
 #include "misc.h"
 #include "rcs.h"
+#include "trace.h"
 
 
 
@@ -64,13 +72,242 @@ struct ParseState
 
 
 
+/*
+ * ParseOp - one step of a parsed page
+ *
+ * Most steps are a call of the output driver, arg is the offset of
+ * the string in the ParseCode, a heading level or a count of cells.
+ */
+enum ParseOpcode
+{
+    OP_TEXT,			/* written with PutsN() */
+    OP_PARA_BEGIN, OP_PARA_END,
+    OP_PRE_BEGIN, OP_PRE_END,
+    OP_BLOCKQUOTE_BEGIN, OP_BLOCKQUOTE_END,
+    OP_RULER_BEGIN, OP_RULER_END,
+    OP_LIST_BEGIN, OP_LIST_END,
+    OP_NUMLIST_BEGIN, OP_NUMLIST_END,
+    OP_LISTITEM_BEGIN, OP_LISTITEM_END,
+    OP_LINE_BEGIN, OP_LINE_END,
+    OP_HEADING_BEGIN, OP_HEADING_END,
+    OP_FOOTNOTE,
+    OP_BOLD_BEGIN, OP_BOLD_END,
+    OP_ITALIC_BEGIN, OP_ITALIC_END,
+    OP_TABLE_BEGIN, OP_TABLE_END,
+    OP_TABLEHEAD_BEGIN, OP_TABLEHEAD_END,
+    OP_TABLEROW_BEGIN, OP_TABLEROW_END,
+    OP_TABLECELL_BEGIN, OP_TABLECELL_END,
+    OP_TABLENUMBER_BEGIN, OP_TABLENUMBER_END,
+    OP_IMAGE,
+    OP_URL,
+    OP_IMAGE_URL,
+    OP_EXTERNAL_LINK,		/* the text follows the url */
+    OP_WIKIWORD,		/* a link, if there is such a page */
+    OP_MACRO,			/* arg is the index in macros[] */
+    OP_PAGES,			/* lists of [pages=...] and so on */
+    OP_TOPIC,
+    OP_CATEGORY
+};
+
+typedef struct ParseOp ParseOp;
+struct ParseOp
+{
+    unsigned char code;
+    int		arg;
+    int		len;		/* of the string */
+};
+
+/*
+ * Span - a piece of the page text, tokens are not copied out of it
+ */
+typedef struct Span Span;
+struct Span
+{
+    char *	str;
+    int		len;
+};
+
+/*
+ * ParseCode - a parsed page, the steps are followed by the strings
+ */
+struct parse_code
+{
+    size_t	size;		/* of the whole block */
+    int		users;		/* the page and the writers of it */
+    int		count;		/* of steps */
+    bool	images;		/* depends on the files in imagedir */
+    time_t	imagetime;	/* mtime of imagedir, when parsed */
+    ParseOp *	ops;
+    char *	strings;
+};
+
+
+
 /* prototypes */
-static void	do_string(char*, ParseState *);
+static void	do_string(char*, char*, ParseState *);
+
+
+
+/* The choosen output option of the thread */
+__thread Output * out = &htm;
+
+/* the page being parsed, each thread parses one page at a time */
+static __thread ParseOp *	parse_ops;
+static __thread int		parse_count;
+static __thread int		parse_max;
+static __thread char *		parse_strings;
+static __thread int		parse_len;
+static __thread int		parse_size;
+static __thread bool		parse_images;
+static __thread bool		parse_failed;
+
+
+
+/*
+ * parse_grow - make room for more strings of the parsed page
+ */
+static bool
+parse_grow(int len)
+{
+    int		size;
+    char *	strings;
+
+    if (parse_len + len <= parse_size)
+	return true;
+    for (size = parse_size ? parse_size : 4096; size < parse_len + len;
+	 size *= 2)
+	;
+    strings = realloc(parse_strings, size);
+    if (strings == NULL) {
+	parse_failed = true;
+	return false;
+    }
+    parse_strings = strings;
+    parse_size = size;
+    return true;
+}
+
+
+
+/*
+ * parse_add_string - keep a string with the parsed page
+ *
+ * The copy ends with a 0. Returns its offset, or -1 if there is no
+ * memory.
+ */
+static int
+parse_add_string(Span span)
+{
+    if (!parse_grow(span.len + 1))
+	return -1;
+    memcpy(parse_strings + parse_len, span.str, span.len);
+    parse_strings[parse_len + span.len] = 0;
+    parse_len += span.len + 1;
+    return parse_len - span.len - 1;
+}
+
+
+
+/*
+ * emit_num - add a step to the parsed page
+ */
+static void
+emit_num(int code, int arg, int len)
+{
+    ParseOp *	ops;
+
+    if (parse_count == parse_max) {
+	ops = realloc(parse_ops, (parse_max ? parse_max * 2 : 256) *
+		      sizeof(ParseOp));
+	if (ops == NULL) {
+	    parse_failed = true;
+	    return;
+	}
+	parse_ops = ops;
+	parse_max = parse_max ? parse_max * 2 : 256;
+    }
+    parse_ops[parse_count].code = code;
+    parse_ops[parse_count].arg = arg;
+    parse_ops[parse_count].len = len;
+    parse_count++;
+}
+
+
+
+static void
+emit(int code)
+{
+    emit_num(code, 0, 0);
+}
+
+
+
+/*
+ * emit_str - add a step with a string
+ */
+static void
+emit_str(int code, Span span)
+{
+    int		offset;
 
+    offset = parse_add_string(span);
+    if (offset >= 0)
+	emit_num(code, offset, span.len);
+}
 
 
-/* The choosen output option */
-Output * out;
+
+/*
+ * emit_link - add an external link, its text follows the url
+ */
+static void
+emit_link(Span url, Span text)
+{
+    int		offset;
+
+    offset = parse_add_string(url);
+    if (offset >= 0 && parse_add_string(text) >= 0)
+	emit_num(OP_EXTERNAL_LINK, offset, url.len);
+}
+
+
+
+/*
+ * emit_text - add text, which is written as it is
+ *
+ * Text following text makes the step longer, so a line without
+ * markup is written at once.
+ */
+static void
+emit_text(Span span)
+{
+    ParseOp *	op;
+
+    op = parse_count > 0 ? &parse_ops[parse_count - 1] : NULL;
+    if (op == NULL || op->code != OP_TEXT) {
+	emit_str(OP_TEXT, span);
+	return;
+    }
+    /* the text is the last string, make it longer */
+    if (!parse_grow(span.len))
+	return;
+    memcpy(parse_strings + parse_len - 1, span.str, span.len);
+    parse_len += span.len;
+    parse_strings[parse_len - 1] = 0;
+    op->len += span.len;
+}
+
+
+
+static void
+emit_char(char ch)
+{
+    Span	span;
+
+    span.str = &ch;
+    span.len = 1;
+    emit_text(span);
+}
 
 
 
@@ -99,21 +336,45 @@ isurl(char c)
 
 
 /*
- * dup_string - duplicate a string
- *
- * end is pointing to the first char after the wanted string
+ * make_span - take the text from start to the first char after it
  */
-static char*
-dup_string(const char* start, const char* end)
+static Span
+make_span(char* start, char* end)
 {
-    char* string;
-    int len = end - start;
+    Span	span;
+
+    span.str = start;
+    span.len = end - start;
+    return span;
+}
+
+
 
-    string = malloc(len + 1);
-    memcpy(string, start, len);
-    string[len] = '\0';
+/*
+ * span_is - compare a token with a string
+ */
+static bool
+span_is(Span span, const char* str)
+{
+    return strncmp(span.str, str, span.len) == 0 && str[span.len] == 0;
+}
 
-    return string;
+
+
+/*
+ * span_string - get a token as string
+ *
+ * Tokens fitting into buf are copied there, longer ones into the
+ * request's arena.
+ */
+static char*
+span_string(Span span, char* buf, int size)
+{
+    if (span.len >= size)
+	return arena_strndup(&server->arena, span.str, span.len);
+    memcpy(buf, span.str, span.len);
+    buf[span.len] = 0;
+    return buf;
 }
 
 
@@ -138,7 +399,7 @@ get_space(char** line)
 /*
  * get_alnum - get an alphanumeric string
  */
-char*
+static Span
 get_alnum(char** line)
 {
     char* start;
@@ -150,7 +411,7 @@ get_alnum(char** line)
         end++;
     *line = end;
 
-    return dup_string(start, end);
+    return make_span(start, end);
 }
 
 
@@ -159,7 +420,7 @@ get_alnum(char** line)
 /*
  * get_number - get a number
  */
-static char*
+static Span
 get_number(char** line)
 {
     char* start;
@@ -171,24 +432,26 @@ get_number(char** line)
         end++;
     *line = end;
 
-    return dup_string(start, end);
+    return make_span(start, end);
 }
 #endif
 
 /*
  * get_line - get line terminated eventually by <CR> and <LF>
+ *
+ * The line is left in the text, the char after it is <CR>, <LF> or 0.
  */
-static char*
+static Span
 get_line(char** text)
 {
     char* start;
     char* end;
-    char* line;
+    Span line;
 
     start = end = *text;
     while (*end && *end != '\r' && *end != '\n')
 	end++;
-    line = dup_string(start, end);
+    line = make_span(start, end);
 
     /* skip the line ending codes, if given */
     if (*end == '\r')
@@ -203,7 +466,7 @@ get_line(char** text)
 /*
  * get_url - get an URL
  */
-static char*
+static Span
 get_url(char** line)
 {
     char* start;
@@ -214,7 +477,7 @@ get_url(char** line)
         end++;
     *line = end;
 
-    return dup_string(start, end);
+    return make_span(start, end);
 }
 
 
@@ -222,18 +485,18 @@ get_url(char** line)
 /*
  * get_cell - get the next cell of a table
  */
-static char*
-get_cell(char** line)
+static Span
+get_cell(char** line, char* stop)
 {
     char* start;
     char* end;
 
     start = end = *line;
-    while (*end && *end != '|')
+    while (end < stop && *end != '|')
         end++;
     *line = end;
 
-    return dup_string(start, end);
+    return make_span(start, end);
 }
 
 
@@ -241,18 +504,18 @@ get_cell(char** line)
 /*
  * get_square - get a special field's
  */
-static char*
-get_square(char** line)
+static Span
+get_square(char** line, char* stop)
 {
     char* start;
     char* end;
 
     start = end = *line;
-    while (*end && *end != ']')
+    while (end < stop && *end != ']')
 	end++;
     *line = end;     /* step over bracket or newline */
 
-    return dup_string(start, end);
+    return make_span(start, end);
 }
 
 
@@ -264,7 +527,8 @@ static char*
 get_shortdate (char * datestring)
 {
     time_t acttime = time(NULL);
-    strftime(datestring, MAX_DATELEN-1, "%y%m%d", localtime(&acttime));
+    struct tm tm;
+    strftime(datestring, MAX_DATELEN-1, "%y%m%d", localtime_r(&acttime, &tm));
     datestring[MAX_DATELEN-1] = '\0';
 
     return datestring;
@@ -273,11 +537,11 @@ get_shortdate (char * datestring)
 
 
 static bool
-is_cell(char* lp)
+is_cell(char* lp, char* end)
 {
-    while (*lp && *lp != '|')
+    while (lp < end && *lp != '|')
         lp++;
-    if (*lp == '|')
+    if (lp < end)
         return true;
     else
         return false;
@@ -286,33 +550,33 @@ is_cell(char* lp)
 
 
 static bool
-is_url(char* lp)
+is_url(Span word)
 {
-    if (!strcmp(lp, "http")) {
+    if (span_is(word, "http")) {
         return true;
     }
-    else if (!strcmp(lp, "mailto")) {
+    else if (span_is(word, "mailto")) {
         return true;
     }
-    else if (!strcmp(lp, "ftp")) {
+    else if (span_is(word, "ftp")) {
         return true;
     }
-    else if (!strcmp(lp, "file")) {
+    else if (span_is(word, "file")) {
         return true;
     }
-    else if (!strcmp(lp, "news")) {
+    else if (span_is(word, "news")) {
         return true;
     }
-    else if (!strcmp(lp, "https")) {
+    else if (span_is(word, "https")) {
         return true;
     }
-    else if (!strcmp(lp, "gopher")) {
+    else if (span_is(word, "gopher")) {
         return true;
     }
-    else if (!strcmp(lp, "telnet")) {
+    else if (span_is(word, "telnet")) {
         return true;
     }
-    else if (!strcmp(lp, "mms")) {
+    else if (span_is(word, "mms")) {
         return true;
     }
 
@@ -341,8 +605,10 @@ is_footnote(char* lp)
 
 
 static bool
-is_numbercell(char* lp)
+is_numbercell(Span cell)
 {
+    char* lp = cell.str;
+
     get_space(&lp);
     if (*lp == '-') {
         lp++;
@@ -351,7 +617,7 @@ is_numbercell(char* lp)
         lp++;
     }
     get_space(&lp);
-    if (*lp != '\0')
+    if (lp != cell.str + cell.len)
         return false;
     else
         return true;
@@ -362,13 +628,13 @@ is_numbercell(char* lp)
  * count_cells - Count, how many cells a table has in a row
  */
 static void
-count_cells(char* lp, ParseState * state)
+count_cells(char* lp, char* end, ParseState * state)
 {
     char* lp2;
 
     state->cells = 0;
     lp2 = lp+1;
-    while (*lp2) {
+    while (lp2 < end) {
         if (*lp2 == '|')
             state->cells++;
         lp2++;
@@ -378,25 +644,25 @@ count_cells(char* lp, ParseState * state)
 
 
 static void
-do_cell(char** line, ParseState* pfmt)
+do_cell(char** line, char* end, ParseState* pfmt)
 {
-    char* cell;
+    Span cell;
     char* lp;
 
     lp = *line;
 
-    cell = get_cell(&lp);
+    cell = get_cell(&lp, end);
     if (is_numbercell(cell)) {
-        out->TableNumberBegin();
-        do_string(cell, pfmt);      /* recursive call for markup in Cell */
-        out->TableNumberEnd();
+        emit(OP_TABLENUMBER_BEGIN);
+        /* recursive call for markup in Cell */
+        do_string(cell.str, cell.str + cell.len, pfmt);
+        emit(OP_TABLENUMBER_END);
     }
     else {
-        out->TableCellBegin();
-        do_string(cell, pfmt);      /* recursive call for markup in Cell */
-        out->TableCellEnd();
+        emit(OP_TABLECELL_BEGIN);
+        do_string(cell.str, cell.str + cell.len, pfmt);
+        emit(OP_TABLECELL_END);
     }
-    free(cell);
 
     *line = lp;
 }
@@ -768,7 +1034,7 @@ do_editform()
 {
     char* name;
 
-    name = var_get_val(server->variables, "page");
+    name = var_get_val(&server->variables, VAR_PAGE);
     if (name != NULL) {
 	Page * page;
 
@@ -794,7 +1060,7 @@ do_sourceform()
 {
     char* name;
 
-    name = var_get_val(server->variables, "page");
+    name = var_get_val(&server->variables, VAR_PAGE);
     if (name != NULL) {
 	Page * page;
 
@@ -822,7 +1088,7 @@ do_errormsg()
 {
     char* msg;
 
-    msg = var_get_val(server->variables, "errormsg");
+    msg = var_get_val(&server->variables, VAR_ERRORMSG);
     if (msg != NULL)
 	out->Puts(msg);
     else
@@ -839,7 +1105,7 @@ do_errordsc()
 {
     char* dsc;
 
-    dsc = var_get_val(server->variables, "errordsc");
+    dsc = var_get_val(&server->variables, VAR_ERRORDSC);
     if (dsc != NULL)
 	out->Puts(dsc);
     else
@@ -915,7 +1181,7 @@ do_reverselist()
 {
     char* name;
 
-    name = var_get_val(server->variables, "page");
+    name = var_get_val(&server->variables, VAR_PAGE);
     if (name != NULL)
 	do_list(pagelist_of_reverse_links(name), SHOW_DATE|SHOW_OWNER);
     else
@@ -932,9 +1198,9 @@ do_searchlist()
     char* filter;
 
     /* Handle search form data */
-    full = var_get_val(server->variables, "fullsearch");
-    criterion = var_get_val(server->variables, "cutewiki-search");
-    filter = var_get_val(server->variables, "category");
+    full = var_get_val(&server->variables, VAR_FULLSEARCH);
+    criterion = var_get_val(&server->variables, VAR_CUTEWIKI_SEARCH);
+    filter = var_get_val(&server->variables, VAR_CATEGORY);
 
     /* if search string is empty, write error */
     if (criterion != NULL) {
@@ -1040,8 +1306,9 @@ do_date ()
 {
     char buf[MAX_DATELEN];
     time_t acttime = time(NULL);
+    struct tm tm;
 
-    strftime(buf, MAX_DATELEN-1, "%A, %d. %b. %Y", localtime(&acttime));
+    strftime(buf, MAX_DATELEN-1, "%A, %d. %b. %Y", localtime_r(&acttime, &tm));
     buf[MAX_DATELEN-1] = '\0';
     out->Puts(buf);
 }
@@ -1052,9 +1319,10 @@ static void
 do_shortdate ()
 {
     char buf[MAX_DATELEN];
+    struct tm tm;
 
     time_t acttime = time(NULL);
-    strftime(buf, MAX_DATELEN-1, "%y%m%d", localtime(&acttime));
+    strftime(buf, MAX_DATELEN-1, "%y%m%d", localtime_r(&acttime, &tm));
     buf[MAX_DATELEN-1] = '\0';
     out->Puts(buf);
 }
@@ -1066,8 +1334,9 @@ do_time ()
 {
     char buf[MAX_TIMELEN];
     time_t acttime = time(NULL);
+    struct tm tm;
 
-    strftime(buf, MAX_DATELEN-1, "%k:%M", localtime(&acttime));
+    strftime(buf, MAX_DATELEN-1, "%k:%M", localtime_r(&acttime, &tm));
     buf[MAX_DATELEN-1] = '\0';
     out->Puts(buf);
 }
@@ -1079,9 +1348,10 @@ do_wikistart ()
 {
     char buf[MAX_TIMELEN];
     time_t starttime = wiki_get_starttime();
+    struct tm tm;
 
     strftime(buf, MAX_TIMELEN-1, "%A, %d. %b. %Y, %k:%M",
-	     localtime(&starttime));
+	     localtime_r(&starttime, &tm));
     buf[MAX_DATELEN-1] = '\0';
     out->Puts(buf);
 }
@@ -1106,6 +1376,35 @@ do_calls ()
 }
 
 
+/*
+ * do_routecalls - show the requests per registered path of the server
+ */
+static void
+do_routecall (char * path, unsigned long hits)
+{
+    char buf [HTTP_MAX_URL];
+
+    out->TableRowBegin();
+    out->TableCellBegin();
+    out->Puts(path);
+    out->TableCellEnd();
+    out->TableNumberBegin();
+    sprintf(buf, "%lu", hits);
+    out->Puts(buf);
+    out->TableNumberEnd();
+    out->TableRowEnd();
+}
+
+static void
+do_routecalls ()
+{
+    out->TableBegin(2);
+    svr_foreach_route(server, do_routecall);
+    out->TableEnd();
+}
+
+
+
 /*
  * do_dailycalls - show the page calls per day
  */
@@ -1178,7 +1477,7 @@ do_pagename ()
 {
     char* name;
 
-    name = var_get_val(server->variables, "page");
+    name = var_get_val(&server->variables, VAR_PAGE);
     if (name != NULL) {
 	Page * page;
 
@@ -1209,7 +1508,7 @@ do_searchtext ()
 {
     char* searchtext;
 
-    searchtext = var_get_val(server->variables, "cutewiki-search");
+    searchtext = var_get_val(&server->variables, VAR_CUTEWIKI_SEARCH);
     if (searchtext != NULL)
 	out->Puts(searchtext);
     else
@@ -1244,7 +1543,7 @@ do_history ()
 {
     char* pagename;
 
-    pagename = var_get_val(server->variables, "page");
+    pagename = var_get_val(&server->variables, VAR_PAGE);
     if (pagename == NULL)
 	out->Puts("[PageHistory]");
     else {
@@ -1319,9 +1618,9 @@ do_diffs ()
     char* rev1;
     char* rev2;
 
-    pagename = var_get_val(server->variables, "page");
-    rev1 = var_get_val(server->variables, "rev1");
-    rev2 = var_get_val(server->variables, "rev2");
+    pagename = var_get_val(&server->variables, VAR_PAGE);
+    rev1 = var_get_val(&server->variables, VAR_REV1);
+    rev2 = var_get_val(&server->variables, VAR_REV2);
 #if 0
     fprintf(stderr, "page: %s\n", pagename);
     fprintf(stderr, "rev1: %s\n", rev1);
@@ -1341,7 +1640,7 @@ do_revision ()
 {
     char* revision;
 
-    revision = var_get_val(server->variables, "revision");
+    revision = var_get_val(&server->variables, VAR_REVISION);
     if (revision == NULL)
 	out->Puts("[PageRevision]");
     else
@@ -1366,17 +1665,70 @@ static void
 do_answer(ParseState* fmt)
 {
     char question[1024];
+    char *answer;
 
-    question = var_get_val(server->variables, "question");
+    question = var_get_val(&server->variables, VAR_QUESTION);
     if (question != NULL) {
-        do_string(robo_ask("Martin", question), fmt);
+        answer = robo_ask("Martin", question);
+        do_string(answer, answer + strlen(answer), fmt);
+    }
+    else {
+        answer = "Please ask your question. [question] ";
+        do_string(answer, answer + strlen(answer), fmt);
     }
-    else
-        do_string("Please ask your question. [question] ", fmt);
 }
 #endif
 
 
+/*
+ * macros - the special commands like [RecentChanges]
+ */
+static struct
+{
+    char *	name;
+    void	(*write)();
+} macros[] = {
+    { "RecentChanges", do_changes },
+    { "EditForm", do_editform },
+    { "PageIndex", do_index },
+    { "PageList", do_pagelist },
+    { "UserList", do_userlist },
+    { "GroupList", do_grouplist },
+    { "PageHistory", do_history },
+    { "PageDiffs", do_diffs },
+    { "ReverseList", do_reverselist },
+    { "SearchList", do_searchlist },
+    { "CategoryList", do_categorylist },
+    { "SearchText", do_searchtext },
+#if 0
+    { "SupportAnswer", do_answer },
+    { "SupportQuestion", do_question },
+#endif
+    { "PageSource", do_sourceform },
+    { "PasswordReset", do_pwreset },
+    { "MainMemory", do_memusage },
+    { "DiskUsage", do_diskusage },
+    { "PageCount", do_pagecount },
+    { "PageName", do_pagename },
+    { "WikiName", do_wikiname },
+    { "OperatingSystem", do_os },
+    { "MachineName", do_machine },
+    { "UserName", do_user },
+    { "ActualDate", do_date },
+    { "ActualTime", do_time },
+    { "ShortDate", do_shortdate },
+    { "TarBackup", do_tarbackup },
+    { "ErrorMessage", do_errormsg },
+    { "ErrorDescription", do_errordsc },
+    { "PageCalls", do_calls },
+    { "DailyCalls", do_dailycalls },
+    { "RouteCalls", do_routecalls },
+    { "WikiStart", do_wikistart },
+    { NULL, NULL }
+};
+
+
+
 /*
  * do_quote - accept part of text beginning '
  *
@@ -1396,21 +1748,21 @@ do_quote(char** line, LineFmt* fmt)
     }
 
     if (quotes == 1) {
-        out->Putc('\'');
+        emit_char('\'');
     }
     else {
         if (quotes != 3) {	// 2 or bigger switches italic
             if (!fmt->italic)
-                out->ItalicBegin();
+                emit(OP_ITALIC_BEGIN);
             else
-                out->ItalicEnd();
+                emit(OP_ITALIC_END);
             fmt->italic = !fmt->italic;
         }
         if (quotes != 2) {	// 3 or bigger switches bold
             if (!fmt->bold)
-                out->BoldBegin();
+                emit(OP_BOLD_BEGIN);
             else
-                out->BoldEnd();
+                emit(OP_BOLD_END);
             fmt->bold = !fmt->bold;
         }
     }
@@ -1426,40 +1778,25 @@ static void
 do_alpha(char** line, LineFmt* fmt)
 {
     char* lp;
-    char* word;
+    Span word;
+    char buf[MAX_WIKINAME];
 
     lp = *line;
     word = get_alnum(&lp);
-    if (is_wikiword(word)) {
-        Page*	page;
-
-        page = pagelist_find_page(word);
-        if (page != NULL) {
-            if (page_is_seen(page))
-		out->InternalLink(page_get_name(page),
-				  page_get_title(page),
-				  page_get_type(page)
-				 );
-            else
-                out->Puts(page_get_title(page));
-        }
-        else {
-            /* link to not yet written WikiWord page */
-            out->BrokenLink(word);
-        }
+    if (is_wikiword(span_string(word, buf, sizeof(buf)))) {
+        /* the page is looked up, when the link is written */
+        emit_str(OP_WIKIWORD, word);
     }
     else if ((*lp == ':') && is_url(word)) {
         /* it is an URL */
         lp = *line;             /* back to start of URL */
-        free(word);
         word = get_url(&lp);
-        out->url(word);     /* is a URL - check protocol */
+        emit_str(OP_URL, word);     /* is a URL - check protocol */
     }
     else {
-        out->Puts(word);
+        emit_text(word);
     }
 
-    free(word);
     *line = lp;
 }
 
@@ -1469,7 +1806,7 @@ do_alpha(char** line, LineFmt* fmt)
  * do_square - accept part of text beginning with [
  */
 static void
-do_square(char** line, LineFmt* fmt, ParseState * pfmt)
+do_square(char** line, char* end, LineFmt* fmt, ParseState * pfmt)
 {
     char* lp;
     bool done;
@@ -1480,38 +1817,36 @@ do_square(char** line, LineFmt* fmt, ParseState * pfmt)
 
     if (isdigit((unsigned char)*lp)) {
         /* for shure, this is a footnote */
-        char*	footnote;
+        Span	footnote;
 
 	while (isdigit((unsigned char)*lp))
 	    lp++;
         get_space(&lp);
-        footnote = get_square(&lp);
-        out->Footnote(footnote);
-	free(footnote);
+        footnote = get_square(&lp, end);
+        emit_str(OP_FOOTNOTE, footnote);
     }
     else if (islower((unsigned char)*lp)) {
-	char*	word;
+	Span	word;
+	char	buf[MAX_WIKINAME];
 
         word = get_alnum(&lp);
         switch (*lp) {
         case ':':
             /* check, if it was an URL kind of string */
             if (is_url(word)) {
-                lp -= strlen(word);		// back up to start of URL
-                free(word);
+                lp -= word.len;		// back up to start of URL
 		word = get_url(&lp);
 
                 get_space(&lp);
                 if (*lp == ']') {
                     /* is a URL - check protocol */
-                    out->image_url(word);
+                    emit_str(OP_IMAGE_URL, word);
                 }
                 else {
-                    char * text;
+                    Span text;
 
-                    text = get_square(&lp);	/* jumps over ] */
-                    out->external_link(word, text);
-                    free(text);
+                    text = get_square(&lp, end);	/* jumps over ] */
+                    emit_link(word, text);
                 }
 	    }
 	    else
@@ -1521,114 +1856,48 @@ do_square(char** line, LineFmt* fmt, ParseState * pfmt)
 
         case '=':
 	    /* may be, it's a dynamic list */
-            if (!strcmp(word, "pages")) {
+            if (span_is(word, "pages")) {
                 lp++;
-                free(word);
-                word = get_square(&lp);
-		do_list(pagelist_search_title(word, NULL), SHOW_DATE|SHOW_OWNER);
+                word = get_square(&lp, end);
+		emit_str(OP_PAGES, word);
             }
-            else if (!strcmp(word, "topic")) {
+            else if (span_is(word, "topic")) {
                 lp++;
-		free(word);
-                word = get_square(&lp);
-                do_list(pagelist_search_topic(word), SHOW_DATE|SHOW_OWNER);
+                word = get_square(&lp, end);
+                emit_str(OP_TOPIC, word);
             }
-	    else if (!strcmp(word, "category")) {
+	    else if (span_is(word, "category")) {
                 lp++;
-		free(word);
-                word = get_square(&lp);
-                do_list(pagelist_in_category(word), SHOW_DATE|SHOW_OWNER);
+                word = get_square(&lp, end);
+                emit_str(OP_CATEGORY, word);
             }
 	    else
 		done = false;
 	    break;
 
         default:
-            /* see, if the word is an image */
-	    if (is_image(word))
-		out->image(word);
+            /* see, if the word is an image, parse it again, when
+             * imagedir changes */
+	    parse_images = true;
+	    if (is_image(span_string(word, buf, sizeof(buf))))
+		emit_str(OP_IMAGE, word);
 	    else
 		done = false;
 	}
-	free(word);
     }
     else if (isupper((unsigned char)*lp)) {
-	char*	word;
+	Span	word;
+	int	i;
 
 	/* see, if the word is one of the special commands */
-	word = get_square(&lp);
-	if (strcmp(word, "RecentChanges") == 0)
-	    do_changes();
-	else if (strcmp(word, "EditForm") == 0)
-	    do_editform();
-	else if (strcmp(word, "PageIndex") == 0)
-	    do_index();
-	else if (strcmp(word, "PageList") == 0)
-	    do_pagelist();
-	else if (strcmp(word, "UserList") == 0)
-	    do_userlist();
-	else if (strcmp(word, "GroupList") == 0)
-	    do_grouplist();
-	else if (strcmp(word, "PageHistory") == 0)
-	    do_history();
-	else if (strcmp(word, "PageDiffs") == 0)
-	    do_diffs();
-	else if (strcmp(word, "ReverseList") == 0)
-	    do_reverselist();
-	else if (strcmp(word, "SearchList") == 0)
-	    do_searchlist();
-	else if (strcmp(word, "CategoryList") == 0)
-	    do_categorylist();
-	else if (strcmp(word, "SearchText") == 0)
-	    do_searchtext();
-#if 0
-	else if (strcmp(word, "SupportAnswer") == 0)
-	    do_answer(pfmt);
-	else if (strcmp(word, "SupportQuestion") == 0)
-	    do_question();
-#endif
-	else if (strcmp(word, "PageSource") == 0)
-	    do_sourceform();
-	else if (strcmp(word, "PasswordReset") == 0)
-	    do_pwreset();
-	else if (strcmp(word, "MainMemory") == 0)
-	    do_memusage();
-	else if (strcmp(word, "DiskUsage") == 0)
-	    do_diskusage();
-	else if (strcmp(word, "PageCount") == 0)
-	    do_pagecount();
-	else if (strcmp(word, "PageName") == 0)
-	    do_pagename();
-	else if (strcmp(word, "WikiName") == 0)
-	    do_wikiname();
-	else if (strcmp(word, "OperatingSystem") == 0)
-	    do_os();
-	else if (strcmp(word, "MachineName") == 0)
-	    do_machine();
-	else if (strcmp(word, "UserName") == 0)
-	    do_user();
-	else if (strcmp(word, "ActualDate") == 0)
-	    do_date();
-	else if (strcmp(word, "ActualTime") == 0)
-	    do_time();
-	else if (strcmp(word, "ShortDate") == 0)
-	    do_shortdate();
-	else if (strcmp(word, "TarBackup") == 0)
-	    do_tarbackup();
-	else if (strcmp(word, "ErrorMessage") == 0)
-	    do_errormsg();
-	else if (strcmp(word, "ErrorDescription") == 0)
-	    do_errordsc();
-	else if (strcmp(word, "PageCalls") == 0)
-	    do_calls();
-	else if (strcmp(word, "DailyCalls") == 0)
-	    do_dailycalls();
-	else if (strcmp(word, "WikiStart") == 0)
-	    do_wikistart();
+	word = get_square(&lp, end);
+	for (i = 0; macros[i].name != NULL; i++)
+	    if (span_is(word, macros[i].name))
+		break;
+	if (macros[i].name != NULL)
+	    emit_num(OP_MACRO, i, 0);
 	else
 	    done = false;
-
-	free(word);
     }
     else
         done = false;
@@ -1636,10 +1905,10 @@ do_square(char** line, LineFmt* fmt, ParseState * pfmt)
     if (done == false) {
 	lp = *line;             /* forget it all */
 	lp++;                   /* jump over [ */
-        out->Putc('[');
+        emit_char('[');
     }
     else {
-	if (*lp)
+	if (lp < end)
 	    lp++;       /* skip the closing ']', if there */
     }
 
@@ -1651,7 +1920,7 @@ do_square(char** line, LineFmt* fmt, ParseState * pfmt)
  * do_pipe - accept part of text beginning |
  */
 static void
-do_pipe(char** line, ParseState * pfmt)
+do_pipe(char** line, char* end, ParseState * pfmt)
 {
     char* lp;
 
@@ -1660,13 +1929,13 @@ do_pipe(char** line, ParseState * pfmt)
 
     if (pfmt->table ) {
         get_space(&lp);        /* strip leading spaces */
-        if (is_cell(lp))
-            do_cell(&lp, pfmt);
+        if (is_cell(lp, end))
+            do_cell(&lp, end, pfmt);
         get_space(&lp);
     }
     else {
         /* we are not in a Table */
-        out->Putc('|');
+        emit_char('|');
     }
     *line = lp;
 }
@@ -1681,16 +1950,16 @@ do_linestart(ParseState * state)
 {
     /* write needed formatting for the line output */
     if (state->indent)
-        out->ListItemBegin();
+        emit(OP_LISTITEM_BEGIN);
 
     else if (state->table) {     /* table row */
         if (state->table == 2)      /* table header */
-            out->TableHeadBegin();
+            emit(OP_TABLEHEAD_BEGIN);
         else
-            out->TableRowBegin();
+            emit(OP_TABLEROW_BEGIN);
     }
     else
-	out->LineBegin();
+	emit(OP_LINE_BEGIN);
 }
 
 /*
@@ -1700,19 +1969,19 @@ static void
 do_lineend(ParseState * state)
 {
     if (!state->table && !state->indent)
-	out->LineEnd();
+	emit(OP_LINE_END);
 
     /* write line ending formats */
     if (state->table) {     		/* table row */
         if (state->table == 2) {		/* table header */
-            out->TableHeadEnd();
+            emit(OP_TABLEHEAD_END);
             state->table = 1;
         }
         else
-            out->TableRowEnd();
+            emit(OP_TABLEROW_END);
     }
     else if (state->indent)
-        out->ListItemEnd();
+        emit(OP_LISTITEM_END);
 }
 
 
@@ -1724,7 +1993,7 @@ do_lineend(ParseState * state)
  * text and headings, the actual paragraph state needs to be passed.
  */
 static void
-do_string(char* lp, ParseState * state)
+do_string(char* lp, char* end, ParseState * state)
 {
     LineFmt	fmt;
     char ch;
@@ -1735,25 +2004,26 @@ do_string(char* lp, ParseState * state)
     fmt.number = false;
 
     if (fmt.italic)
-        out->ItalicBegin();
+        emit(OP_ITALIC_BEGIN);
 
     /* No formatting, if preformatted text or heading */
     if ( state->head || state->pre) {
-        out->Puts(lp);
+        emit_text(make_span(lp, end));
     }
     else {
-        while ((ch = *lp)) {
+        while (lp < end) {
+            ch = *lp;
             switch (ch) {
             case '\'':
                 do_quote(&lp, &fmt);
                 break;
 
             case '[':
-                do_square(&lp, &fmt, state);
+                do_square(&lp, end, &fmt, state);
                 break;
 
             case '|':
-                do_pipe(&lp, state);
+                do_pipe(&lp, end, state);
                 break;
 
             default:
@@ -1761,7 +2031,7 @@ do_string(char* lp, ParseState * state)
                     do_alpha(&lp, &fmt);
                 }
                 else {
-                    out->Putc(ch);
+                    emit_char(ch);
                     lp++;
                 }
             }
@@ -1770,9 +2040,9 @@ do_string(char* lp, ParseState * state)
 
     /* these formats are just valid for ONE line, so end them  */
     if (fmt.bold)
-        out->BoldEnd();
+        emit(OP_BOLD_END);
     if (fmt.italic)
-        out->ItalicEnd();
+        emit(OP_ITALIC_END);
 }
 
 
@@ -1790,36 +2060,36 @@ set_state(ParseState* beg_state, ParseState* end_state)
 {
     // turn ruler on
     if (beg_state->ruler && !end_state->ruler) {
-        out->RulerEnd();
+        emit(OP_RULER_END);
         beg_state->ruler = false;
     }
 
     // turn table formatting off
     if (beg_state->table && !end_state->table) {
-        out->TableEnd();
+        emit(OP_TABLE_END);
         beg_state->table = 0;
     }
 
     // turn heading off
     if (beg_state->head && !end_state->head) {
-        out->HeadingEnd(beg_state->head);
+        emit_num(OP_HEADING_END, beg_state->head, 0);
         beg_state->head = 0;
     }
 
     // turn block-quotes off
     while (end_state->quote < beg_state->quote) {
-        out->BlockquoteEnd();
+        emit(OP_BLOCKQUOTE_END);
         beg_state->quote--;
     }
     // turn preformatting off
     if (beg_state->pre && !end_state->pre) {
-        out->PreEnd();
+        emit(OP_PRE_END);
         beg_state->pre = false;
     }
 
     // end paragraph
     if (beg_state->para && !end_state->para) {
-        out->ParaEnd();
+        emit(OP_PARA_END);
         beg_state->para = false;
     }
 
@@ -1827,55 +2097,55 @@ set_state(ParseState* beg_state, ParseState* end_state)
     while (end_state->indent < beg_state->indent) {
         beg_state->indent--;
         if (beg_state->indents[beg_state->indent] == 'o')
-            out->NumListEnd();
+            emit(OP_NUMLIST_END);
         else
-            out->ListEnd();
+            emit(OP_LIST_END);
     }
 
     // increase indent, if we had not been in preformatted before
     while (end_state->indent > beg_state->indent) {
         beg_state->indents[beg_state->indent] = end_state->indents[beg_state->indent];
         if (beg_state->indents[beg_state->indent] == 'o')
-            out->NumListBegin();
+            emit(OP_NUMLIST_BEGIN);
         else
-            out->ListBegin();
+            emit(OP_LIST_BEGIN);
         beg_state->indent++;
     }
 
     // begin paragraph
     if (end_state->para && !beg_state->para) {
-        out->ParaBegin();
+        emit(OP_PARA_BEGIN);
         beg_state->para = true;
     }
 
     // turn preformatting on, if we had not been in a list before
     if (end_state->pre && !beg_state->pre) {
-        out->PreBegin();
+        emit(OP_PRE_BEGIN);
         beg_state->pre = true;
     }
     // turn block-quotes on
     while (end_state->quote > beg_state->quote)
     {
-        out->BlockquoteBegin();
+        emit(OP_BLOCKQUOTE_BEGIN);
         beg_state->quote++;
     }
 
     // turn heading on
     if (end_state->head && !beg_state->head)
     {
-        out->HeadingBegin(end_state->head);
+        emit_num(OP_HEADING_BEGIN, end_state->head, 0);
         beg_state->head = end_state->head;
     }
 
     // start table formatting
     if (end_state->table && !beg_state->table) {
-        out->TableBegin(end_state->cells);
+        emit_num(OP_TABLE_BEGIN, end_state->cells, 0);
         beg_state->table = end_state->table;
     }
 
     // start ruler
     if (end_state->ruler && !beg_state->ruler) {
-        out->RulerBegin();
+        emit(OP_RULER_BEGIN);
         beg_state->ruler = end_state->ruler;
     }
 }
@@ -1896,7 +2166,7 @@ reset_state(ParseState * state)
 
 
 static char*
-change_state(char* line, ParseState * state)
+change_state(char* line, char* end, ParseState * state)
 {
     ParseState	newstate;
     int		spaces;
@@ -1911,7 +2181,7 @@ change_state(char* line, ParseState * state)
 
     reset_state(&newstate);
 
-    switch (*lp) {
+    switch (lp < end ? *lp : '\0') {
     case '\0':
         /* empty line - change nothing */
         break;
@@ -1995,7 +2265,7 @@ change_state(char* line, ParseState * state)
             newstate.table++;
             lp++;
         }
-        count_cells(lp, &newstate);
+        count_cells(lp, end, &newstate);
         break;
 
     case '>':
@@ -2013,7 +2283,7 @@ change_state(char* line, ParseState * state)
             lp2 = lp;
             while (*lp2 == '-')
                 lp2++;
-            if (!*lp2 && (lp2 - lp >= 4)) {
+            if (lp2 == end && (lp2 - lp >= 4)) {
                 newstate.ruler = true;
             }
         }
@@ -2036,55 +2306,334 @@ change_state(char* line, ParseState * state)
 static void
 do_line(char ** text, ParseState * state)
 {
-    char* line;
+    Span line;
+    char* end;
     char* string;
 
     /* get next line */
     line = get_line(text);
+    end = line.str + line.len;
 
     /* set attributes for line and return where we are */
-    string = change_state(line, state);
+    string = change_state(line.str, end, state);
 
     /* write line, if it is no ruler */
     if (!state->ruler && !state->comment) {
         do_linestart(state);
-        do_string(string, state);
+        do_string(string, end, state);
         do_lineend(state);
     }
-    free(line);
 }
 
 
 
 /*
- * OutputPage -  write out a page with a choosen output option
+ * parse_page - parse the text of a page into steps
  *
- * load the page text and print it line by line
-*/
-static void
-do_page(Page * page, int mode)
+ * load the page text and parse it line by line. Returns NULL, if there
+ * is no text or no memory.
+ */
+static ParseCode *
+parse_page(Page * page)
 {
+    ParseCode *	code;
     char*	text;
     bool 	loaded;
     ParseState	state;
     ParseState	newstate;
-
-    page_load_text(page, &loaded);
-    out->page_header(page, mode);
+    struct stat	sbuf;
+    TraceSpan	span;
+
+    /* images added while parsing are seen next time, as are those of
+     * the second imagedir did change in */
+    if (stat(wiki_get_imagedir(), &sbuf) < 0)
+	sbuf.st_mtime = 0;
+    else if (sbuf.st_mtime >= time(NULL))
+	sbuf.st_mtime = -1;
+    if (!page_load_text(page, &loaded))
+	return NULL;
+
+    TRACE_BEGIN(&span, "parse_page", page_get_name(page));
+    parse_count = 0;
+    parse_len = 0;
+    parse_images = false;
+    parse_failed = false;
 
     reset_state(&state);
     text = page_get_text(page);
-    if (text) {
-        while (*text)
-            do_line(&text, &state);
-    }
+    while (*text)
+	do_line(&text, &state);
 
     /* end the last paragraph, list or table */
     reset_state(&newstate);
     set_state(&state, &newstate);
+    page_unload_text(page, loaded);
+
+    code = NULL;
+    if (!parse_failed)
+	code = malloc(sizeof(ParseCode) + parse_count * sizeof(ParseOp) +
+		      parse_len);
+    if (code) {
+	code->size = sizeof(ParseCode) + parse_count * sizeof(ParseOp) +
+	    parse_len;
+	code->users = 1;
+	code->count = parse_count;
+	code->images = parse_images;
+	code->imagetime = sbuf.st_mtime;
+	code->ops = (ParseOp *)(code + 1);
+	code->strings = (char *)(code->ops + parse_count);
+	memcpy(code->ops, parse_ops, parse_count * sizeof(ParseOp));
+	memcpy(code->strings, parse_strings, parse_len);
+    }
+    TRACE_END(&span);
+    return code;
+}
+
+
+
+/*
+ * do_wikiword - write a link to a page, if the reader may see it
+ */
+static void
+do_wikiword(char * word)
+{
+    Page*	page;
+
+    page = pagelist_find_page(word);
+    if (page != NULL) {
+	if (page_is_seen(page))
+	    out->InternalLink(page_get_name(page),
+			      page_get_title(page),
+			      page_get_type(page)
+			     );
+	else
+	    out->Puts(page_get_title(page));
+    }
+    else {
+	/* link to not yet written WikiWord page */
+	out->BrokenLink(word);
+    }
+}
+
+
+
+/*
+ * do_code - write a parsed page with the choosen output option
+ */
+static void
+do_code(ParseCode * code)
+{
+    ParseOp *	op;
+    ParseOp *	end;
+    char *	str;
+    TraceSpan	span;
+
+    end = code->ops + code->count;
+    for (op = code->ops; op < end; op++) {
+	str = code->strings + op->arg;
+	switch (op->code) {
+	case OP_TEXT:
+	    out->PutsN(str, op->len);
+	    break;
+	case OP_PARA_BEGIN:
+	    out->ParaBegin();
+	    break;
+	case OP_PARA_END:
+	    out->ParaEnd();
+	    break;
+	case OP_PRE_BEGIN:
+	    out->PreBegin();
+	    break;
+	case OP_PRE_END:
+	    out->PreEnd();
+	    break;
+	case OP_BLOCKQUOTE_BEGIN:
+	    out->BlockquoteBegin();
+	    break;
+	case OP_BLOCKQUOTE_END:
+	    out->BlockquoteEnd();
+	    break;
+	case OP_RULER_BEGIN:
+	    out->RulerBegin();
+	    break;
+	case OP_RULER_END:
+	    out->RulerEnd();
+	    break;
+	case OP_LIST_BEGIN:
+	    out->ListBegin();
+	    break;
+	case OP_LIST_END:
+	    out->ListEnd();
+	    break;
+	case OP_NUMLIST_BEGIN:
+	    out->NumListBegin();
+	    break;
+	case OP_NUMLIST_END:
+	    out->NumListEnd();
+	    break;
+	case OP_LISTITEM_BEGIN:
+	    out->ListItemBegin();
+	    break;
+	case OP_LISTITEM_END:
+	    out->ListItemEnd();
+	    break;
+	case OP_LINE_BEGIN:
+	    out->LineBegin();
+	    break;
+	case OP_LINE_END:
+	    out->LineEnd();
+	    break;
+	case OP_HEADING_BEGIN:
+	    out->HeadingBegin(op->arg);
+	    break;
+	case OP_HEADING_END:
+	    out->HeadingEnd(op->arg);
+	    break;
+	case OP_FOOTNOTE:
+	    out->Footnote(str);
+	    break;
+	case OP_BOLD_BEGIN:
+	    out->BoldBegin();
+	    break;
+	case OP_BOLD_END:
+	    out->BoldEnd();
+	    break;
+	case OP_ITALIC_BEGIN:
+	    out->ItalicBegin();
+	    break;
+	case OP_ITALIC_END:
+	    out->ItalicEnd();
+	    break;
+	case OP_TABLE_BEGIN:
+	    out->TableBegin(op->arg);
+	    break;
+	case OP_TABLE_END:
+	    out->TableEnd();
+	    break;
+	case OP_TABLEHEAD_BEGIN:
+	    out->TableHeadBegin();
+	    break;
+	case OP_TABLEHEAD_END:
+	    out->TableHeadEnd();
+	    break;
+	case OP_TABLEROW_BEGIN:
+	    out->TableRowBegin();
+	    break;
+	case OP_TABLEROW_END:
+	    out->TableRowEnd();
+	    break;
+	case OP_TABLECELL_BEGIN:
+	    out->TableCellBegin();
+	    break;
+	case OP_TABLECELL_END:
+	    out->TableCellEnd();
+	    break;
+	case OP_TABLENUMBER_BEGIN:
+	    out->TableNumberBegin();
+	    break;
+	case OP_TABLENUMBER_END:
+	    out->TableNumberEnd();
+	    break;
+	case OP_IMAGE:
+	    out->image(str);
+	    break;
+	case OP_URL:
+	    out->url(str);
+	    break;
+	case OP_IMAGE_URL:
+	    out->image_url(str);
+	    break;
+	case OP_EXTERNAL_LINK:
+	    out->external_link(str, str + strlen(str) + 1);
+	    break;
+	case OP_WIKIWORD:
+	    do_wikiword(str);
+	    break;
+	case OP_MACRO:
+	    TRACE_BEGIN(&span, "do_square", macros[op->arg].name);
+	    macros[op->arg].write();
+	    TRACE_END(&span);
+	    break;
+	case OP_PAGES:
+	    TRACE_BEGIN(&span, "do_square", "pages");
+	    do_list(pagelist_search_title(str, NULL), SHOW_DATE|SHOW_OWNER);
+	    TRACE_END(&span);
+	    break;
+	case OP_TOPIC:
+	    TRACE_BEGIN(&span, "do_square", "topic");
+	    do_list(pagelist_search_topic(str), SHOW_DATE|SHOW_OWNER);
+	    TRACE_END(&span);
+	    break;
+	case OP_CATEGORY:
+	    TRACE_BEGIN(&span, "do_square", "category");
+	    do_list(pagelist_in_category(str), SHOW_DATE|SHOW_OWNER);
+	    TRACE_END(&span);
+	    break;
+	}
+    }
+}
+
+
+
+/*
+ * parse_hold_code - keep the code, while it is written out
+ *
+ * Readers write a page at the same time, while one of them may give
+ * the page a new code. Each one holds the code it writes.
+ */
+void
+parse_hold_code(ParseCode * code)
+{
+    __sync_fetch_and_add(&code->users, 1);
+}
+
 
+
+/*
+ * parse_free_code - give up the code, the last one frees it
+ */
+void
+parse_free_code(ParseCode * code)
+{
+    if (code && __sync_sub_and_fetch(&code->users, 1) == 0)
+	free(code);
+}
+
+
+
+/*
+ * OutputPage -  write out a page with a choosen output option
+ *
+ * The page is parsed, if it was not before or the images changed.
+*/
+static void
+do_page(Page * page, int mode)
+{
+    ParseCode *	code;
+    struct stat	sbuf;
+    TraceSpan	span;
+
+    TRACE_BEGIN(&span, "do_page", page_get_name(page));
+    code = page_get_code(page);
+    if (code && code->images) {
+	if (stat(wiki_get_imagedir(), &sbuf) < 0)
+	    sbuf.st_mtime = 0;
+	if (sbuf.st_mtime != code->imagetime) {
+	    parse_free_code(code);
+	    code = NULL;
+	}
+    }
+    if (code == NULL) {
+	code = parse_page(page);
+	page_set_code(page, code);
+    }
+
+    out->page_header(page, mode);
+    if (code)
+	do_code(code);
     out->page_footer(page, mode);
-    page_unload_text(page, loaded);
+    parse_free_code(code);
+    TRACE_END(&span);
 }
 
 
@@ -2126,7 +2675,7 @@ set_category(char * addition)
     char* category;
 
     /* Handle the hidden category setting */
-    category = var_get_val(server->variables, "cutewiki-category");
+    category = var_get_val(&server->variables, VAR_CUTEWIKI_CATEGORY);
 
 #if 0
     printf("============ set_category!\n");
@@ -2141,15 +2690,15 @@ set_category(char * addition)
 	    /* add addition to existent category in cookie and vars */
 	    snprintf(result, MAX_WIKINAME*2, "%s+%s", category, addition );
 	    svr_set_cookie(server, "cutewiki-category", result);
-	    var_del(&server->variables, "cutewiki-category");
-	    var_set(&server->variables, "cutewiki-category", result);
+	    var_del(&server->variables, VAR_CUTEWIKI_CATEGORY);
+	    var_put(&server->arena, &server->variables, VAR_CUTEWIKI_CATEGORY, result);
 	}
     }
     else {
 	if (addition != NULL) {
 	    /* set just cookie and vars for new category */
 	    svr_set_cookie(server, "cutewiki-category", addition);
-	    var_set(&server->variables, "cutewiki-category", addition);
+	    var_put(&server->arena, &server->variables, VAR_CUTEWIKI_CATEGORY, addition);
 	}
     }
 }
@@ -2180,6 +2729,11 @@ out_write_page(char * name, int mode)
 			    "bad guys that want to see things that you "
 			    "better should not see. If you just would "
 			    "have heard on your mom...");
+
+	    /* it may be gone, if the ErrorPage had to be created */
+	    page = pagelist_find_page(name);
+	    if (page == NULL)
+		return;
         }
 
 	if (page_is_category(page))
@@ -2188,9 +2742,11 @@ out_write_page(char * name, int mode)
 	out_print_page(page, mode);
     }
     else {
-        /* if it is an elemental page, create it automatically */
+        /* if it is an elemental page, create it automatically, a
+	 * reader may do so only alone, if still nobody else did */
 	if (create_is_special(name)) {
-	    if (create_special_page(name)) {
+	    svr_lock_writes(server);
+	    if (pagelist_find_page(name) || create_special_page(name)) {
 		out_write_page(name, MODE_NORMAL);
 	    }
 	    else {
@@ -2200,7 +2756,7 @@ out_write_page(char * name, int mode)
 	}
 	else {
 	    /* If page did not yet exist make one */
-	    var_set(&server->variables, "page", name);
+	    var_put(&server->arena, &server->variables, VAR_PAGE, name);
 	    out_write_page("EditPage", MODE_EDIT);
 	}
     }
@@ -2217,8 +2773,8 @@ void
 out_write_error(char * num, char * msg, char * dsc)
 {
     svr_set_response(server, num);
-    var_set(&server->variables, "errormsg", msg);
-    var_set(&server->variables, "errordsc", dsc);
+    var_put(&server->arena, &server->variables, VAR_ERRORMSG, msg);
+    var_put(&server->arena, &server->variables, VAR_ERRORDSC, dsc);
     out_write_page("ErrorPage", MODE_NORMAL);
 }
 
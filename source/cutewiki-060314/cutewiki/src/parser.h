@@ -20,6 +20,16 @@
 
 #define MAX_NUMFOOT     256
 
+/*
+ * footnotes collected for the end of a page
+ */
+typedef struct Footnote Footnote;
+struct Footnote
+{
+    char * text;
+    Footnote * next;
+};
+
 /*
  * option for different outputs
  */
@@ -28,6 +38,7 @@ struct Output
 {
     void (*Putc)(char ch);
     void (*Puts)(char * str);
+    void (*PutsN)(char * str, int len);
     void (*page_header)(Page * page, int mode);
     void (*page_footer)(Page * page, int mode);
     void (*ParaBegin)();
@@ -75,7 +86,7 @@ struct Output
 
 /* Pluggable output options */
 
-extern Output* out;
+extern __thread Output* out;
 extern Output htm;
 extern Output prt;
 extern Output txt;
@@ -84,12 +95,10 @@ extern Output rtf;
 
 
 
+void		parse_hold_code(ParseCode * code);
+void		parse_free_code(ParseCode * code);
 void		out_print_page(Page * page, int mode);
 void 		out_write_page(char * pname, int mode);
 void 		out_write_error(char *, char *, char *);
 
-char* 		get_alnum(char** string);
-
-
-
 #endif
@@ -10,12 +10,15 @@
 
 
 #include <stdio.h>
+#include <sys/time.h>
 
 #include "types.h"
 #include "config.h"
 #include "cutewiki.h"
 #include "page_list.h"
 #include "parser.h"
+#include "metrics.h"
+#include "trace.h"
 
 
 
@@ -62,11 +65,17 @@ bool
 rcs_checkin (char* pagename, char* username)
 {
     char command[MAX_PATH];
+    struct timeval started;
+    TraceSpan span;
 
     snprintf(command, MAX_PATH, "ci -q -l "
 	     "-t-'%s' -m'user: %s' %s/%s.wik >/dev/null 2>&1",
 	     pagename, username, pagepath, pagename);
+    TRACE_BEGIN(&span, "rcs_checkin", pagename);
+    gettimeofday(&started, NULL);
     system(command);
+    metrics_time(&metrics->rcs[METRICS_RCS_CI], metrics_since(&started));
+    TRACE_END(&span);
 
     return true;
 }
@@ -121,15 +130,20 @@ rcs_log (char* pagename)
     char command[MAX_PATH];
     char line[1024];
     char* token;
+    char* last;
     char rev_from[64];    	/* store the original revision */
     char rev_to[64];		/* store the changed revision */
     char date   [MAX_WIKINAME];	/* store the date */
     char user[MAX_WIKINAME];	/* store the one who did change */
+    struct timeval started;
+    TraceSpan span;
 
     snprintf(command, MAX_PATH, "rlog -zLT %s/%s.wik", pagepath, pagename);
+    gettimeofday(&started, NULL);
     pipe = popen(command, "r");
     if (pipe == NULL)
 	return false;
+    TRACE_BEGIN(&span, "rcs_log", pagename);
 
     rev_from[0] = '\0';
     rev_to[0] = '\0';
@@ -137,10 +151,10 @@ rcs_log (char* pagename)
     user[0] = '\0';
 
     while (fgets(line, sizeof(line), pipe) != NULL) {
-	token = strtok(line, " ");
+	token = strtok_r(line, " ", &last);
 	if (token != NULL) {
 	    if (strcmp("revision", token) == 0) {
-		strcpy(rev_from, strtok(NULL, " \t\n"));
+		strcpy(rev_from, strtok_r(NULL, " \t\n", &last));
 
                 /* if not last version, print the line */
 		if (strlen(rev_to) > 0) {
@@ -171,15 +185,17 @@ rcs_log (char* pagename)
 		strcpy(rev_to, rev_from); /* save older revision */
 	    }
 	    else if (strcmp("date:", token) == 0) {
-		strcpy(date, strtok(NULL, ";+"));
+		strcpy(date, strtok_r(NULL, ";+", &last));
 	    }
 	    else if (strcmp("user:", token) == 0) {
-		strcpy(user, strtok(NULL, ";+\n"));
+		strcpy(user, strtok_r(NULL, ";+\n", &last));
 	    }
 	}
     }
     fflush(pipe);
     pclose(pipe);
+    metrics_time(&metrics->rcs[METRICS_RCS_RLOG], metrics_since(&started));
+    TRACE_END(&span);
 
     return false;
 }
@@ -204,14 +220,18 @@ rcs_diff (char* pagename, char* revision1, char* revision2)
     int block_old = header;
     int line_type = normal;
     int line_old = normal;
+    struct timeval started;
+    TraceSpan span;
 
     snprintf(command, MAX_PATH, "rcsdiff -q -c -zLT "
 	     "-r%s -r%s %s/%s.wik",
 	     revision1, revision2, pagepath, pagename);
 
+    gettimeofday(&started, NULL);
     pipe = popen(command, "r");
     if (pipe == NULL)
         return false;
+    TRACE_BEGIN(&span, "rcs_diff", pagename);
 
     svr_puts(server, "<div class=\"diff\">\n");
     svr_puts(server, "<div class=\"head\">\n");
@@ -323,6 +343,8 @@ rcs_diff (char* pagename, char* revision1, char* revision2)
      */
     fflush(pipe);
     pclose(pipe);
+    metrics_time(&metrics->rcs[METRICS_RCS_RCSDIFF], metrics_since(&started));
+    TRACE_END(&span);
 
     return true;
 }
@@ -20,6 +20,7 @@
 #include <time.h>
 
 #include <unistd.h> 
+#include <pthread.h>
 
 #include "config.h"
 #include "svr.h"
@@ -179,16 +180,15 @@ request_unescape(char *str)
 char *
 request_get_methodname(httpd * server)
 {
-    static char	buf[255];
-
     switch(server->request.method) {
     case HTTP_GET:
         return("GET");
     case HTTP_POST:
         return("POST");
+    case HTTP_HEAD:
+        return("HEAD");
     default:
-        snprintf(buf,255,"Invalid method '%d'", server->request.method);
-        return(buf);
+        return("Invalid method");
     }
 }
 
@@ -198,9 +198,16 @@ request_clear(httpd * server)
     bzero(&server->request, sizeof(server->request));
 }
 
+/*
+ * request_get_method - the method, as the handlers see it
+ *
+ * A HEAD is handled like a GET, the body is dropped by the http layer.
+ */
 int
 request_get_method(httpd * server)
 {
+    if (server->request.method == HTTP_HEAD)
+        return HTTP_GET;
     return server->request.method;
 }
 
@@ -228,63 +235,130 @@ request_get_type(httpd * server)
 int
 request_get_start(httpd * server)
 {
-    return server->request.starttime;
+    return server->request.started.tv_sec * 1000L +
+        server->request.started.tv_usec / 1000;
 }
 
 
+/*
+ * request_store_pair - store one name=value pair of form data
+ *
+ * Dots are not allowed in variable names, they become "_dot_".
+ */
 static void
-request_store_data(httpd *server, char *query)
+request_store_pair(httpd *server, char *pair)
 {
-    char *cp, *cp2;
-    char var[50];
-    char *val, *tmp;
+    char	var[50];
+    char	*val;
+    int		len;
+
+    val = strchr(pair, '=');
+    if (val)
+        *val++ = 0;
+    for (len = 0; *pair && len < sizeof(var) - 6; pair++) {
+        if (*pair == '.') {
+            strcpy(var + len, "_dot_");
+            len += 5;
+        }
+        else {
+            var[len++] = *pair;
+        }
+    }
+    var[len] = 0;
+    if (len > 0)
+        var_set(&server->arena, &server->variables, var, request_unescape(val));
+}
 
-    if (!query)
-        return;
 
-    cp = query;
-    cp2 = var;
-    bzero(var,sizeof(var));
-    val = NULL;
-    while (*cp) {
-        if (*cp == '=') {
-            cp++;
-            *cp2 = 0;
-            val = cp;
-            continue;
-        }
-        if (*cp == '&') {
-            *cp = 0;
-            tmp = request_unescape(val);
-            var_set(&server->variables, var, tmp);
-            cp++;
-            cp2 = var;
-            val = NULL;
-            continue;
+
+/*
+ * request_store_data - store form data or a query string
+ *
+ * The pairs are decoded in place, data[len] must be writable.  Unless
+ * this is the last part of the data, an incomplete pair at the end is
+ * left alone.  Returns the number of bytes used.
+ */
+static int
+request_store_data(httpd *server, char *data, int len, bool last)
+{
+    char	*cp = data,
+    *end = data + len,
+    *amp;
+
+    while (cp < end) {
+        amp = memchr(cp, '&', end - cp);
+        if (amp == NULL) {
+            if (!last)
+                break;
+            amp = end;
         }
-        if (val) {
-            cp++;
+        *amp = 0;
+        request_store_pair(server, cp);
+        cp = amp + 1;
+    }
+    return (cp > end) ? len : cp - data;
+}
+
+
+
+/*
+ * request_stream_data - store form data too big for the input buffer
+ *
+ * The body is stored in parts as it arrives, only an incomplete pair
+ * is kept from one part to the next.
+ */
+static int
+request_stream_data(httpd *server)
+{
+    char	*buf = NULL,
+    *new;
+    int		size = 0,
+    len = 0,
+    got,
+    used;
+
+    while (1) {
+        if (size - len <= HTTP_READ_BUF_LEN) {
+            size = size ? size * 2 : HTTP_READ_BUF_LEN * 16;
+            new = realloc(buf, size);
+            if (new == NULL)
+                break;
+            buf = new;
         }
-        else {
-            *cp2 = *cp++;
-            if (*cp2 == '.') {
-                strcpy(cp2,"_dot_");
-                cp2 += 5;
-            }
-            else {
-                cp2++;
-            }
+        got = http_read_body(server, buf + len, size - len - 1);
+        if (got <= 0) {
+            if (got == 0)
+                request_store_data(server, buf, len, true);
+            free(buf);
+            return got;
         }
+        len += got;
+        if (memchr(buf + len - got, '&', got) == NULL)
+            continue;
+        used = request_store_data(server, buf, len, false);
+        len -= used;
+        memmove(buf, buf + used, len);
     }
-    *cp = 0;
-    tmp = request_unescape(val);
-    var_set(&server->variables, var, tmp);
+    free(buf);
+    return -1;
 }
 
 
 
-static int
-request_decode (char *bufcoded, char *bufplain, int outbufsize)
+static unsigned char pr2six[256];
+static pthread_once_t pr2six_once = PTHREAD_ONCE_INIT;
+
+/* single character decode */
+#define DEC(c) pr2six[(int)c]
+#define _DECODE_MAXVAL 63
+
+/*
+ * request_init_decode - initialize the base64 mapping table
+ *
+ * This code should work even on non-ASCII machines.
+ */
+static void
+request_init_decode (void)
 {
     static char six2pr[64] = {
         'A','B','C','D','E','F','G','H','I','J','K','L','M',
@@ -293,29 +367,24 @@ request_decode (char *bufcoded, char *bufplain, int outbufsize)
         'n','o','p','q','r','s','t','u','v','w','x','y','z',
         '0','1','2','3','4','5','6','7','8','9','+','/'
     };
+    int j;
 
-    static unsigned char pr2six[256];
+    for (j=0; j<256; j++) pr2six[j] = _DECODE_MAXVAL+1;
+    for (j=0; j<64; j++) pr2six[(int)six2pr[j]] = (unsigned char)j;
+}
 
-    /* single character decode */
-#define DEC(c) pr2six[(int)c]
-#define _DECODE_MAXVAL 63
 
-    static int first = 1;
 
-    int nbytesdecoded, j;
+static int
+request_decode (char *bufcoded, char *bufplain, int outbufsize)
+{
+    int nbytesdecoded;
     char *bufin = bufcoded;
     unsigned char *bufout = (unsigned char*)bufplain;
     int nprbytes;
 
-    /*
-     ** If this is the first call, initialize the mapping table.
-     ** This code should work even on non-ASCII machines.
-     */
-    if (first) {
-        first = 0;
-        for (j=0; j<256; j++) pr2six[j] = _DECODE_MAXVAL+1;
-        for (j=0; j<64; j++) pr2six[(int)six2pr[j]] = (unsigned char)j;
-    }
+    /* the table is shared by all workers, fill it exactly once */
+    pthread_once(&pr2six_once, request_init_decode);
 
     /* Strip leading whitespace. */
 
@@ -332,7 +401,8 @@ request_decode (char *bufcoded, char *bufplain, int outbufsize)
     nprbytes = bufin - bufcoded - 1;
     nbytesdecoded = ((nprbytes+3)/4) * 3;
     if (nbytesdecoded > outbufsize) {
-        nprbytes = (outbufsize*4)/3;
+        nprbytes = outbufsize / 3 * 4;
+        nbytesdecoded = nprbytes / 4 * 3;
     }
     bufin = bufcoded;
 
@@ -416,143 +486,324 @@ request_sanitise_url(char *url)
 
 
 
-int
-request_read(httpd * server, char * req)
+/*
+ * request_get_encodings - read the content codings a client takes
+ *
+ * Codings with a quality of 0 are refused by the client.
+ */
+static int
+request_get_encodings(char *list)
 {
-    int	count;
-    int in_headers;
-    char *cp, *cp2;
-
-    server->request.starttime = get_time();     /* for time measurement */
-
-    /* Read the request */
-    count = 0;
-    in_headers = 1;
-    while(http_read_line(server, req, HTTP_MAX_LEN) > 0) {
-
-        /* Special case for the first line.  */
-	count++;
-        if (count == 1) {
-            /* First line.  Scan the request info */
-            cp = cp2 = req;
-            while(isalpha(*cp2))
-                cp2++;
-            *cp2 = 0;
-            if (strcasecmp(cp,"GET") == 0)
-                server->request.method = HTTP_GET;
-            if (strcasecmp(cp,"POST") == 0)
-                server->request.method = HTTP_POST;
-	    if (server->request.method == 0) {
-                /* method unknown */
-		return(-1);
-            }
-            cp = cp2+1;
-            while(*cp == ' ')
-                cp++;
-            cp2 = cp;
-            while(*cp2 != ' ' && *cp2 != 0)
-                cp2++;
-            *cp2 = 0;
-            strncpy(server->request.path,cp,HTTP_MAX_URL);
-	    request_sanitise_url(server->request.path);
-            continue;
+    char	*cp, *end, *param;
+    int		len, result = 0;
+
+    for (cp = list; *cp; cp = end) {
+        while (*cp == ' ' || *cp == ',')
+            cp++;
+        end = cp + strcspn(cp, ",");
+        len = strcspn(cp, " ;,");
+        param = memchr(cp, ';', end - cp);
+        if (param) {
+            param = strstr(param, "q=");
+            if (param && param < end && atof(param + 2) == 0)
+                continue;
         }
+        if (len == 4 && strncasecmp(cp, "gzip", 4) == 0)
+            result |= HTTP_ENC_GZIP;
+        if (len == 7 && strncasecmp(cp, "deflate", 7) == 0)
+            result |= HTTP_ENC_DEFLATE;
+        if (len == 1 && *cp == '*')
+            result |= HTTP_ENC_GZIP | HTTP_ENC_DEFLATE;
+    }
+    return result;
+}
 
-        /* Process the headers */
-        if (in_headers) {
-            if (*req == 0) {
-                /* End of headers.  Continue if there's data to read */
-                if (server->request.contentLength == 0)
-                    break;
-                in_headers = 0;
-                break;
-            }
-            if (strncasecmp(req,"Cookie: ",7) == 0) {
-                char	*var,
-                *val,
-                *end;
-
-                var = index(req,':');
-                while(var) {
-                    var++;
-                    val = index(var, '=');
-                    *val = 0;
-                    val++;
-                    end = index(val,';');
-		    if(end)
-			*end = 0;
-                    var_set(&server->variables, var, val);
-                    var = end;
-                }
-            }
-            if (strncasecmp(req,"Authorization: ",15) == 0) {
-                cp = index(req,':') + 2;
-                if (strncmp(cp,"Basic ", 6) != 0) {
-                    /* Unknown auth method */
-                }
-                else {
-                    char 	authBuf[100];
-
-                    cp = index(cp,' ') + 1;
-                    request_decode(cp, authBuf, 100);
-                    server->request.authLength = strlen(authBuf);
-                    cp = index(authBuf,':');
-                    if (cp) {
-                        *cp = 0;
-                        strncpy(server->request.authPassword,
-                                cp+1, HTTP_MAX_AUTH);
-                    }
-                    strncpy(server->request.authUser,
-                            authBuf, HTTP_MAX_AUTH);
-                }
-            }
-            if (strncasecmp(req,"Referer: ",9) == 0) {
-                cp = index(req,':') + 2;
-                if(cp) {
-                    strncpy(server->request.referer,cp,
-			    HTTP_MAX_URL);
-                }
-            }
-            if (strncasecmp(req,"If-Modified-Since: ",19) == 0) {
-                cp = index(req,':') + 2;
-                if(cp) {
-                    strncpy(server->request.ifModified,cp,
-                            HTTP_MAX_URL);
-                    cp = index(server->request.ifModified,
-                               ';');
-                    if (cp)
-                        *cp = 0;
-                }
-            }
-            if (strncasecmp(req,"Content-Type: ",14) == 0) {
-                cp = index(req,':') + 2;
-                if(cp) {
-                    strncpy(server->request.contentType,cp,
-                            HTTP_MAX_URL);
-                }
-            }
-            if (strncasecmp(req,"Content-Length: ",16) == 0) {
-                cp = index(req,':') + 2;
-                if(cp)
-                    server->request.contentLength = atoi(cp);
-            }
+
+
+/*
+ * request_cut_line - terminate the header line at cp in place
+ *
+ * Returns the start of the next line.
+ */
+static char *
+request_cut_line(char *cp, char *last)
+{
+    char	*end;
+
+    end = memchr(cp, '\n', last - cp);
+    if (end == NULL)
+        return last;
+    *end = 0;
+    if (end > cp && end[-1] == '\r')
+        end[-1] = 0;
+    return end + 1;
+}
+
+
+
+/*
+ * request_store_auth - decode the user and password of basic auth
+ */
+static void
+request_store_auth(httpd *server, char *value)
+{
+    char	authBuf[100];
+    char	*cp;
+
+    if (strncmp(value, "Basic ", 6) != 0)
+        return;         /* Unknown auth method */
+    request_decode(value + 6, authBuf, sizeof(authBuf) - 1);
+    server->request.authLength = strlen(authBuf);
+    cp = index(authBuf, ':');
+    if (cp) {
+        *cp = 0;
+        strncpy(server->request.authPassword, cp + 1, HTTP_MAX_AUTH);
+    }
+    strncpy(server->request.authUser, authBuf, HTTP_MAX_AUTH);
+}
+
+
+
+/*
+ * request_get_ranges - read the byte ranges of a Range header
+ *
+ * Like "bytes=0-99,200-,-50". If one of them can not be read or there
+ * are too many, the whole file is sent.
+ */
+static void
+request_get_ranges(httpReq *req, char *value)
+{
+    httpRange	*range;
+    char	*cp, *end;
+
+    req->rangeCount = 0;
+    if (strncasecmp(value, "bytes=", 6) != 0)
+        return;
+    cp = value + 6;
+    while (*cp) {
+        while (*cp == ' ' || *cp == ',')
+            cp++;
+        if (*cp == 0)
+            break;
+        if (req->rangeCount == HTTP_MAX_RANGES)
+            goto ignore;
+        range = &req->ranges[req->rangeCount++];
+        range->first = range->last = -1;
+        if (isdigit(*cp)) {
+            range->first = strtoll(cp, &end, 10);
+            cp = end;
+        }
+        if (*cp++ != '-')
+            goto ignore;
+        if (isdigit(*cp)) {
+            range->last = strtoll(cp, &end, 10);
+            cp = end;
+        }
+        else if (range->first < 0)
+            goto ignore;                /* neither first nor last */
+        if (range->first >= 0 && range->last >= 0 &&
+            range->last < range->first)
+            goto ignore;
+        while (*cp == ' ')
+            cp++;
+        if (*cp != ',' && *cp != 0)
+            goto ignore;
+    }
+    return;
+
+ignore:
+    req->rangeCount = 0;
+}
+
+
+
+/*
+ * request_store_cookies - store the cookies as variables
+ */
+static void
+request_store_cookies(httpd *server, char *value)
+{
+    char	*name,
+    *val,
+    *end;
+
+    for (name = value; *name; name = end) {
+        while (*name == ' ' || *name == ';')
+            name++;
+        end = name + strcspn(name, ";");
+        if (*end)
+            *end++ = 0;
+        val = strchr(name, '=');
+        if (val == NULL)
             continue;
+        *val++ = 0;
+        var_set(&server->arena, &server->variables, name, val);
+    }
+}
+
+
+
+/*
+ * request_header - note a header the server is interested in
+ *
+ * The value stays in the request buffer.
+ */
+static void
+request_header(httpd *server, char *name, int len, char *value)
+{
+    httpReq	*req = &server->request;
+
+#define HEADER_IS(s)	(len == sizeof(s) - 1 && strncasecmp(name, s, len) == 0)
+    switch (tolower(*name)) {
+    case 'a':
+        if (HEADER_IS("Accept-Encoding"))
+            req->acceptEncoding = request_get_encodings(value);
+        else if (HEADER_IS("Authorization"))
+            request_store_auth(server, value);
+        break;
+    case 'c':
+        if (HEADER_IS("Cookie"))
+            request_store_cookies(server, value);
+        else if (HEADER_IS("Connection")) {
+            if (strncasecmp(value, "close", 5) == 0)
+                req->keepAlive = false;
+            if (strncasecmp(value, "keep-alive", 10) == 0)
+                req->keepAlive = true;
+        }
+        else if (HEADER_IS("Content-Type"))
+            req->contentType = value;
+        else if (HEADER_IS("Content-Length"))
+            req->contentLength = atoi(value);
+        break;
+    case 'i':
+        if (HEADER_IS("If-Modified-Since")) {
+            req->ifModified = value;
+            value[strcspn(value, ";")] = 0;
         }
+        else if (HEADER_IS("If-None-Match"))
+            req->ifNoneMatch = value;
+        else if (HEADER_IS("If-Range"))
+            req->ifRange = value;
+        break;
+    case 'r':
+        if (HEADER_IS("Referer"))
+            req->referer = value;
+        else if (HEADER_IS("Range"))
+            request_get_ranges(req, value);
+        break;
+    case 't':
+        if (HEADER_IS("Transfer-Encoding"))
+            req->transferEncoding = true;
+        break;
+    case 'u':
+        if (HEADER_IS("User-Agent"))
+            req->userAgent = value;
+        break;
     }
+#undef HEADER_IS
+}
+
+
 
-    /* Process POST data */
-    if (server->request.contentLength > 0) {
-        bzero(req, HTTP_MAX_LEN);
-        http_read_buf(server, req, server->request.contentLength);
-        request_store_data(server, req);
+/*
+ * request_read - parse the request the reactor has buffered
+ *
+ * Nothing is copied, the lines are terminated in place and the values
+ * point into the buffer.  Returns -1 for an unknown method, -2 if
+ * the client went away while sending the body and -3 for a body with
+ * a transfer encoding. The reactor only knows the Content-Length, so
+ * the connection is not kept then.
+ */
+int
+request_read(httpd * server)
+{
+    httpReq	*req = &server->request;
+    httpConn	*conn = server->conn;
+    char	*cp, *next, *last, *value;
+    int		len;
+
+    gettimeofday(&req->started, NULL);
+
+    /* the request ends with a 0 byte, use it for missing headers */
+    cp = server->readBufPtr;
+    last = cp + conn->headLen;
+    req->path = req->userAgent = req->referer = req->ifModified =
+        req->ifNoneMatch = req->ifRange = req->contentType =
+        cp + conn->reqLen;
+
+    /* First line.  Scan the request info */
+    next = request_cut_line(cp, last);
+    value = cp;
+    while (isalpha(*value))
+        value++;
+    if (value - cp == 3 && strncasecmp(cp, "GET", 3) == 0)
+        req->method = HTTP_GET;
+    if (value - cp == 4 && strncasecmp(cp, "POST", 4) == 0)
+        req->method = HTTP_POST;
+    if (value - cp == 4 && strncasecmp(cp, "HEAD", 4) == 0)
+        req->method = HTTP_HEAD;
+    if (req->method == 0) {
+        /* method unknown */
+        return(-1);
+    }
+    while (*value == ' ')
+        value++;
+    req->path = value;
+    value += strcspn(value, " ");
+    if (*value)
+        *value++ = 0;
+    if (value - req->path > HTTP_MAX_URL)
+        req->path[HTTP_MAX_URL - 1] = 0;
+    request_sanitise_url(req->path);
+
+    /* HTTP/1.1 keeps the connection by default */
+    while (*value == ' ')
+        value++;
+    if (strncasecmp(value, "HTTP/1.", 7) == 0 && isdigit(value[7]) &&
+        value[7] != '0')
+        req->version = 11;
+    else
+        req->version = 10;
+    req->keepAlive = (req->version >= 11);
+
+    /* Process the headers up to the empty line */
+    for (cp = next; cp < last && *cp != '\r' && *cp != '\n'; cp = next) {
+        next = request_cut_line(cp, last);
+        value = strchr(cp, ':');
+        if (value == NULL)
+            continue;
+        *value = 0;
+        len = value++ - cp;
+        while (*value == ' ' || *value == '\t')
+            value++;
+        request_header(server, cp, len, value);
+    }
+
+    if (req->transferEncoding) {
+        req->keepAlive = false;
+        return(-3);
+    }
+
+    /* Process POST data, a big body is read while it arrives */
+    server->readBufPtr += conn->headLen;
+    server->readBufRemain -= conn->headLen;
+    if (req->contentLength > 0) {
+        if (conn->bodyPending > 0) {
+            if (request_stream_data(server) < 0)
+                return(-2);
+        }
+        else {
+            request_store_data(server, server->readBufPtr,
+                               server->readBufRemain, true);
+        }
     }
 
     /* Process any URL data */
-    cp = index(server->request.path,'?');
+    cp = index(req->path, '?');
     if (cp != NULL) {
         *cp = 0;
         cp++;
-        request_store_data(server, cp);
+        request_store_data(server, cp, strlen(cp), true);
     }
     return(0);
 }
@@ -26,6 +26,6 @@ char * 	request_get_uri(httpd * server);
 int 	request_get_length(httpd * server);
 char * 	request_get_type(httpd * server);
 int 	request_get_start(httpd * server);
-int     request_read(httpd * server, char * req);
+int     request_read(httpd * server);
 
 #endif
@@ -34,14 +34,16 @@
 
 
 /* Global variables for wiki settings */
-extern httpd	*server;        /* this is our webserver instance */
+extern __thread httpd	*server;        /* this worker's webserver instance */
 
 
 
 /* prototypes */
 void	svr_init(void);
 void	svr_exit(void);
-httpd *	svr_new(char *, int);
+httpd *	svr_new(char *, int, int);
+httpd *	svr_new_fcgi(char *, int);
+httpd *	svr_clone(httpd *);
 void	svr_del(httpd *);
 
 int 	svr_register_string (httpd*,char*,char*,int,int(*)(),char*);
@@ -59,6 +61,7 @@ void 	svr_set_cookie (httpd*, char*, char*);
 void	svr_expire_cookie(httpd*, char*);
 void 	svr_set_response (httpd*, char*);
 
+int 	svr_start (httpd*);
 int 	svr_get_connection (httpd*, struct timeval*);
 int 	svr_read_request (httpd*);
 void 	svr_process_request (httpd*);
@@ -66,6 +69,7 @@ void 	svr_end_request (httpd*);
 
 void	svr_use_utf8 (bool);
 void 	svr_puts (httpd*, const char*);
+void 	svr_write (httpd*, const char*, int);
 void 	svr_putc (httpd *server, char ch);
 void 	svr_printf (httpd*, char*, ...);
 char*	svr_encode_url (char *);
@@ -75,10 +79,13 @@ int     svr_get_request_start();
 
 httpContent *svr_find_content (httpd*, httpDir*, char*);
 httpDir *svr_find_dir (httpd*, char*, int);
+httpContent *svr_find_route (httpd*, char*, char**);
+void	svr_foreach_route (httpd*, void (*)(char*, unsigned long));
 
 void 	svr_send_headers (httpd*);
 int 	svr_send_direntry (httpd*, httpContent*, char*);
 void 	svr_send_file (httpd*, char*);
+void 	svr_add_fileheaders (httpd*, char*, char*, char*);
 void 	svr_send_text (httpd*, char*);
 void 	svr_send_static (httpd*, char*);
 void 	svr_send_binary(httpd *, char*, int);
@@ -87,9 +94,23 @@ void 	svr_send_err403 (httpd*);
 void 	svr_send_err404 (httpd*);
 
 void 	svr_set_filebase(httpd*, char*);
+void 	svr_set_keepalive(httpd*, int, int);
+void 	svr_set_limits(httpd*, int, int, int, int);
+void 	svr_set_sync(httpd*, void (*)(), bool (*)());
+void 	svr_set_reader(httpd*, char*, char*);
+void 	svr_lock_writes(httpd*);
+void 	svr_reconfigure(httpd*);
+void 	svr_lock(httpd*);
+void 	svr_unlock(httpd*);
+int 	svr_share_port(httpd*);
+void 	svr_close_port(httpd*);
+void 	svr_stop(httpd*);
+int 	svr_connections(httpd*);
+void 	svr_set_cache(httpd*, int, int);
+void 	svr_set_compression(httpd*, int);
 void 	svr_set_errorlog(httpd*, FILE*);
 void 	svr_set_accesslog(httpd*, FILE*);
-void 	svr_write_accesslog (httpd*);
+void 	svr_write_accesslog (httpd*, long);
 void 	svr_write_errorlog (httpd*, char*, char*);
 
 
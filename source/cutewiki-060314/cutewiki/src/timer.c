@@ -0,0 +1,150 @@
+/*
+ * timer.c - a hierarchical timer wheel for connection deadlines
+ *
+ * Copyright 2005 Martin Doering
+ *
+ * This file is distributed under the GPL, version 2 or at your
+ * option any later version.  See doc/license.txt for details.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "timer.h"
+
+
+
+/*
+ * Level 0 has a slot for each of the next 64 ticks, every further
+ * level covers 64 slots of the one below. When level 0 wraps around,
+ * the next slot of level 1 is spread over it, and so on. Adding and
+ * removing a timer costs the same, how many connections there are.
+ */
+
+
+
+/*
+ * timer_init - start with empty slots
+ */
+void
+timer_init(TimerWheel *wheel, unsigned long now)
+{
+    int		level, i;
+
+    wheel->now = now;
+    for (level = 0; level < TIMER_LEVELS; level++) {
+        for (i = 0; i < TIMER_SLOTS; i++) {
+            wheel->slots[level][i].next = &wheel->slots[level][i];
+            wheel->slots[level][i].prev = &wheel->slots[level][i];
+        }
+    }
+}
+
+
+
+/*
+ * timer_add - let a timer fire at the given tick
+ *
+ * A pending timer is moved. Ticks already past fire with the next run.
+ */
+void
+timer_add(TimerWheel *wheel, Timer *timer, unsigned long expires)
+{
+    unsigned long delta;
+    Timer	*head;
+    int		level;
+
+    if (timer->next)
+        timer_del(timer);
+    timer->expires = expires;
+
+    if ((long)(expires - wheel->now) < 0)
+        expires = wheel->now;
+    delta = expires - wheel->now;
+    for (level = 0; level < TIMER_LEVELS - 1; level++) {
+        if (delta < 1UL << (TIMER_BITS * (level + 1)))
+            break;
+    }
+    if (delta >= 1UL << (TIMER_BITS * TIMER_LEVELS)) {
+        /* beyond the wheel, it is added again when cascaded */
+        expires = wheel->now + (1UL << (TIMER_BITS * TIMER_LEVELS)) - 1;
+    }
+
+    head = &wheel->slots[level][(expires >> (TIMER_BITS * level)) & TIMER_MASK];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+
+
+/*
+ * timer_del - stop a timer, if it is pending
+ */
+void
+timer_del(Timer *timer)
+{
+    if (timer->next == NULL)
+        return;
+    timer->next->prev = timer->prev;
+    timer->prev->next = timer->next;
+    timer->next = timer->prev = NULL;
+}
+
+
+
+bool
+timer_pending(Timer *timer)
+{
+    return timer->next != NULL;
+}
+
+
+
+/*
+ * timer_cascade - spread a slot of a coarser level over the finer ones
+ */
+static void
+timer_cascade(TimerWheel *wheel, Timer *head)
+{
+    Timer	*timer;
+
+    while ((timer = head->next) != head) {
+        timer_del(timer);
+        timer_add(wheel, timer, timer->expires);
+    }
+}
+
+
+
+/*
+ * timer_run - fire all timers up to the given tick
+ *
+ * The timer is stopped before fire() is called with arg, which may
+ * free it or add it again.
+ */
+void
+timer_run(TimerWheel *wheel, unsigned long now,
+          void (*fire)(Timer*, void*), void *arg)
+{
+    Timer	*head, *timer;
+    int		level, index;
+
+    while ((long)(now - wheel->now) >= 0) {
+        index = wheel->now & TIMER_MASK;
+        for (level = 1; index == 0 && level < TIMER_LEVELS; level++) {
+            index = (wheel->now >> (TIMER_BITS * level)) & TIMER_MASK;
+            timer_cascade(wheel, &wheel->slots[level][index]);
+        }
+
+        head = &wheel->slots[0][wheel->now & TIMER_MASK];
+        wheel->now++;
+        while ((timer = head->next) != head) {
+            timer_del(timer);
+            fire(timer, arg);
+        }
+    }
+}
@@ -0,0 +1,45 @@
+/*
+ * timer.h - a hierarchical timer wheel for connection deadlines
+ *
+ * Copyright 2005 Martin Doering
+ *
+ * This file is distributed under the GPL, version 2 or at your
+ * option any later version.  See doc/license.txt for details.
+ */
+
+
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "types.h"
+
+
+#define	TIMER_BITS	6
+#define	TIMER_SLOTS	(1 << TIMER_BITS)	/* slots of one level */
+#define	TIMER_MASK	(TIMER_SLOTS - 1)
+#define	TIMER_LEVELS	4			/* 64^4 ticks ahead */
+
+
+typedef struct timer {
+    struct timer	*next;		/* in the list of a slot */
+    struct timer	*prev;
+    unsigned long	expires;	/* tick to fire at */
+    void		*data;
+} Timer;
+
+typedef struct {
+    unsigned long	now;		/* next tick to be run */
+    Timer		slots[TIMER_LEVELS][TIMER_SLOTS];
+} TimerWheel;
+
+
+
+void	timer_init (TimerWheel*, unsigned long now);
+void	timer_add (TimerWheel*, Timer*, unsigned long expires);
+void	timer_del (Timer*);
+bool	timer_pending (Timer*);
+void	timer_run (TimerWheel*, unsigned long now,
+		   void (*)(Timer*, void*), void*);
+
+#endif
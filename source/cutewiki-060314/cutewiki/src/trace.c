@@ -0,0 +1,223 @@
+/*
+ * trace.c - spans of the request phases for the Chrome trace viewer
+ *
+ * Each thread keeps its last TRACE_EVENTS spans in a ring of its own,
+ * so recording takes no lock. The rings are written out as JSON in
+ * the trace event format, which chrome://tracing and Perfetto load.
+ * A ring is read while its thread goes on; events overwritten during
+ * the copy are left out.
+ *
+ * Copyright 2005 Martin Doering
+ *
+ * This file is distributed under the GPL, version 2 or at your
+ * option any later version.  See doc/license.txt for details.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "types.h"
+#include "http.h"
+#include "svr.h"
+#include "trace.h"
+
+
+
+typedef struct {
+    const char	*name;
+    long	start;
+    long	duration;
+    char	arg[TRACE_ARG_LEN];
+} TraceEvent;
+
+typedef struct trace_ring {
+    struct trace_ring *next;
+    int		tid;
+    unsigned long head;			/* events recorded so far */
+    TraceEvent	events[TRACE_EVENTS];
+} TraceRing;
+
+bool		trace_on = false;
+
+static __thread TraceRing *trace_ring;
+static TraceRing *trace_rings;
+static int	trace_threads;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/*
+ * trace_set - switch the recording of spans on or off
+ */
+void
+trace_set(bool on)
+{
+    trace_on = on;
+}
+
+
+
+static long
+trace_clock()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+
+
+/*
+ * trace_begin - start a span, arg may be NULL
+ *
+ * Arg must stay until the end of the span.
+ */
+void
+trace_begin(TraceSpan * span, const char * name, const char * arg)
+{
+    span->name = name;
+    span->arg = arg;
+    span->start = trace_clock();
+}
+
+
+
+/*
+ * trace_new_ring - give the thread a ring to record into
+ */
+static TraceRing *
+trace_new_ring()
+{
+    TraceRing	*ring;
+
+    ring = calloc(1, sizeof(TraceRing));
+    if (ring == NULL)
+        return NULL;
+    pthread_mutex_lock(&trace_lock);
+    ring->tid = ++trace_threads;
+    ring->next = trace_rings;
+    trace_rings = ring;
+    pthread_mutex_unlock(&trace_lock);
+    return ring;
+}
+
+
+
+/*
+ * trace_end - record a span in the ring of the thread
+ *
+ * The argument is copied, characters to be escaped in JSON are left
+ * out.
+ */
+void
+trace_end(TraceSpan * span)
+{
+    TraceEvent	*event;
+    const char	*cp;
+    int		len = 0;
+
+    if (trace_ring == NULL && (trace_ring = trace_new_ring()) == NULL)
+        return;
+    event = &trace_ring->events[trace_ring->head & (TRACE_EVENTS - 1)];
+    event->name = span->name;
+    event->start = span->start;
+    event->duration = trace_clock() - span->start;
+    for (cp = span->arg; cp && *cp && len < TRACE_ARG_LEN - 1; cp++)
+        if ((unsigned char) *cp >= ' ' && *cp != '"' && *cp != '\\')
+            event->arg[len++] = *cp;
+    event->arg[len] = 0;
+    __sync_synchronize();
+    trace_ring->head++;
+}
+
+
+
+/*
+ * trace_format - put the recorded spans together as JSON
+ */
+static void
+trace_format(void (*put)(void *, const char *), void * to)
+{
+    TraceRing	*ring;
+    TraceEvent	event;
+    unsigned long i, head;
+    char	line[TRACE_ARG_LEN + 160];
+    char	*sep = "";
+    int		pid = getpid();
+
+    put(to, "{\"traceEvents\":[\n");
+    pthread_mutex_lock(&trace_lock);
+    for (ring = trace_rings; ring; ring = ring->next) {
+        head = ring->head;
+        __sync_synchronize();
+        for (i = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0; i < head; i++) {
+            event = ring->events[i & (TRACE_EVENTS - 1)];
+            __sync_synchronize();
+            if (ring->head >= i + TRACE_EVENTS)
+                continue;       /* written over meanwhile */
+            snprintf(line, sizeof(line),
+                     "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                     "\"ts\":%ld.%03ld,\"dur\":%ld.%03ld,"
+                     "\"args\":{\"arg\":\"%s\"}}",
+                     sep, event.name, pid, ring->tid,
+                     event.start / 1000, event.start % 1000,
+                     event.duration / 1000, event.duration % 1000,
+                     event.arg);
+            put(to, line);
+            sep = ",\n";
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    put(to, "\n],\"displayTimeUnit\":\"ms\"}\n");
+}
+
+
+
+static void
+trace_put_server(void * to, const char * text)
+{
+    svr_puts((httpd *) to, text);
+}
+
+
+
+static void
+trace_put_file(void * to, const char * text)
+{
+    fputs(text, (FILE *) to);
+}
+
+
+
+/*
+ * trace_write - answer the request with the recorded spans
+ */
+void
+trace_write(httpd * server)
+{
+    trace_format(trace_put_server, server);
+}
+
+
+
+/*
+ * trace_save - write the recorded spans to a file
+ */
+bool
+trace_save(char * path)
+{
+    FILE	*file;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+    trace_format(trace_put_file, file);
+    return fclose(file) == 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * trace.h - spans of the request phases for the Chrome trace viewer
+ *
+ * Copyright 2005 Martin Doering
+ *
+ * This file is distributed under the GPL, version 2 or at your
+ * option any later version.  See doc/license.txt for details.
+ */
+
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "types.h"
+#include "http.h"
+
+
+#define	TRACE_EVENTS		4096	/* kept per thread, power of 2 */
+#define	TRACE_ARG_LEN		48
+
+
+/* a span being measured, start is 0 if tracing was off at its begin */
+typedef struct {
+    long	start;			/* ns of the monotonic clock */
+    const char	*name;
+    const char	*arg;
+} TraceSpan;
+
+extern bool	trace_on;
+
+/* With tracing off a span costs one test at each end. */
+#define	TRACE_BEGIN(span, name, arg)					\
+    do {								\
+	(span)->start = 0;						\
+	if (__builtin_expect(trace_on, 0))				\
+	    trace_begin(span, name, arg);				\
+    } while (0)
+
+#define	TRACE_END(span)							\
+    do {								\
+	if (__builtin_expect((span)->start != 0, 0))			\
+	    trace_end(span);						\
+    } while (0)
+
+
+
+void	trace_set (bool);
+void	trace_begin (TraceSpan*, const char*, const char*);
+void	trace_end (TraceSpan*);
+void	trace_write (httpd*);
+bool	trace_save (char*);
+
+#endif
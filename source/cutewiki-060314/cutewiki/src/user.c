@@ -10,6 +10,7 @@
 
 
 #include <crypt.h>
+#include <pthread.h>
 
 #define PAGE_PRIVATE
 
@@ -26,6 +27,10 @@
 
 static Hash * usertab;
 
+/* crypt() and the walk over a config section keep their state in one
+ * place, but readers log in at the same time */
+static pthread_mutex_t user_lock = PTHREAD_MUTEX_INITIALIZER;
+
 
 
 /*
@@ -68,7 +73,9 @@ void
 user_set_password(Page * page, const char * password)
 {
     free(page->password);
+    pthread_mutex_lock(&user_lock);
     page->password = strdup( crypt(password, "egal") );
+    pthread_mutex_unlock(&user_lock);
 }
 
 
@@ -145,15 +152,18 @@ user_check_password (Page * page, char * password)
 static bool
 user_check_raw_password (Page * page, char * password)
 {
+    bool same = false;
+
     if (page != NULL && page->password != NULL && password != NULL) {
 	char* passcrypt;
 
+	pthread_mutex_lock(&user_lock);
 	passcrypt = crypt(password, "egal");
-	if (strcmp(passcrypt, page->password) == 0)
-	    return true;
+	same = strcmp(passcrypt, page->password) == 0;
+	pthread_mutex_unlock(&user_lock);
     }
 
-    return false;
+    return same;
 }
 
 
@@ -212,7 +222,7 @@ user_find_page (const char* userid)
 char *
 user_get_logname()
 {
-    return var_get_val(server->variables, "cutewiki-user");
+    return var_get_val(&server->variables, VAR_CUTEWIKI_USER);
 }
 
 
@@ -250,18 +260,20 @@ user_is_admin()
     char * user;
     char * admin;
     char * key;
+    bool found = false;
 
     cfg = wiki_get_config();
     user = user_get_logname();
 
+    pthread_mutex_lock(&user_lock);
     admin = cfg_first_entry(cfg, "Administration", &key);
-    while (admin != NULL) {
-	if (!strcmp(admin, user))
-	    return true;
+    while (admin != NULL && !found) {
+	found = strcmp(admin, user) == 0;
 	admin = cfg_next_entry(cfg, &key);
     }
+    pthread_mutex_unlock(&user_lock);
 
-    return false;
+    return found;
 }
 
 
@@ -290,11 +302,11 @@ user_is_authenticated()
     char* username;
 
     /* check, if a valid authentication cookie is already set*/
-    username = var_get_val(server->variables, "cutewiki-user");
+    username = var_get_val(&server->variables, VAR_CUTEWIKI_USER);
     if (username != NULL) {
 	page = pagelist_find_page(username);
 	if (page != NULL) {
-	    char* password = var_get_val(server->variables, "cutewiki-auth");
+	    char* password = var_get_val(&server->variables, VAR_CUTEWIKI_AUTH);
 	    if (user_check_password(page, password)) {
 		return true;
 	    }
@@ -302,17 +314,17 @@ user_is_authenticated()
     }
 
     /* if the passed password is valid, store it in a crypted cookie */
-    username = var_get_val(server->variables, "username");
+    username = var_get_val(&server->variables, VAR_USERNAME);
     if (username != NULL) {
 	user_to_wikiword(username);
 	page = pagelist_find_page(username);
 	if (page != NULL) {
-	    char* password = var_get_val(server->variables, "password");
+	    char* password = var_get_val(&server->variables, VAR_PASSWORD);
 	    if (user_check_raw_password(page, password)) {
 		password = user_get_password(page);
 		svr_set_cookie(server, "cutewiki-user", username);
 		svr_set_cookie(server, "cutewiki-auth", password);
-		var_set(&server->variables, "cutewiki-user", username);
+		var_put(&server->arena, &server->variables, VAR_CUTEWIKI_USER, username);
 		return true;
 	    }
 	}
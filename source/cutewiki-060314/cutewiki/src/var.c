@@ -13,20 +13,175 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
+#include "arena.h"
 #include "var.h"
 
 
+
+#define	VAR_INDEX_SIZE	64		/* power of 2, > 2 * VAR_KNOWN */
+#define	VAR_FIRST_SLOTS	16		/* power of 2 */
+
+static const char *var_names[VAR_KNOWN] = {
+#define VAR_KEY(id, name)	name,
+    VAR_KEYS
+#undef VAR_KEY
+};
+
+/* the known names by hash, holds VAR_* + 1 or 0 for a free entry */
+static unsigned char var_index[VAR_INDEX_SIZE];
+static unsigned int var_hashes[VAR_KNOWN];
+static pthread_once_t var_index_once = PTHREAD_ONCE_INIT;
+
+
+
+/*
+ * var_hash - FNV-1a hash of a variable name
+ */
+static unsigned int
+var_hash(const char *name)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*name) {
+	hash ^= (unsigned char)*name++;
+	hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+
+/*
+ * var_init_index - hash the names of the known variables
+ */
+static void
+var_init_index(void)
+{
+    int key, i;
+
+    for (key = 0; key < VAR_KNOWN; key++) {
+	var_hashes[key] = var_hash(var_names[key]);
+	i = var_hashes[key] & (VAR_INDEX_SIZE - 1);
+	while (var_index[i])
+	    i = (i + 1) & (VAR_INDEX_SIZE - 1);
+	var_index[i] = key + 1;
+    }
+}
+
+
+
+/*
+ * var_known - get the VAR_* of a name or -1
+ */
+static int
+var_known(const char *name, unsigned int hash)
+{
+    int i, key;
+
+    pthread_once(&var_index_once, var_init_index);
+    for (i = hash & (VAR_INDEX_SIZE - 1); var_index[i];
+	 i = (i + 1) & (VAR_INDEX_SIZE - 1)) {
+	key = var_index[i] - 1;
+	if (var_hashes[key] == hash && strcmp(var_names[key], name) == 0)
+	    return key;
+    }
+    return -1;
+}
+
+
+
+/*
+ * var_probe - find the slot of a name not known to the wiki
+ *
+ * Returns the free slot, where the name belongs, if it is not there.
+ */
+static VarSlot *
+var_probe(VarSlot *slots, int mask, const char *name, unsigned int hash)
+{
+    int i;
+
+    for (i = hash & mask; slots[i].name; i = (i + 1) & mask) {
+	if (slots[i].hash == hash && strcmp(slots[i].name, name) == 0)
+	    break;
+    }
+    return &slots[i];
+}
+
+
+
+/*
+ * var_grow - make room for another name
+ *
+ * The table is kept at most half full.  The old one stays in the
+ * arena until the end of the request.
+ */
+static bool
+var_grow(Arena* arena, Vars* vars)
+{
+    VarSlot	*slots, *slot;
+    int		size, i;
+
+    if (vars->slots && (vars->used + 1) * 2 <= vars->mask + 1)
+	return true;
+
+    size = vars->slots ? (vars->mask + 1) * 2 : VAR_FIRST_SLOTS;
+    slots = arena_alloc(arena, size * sizeof(VarSlot));
+    if (slots == NULL)
+	return false;
+    memset(slots, 0, size * sizeof(VarSlot));
+    if (vars->slots) {
+	for (i = 0; i <= vars->mask; i++) {
+	    if (vars->slots[i].name == NULL)
+		continue;
+	    slot = var_probe(slots, size - 1, vars->slots[i].name,
+			     vars->slots[i].hash);
+	    *slot = vars->slots[i];
+	}
+    }
+    vars->slots = slots;
+    vars->mask = size - 1;
+    return true;
+}
+
+
+
+/*
+ * var_add - append a value to the values of a slot
+ */
+static void
+var_add(Arena* arena, VarSlot* slot, char* value)
+{
+    Var * var;
+
+    var = arena_alloc(arena, sizeof(Var));
+    if (var == NULL)
+	return;
+    var->value = arena_strdup(arena, value);
+    var->next = NULL;
+    if (slot->last)
+	slot->last->next = var;
+    else
+	slot->first = var;
+    slot->last = var;
+}
+
+
+
 /*
  * var_set - save a variable and it's value
  *
  * There can be more than one setting of a specific variable in a
- * HTTP request. So we need to save them all.
+ * HTTP request. So we need to save them all.  The copies are taken
+ * from the request's arena.
  */
 void
-var_set(Var** head, char* name, char* value)
+var_set(Arena* arena, Vars* vars, char* name, char* value)
 {
-    Var * var;
+    VarSlot	*slot;
+    unsigned int hash;
+    int		key;
 
     if (name == NULL || value == NULL)
 	return;
@@ -34,37 +189,85 @@ var_set(Var** head, char* name, char* value)
     while(*name == ' ' || *name == '\t')
 	name++;
 
-    /* create the var */
-    var = calloc(1, sizeof(Var));
-    var->name = strdup(name);
-    var->value = strdup(value);
+    hash = var_hash(name);
+    key = var_known(name, hash);
+    if (key >= 0) {
+	var_add(arena, &vars->known[key], value);
+	return;
+    }
 
-    /* make it the new head of the list */
-    var->next = *head;
-    *head = var;
+    if (!var_grow(arena, vars))
+	return;
+    slot = var_probe(vars->slots, vars->mask, name, hash);
+    if (slot->name == NULL) {
+	slot->name = arena_strdup(arena, name);
+	if (slot->name == NULL)
+	    return;
+	slot->hash = hash;
+	vars->used++;
+    }
+    var_add(arena, slot, value);
 }
 
 
 
 /*
- * var_get - get a saved variable
+ * var_put - save a value of one of the known variables
+ */
+void
+var_put(Arena* arena, Vars* vars, int key, char* value)
+{
+    if (value != NULL)
+	var_add(arena, &vars->known[key], value);
+}
+
+
+
+/*
+ * var_first - get the first value of a known variable
  *
- * Although there can be more than one instance of a named variable
- * we are just able to get back the value of the first accurance.
+ * The others follow in the order they were set.
+ */
+Var *
+var_first(Vars* vars, int key)
+{
+    return vars->known[key].first;
+}
+
+
+
+/*
+ * var_find - get the first value of any variable by its name
  */
-static Var *
-var_get(Var* var, char* name)
+Var *
+var_find(Vars* vars, char* name)
 {
+    unsigned int hash;
+    int		key;
+
     if (name == NULL)
 	return NULL;
 
-    while(var != NULL && var->name != NULL) {
-        if (strcmp(var->name, name) == 0)
-            return(var);
-        var = var->next;
-    }
+    hash = var_hash(name);
+    key = var_known(name, hash);
+    if (key >= 0)
+	return vars->known[key].first;
+    if (vars->slots == NULL)
+	return NULL;
+    return var_probe(vars->slots, vars->mask, name, hash)->first;
+}
 
-    return NULL;
+
+
+/*
+ * var_get - get the value set last of a known variable
+ */
+static char *
+var_get(Vars* vars, int key)
+{
+    Var *var = vars->known[key].last;
+
+    return var ? var->value : NULL;
 }
 
 
@@ -73,12 +276,12 @@ var_get(Var* var, char* name)
  * var_get_bool - get a boolean from a form
  */
 bool
-var_get_bool(Var* head, char * name) {
-    Var* var;
+var_get_bool(Vars* vars, int key) {
+    char* value;
 
-    var = var_get(head, name);
-    if (var != NULL && var->value != NULL) {
-	if (strcmp(var->value, "yes") == 0)
+    value = var_get(vars, key);
+    if (value != NULL) {
+	if (strcmp(value, "yes") == 0)
 	    return true;
     }
 
@@ -91,13 +294,13 @@ var_get_bool(Var* head, char * name) {
  * var_get_int - get's a value from the form as integer
  */
 int
-var_get_int(Var* head, char * name)
+var_get_int(Vars* vars, int key)
 {
-    Var* var;
+    char* value;
 
-    var = var_get(head, name);
-    if (var != NULL && var->value != NULL)
-	return atoi(var->value);
+    value = var_get(vars, key);
+    if (value != NULL)
+	return atoi(value);
 
     return 0;
 }
@@ -110,14 +313,14 @@ var_get_int(Var* head, char * name)
  * If a variables's value is empty, return NULL
  */
 char*
-var_get_val(Var* head, char * name)
+var_get_val(Vars* vars, int key)
 {
-    Var* var;
+    char* value;
 
-    var = var_get(head, name);
-    if (var != NULL && var->value != NULL) {
-	if (strlen(var->value) > 0)
-	    return var->value;
+    value = var_get(vars, key);
+    if (value != NULL) {
+	if (*value)
+	    return value;
     }
 
     return NULL;
@@ -126,66 +329,24 @@ var_get_val(Var* head, char * name)
 
 
 /*
- * var_del - delete a variable and it's value
- *
- * because a variable can appear any times, delete then all
+ * var_del - delete all values of a known variable
  */
 void
-var_del(Var** head, char* name)
+var_del(Vars* vars, int key)
 {
-    Var *var, *last;
-
-    if (name == NULL )
-	return;
-
-    while(*name == ' ' || *name == '\t')
-	name++;
-
-    last = NULL;
-    var = *head;
-    while(var != NULL && var->name != NULL) {
-	Var* next = var->next;
-
-	if (strcmp(var->name, name) == 0) {
-            /* if variable name was found, delete variable from chain */
-	    if (last == NULL)
-		*head = var->next;
-	    else
-		last->next = var->next;
-
-            /* do the real work */
-	    free(var->name);
-	    free(var->value);
-	    free(var);
-	}
-        else
-	    last = var;
-
-	var = next;
-    }
+    vars->known[key].first = NULL;
+    vars->known[key].last = NULL;
 }
 
 
 
 /*
- * var_exit - recursivly free all allocated variables
+ * var_exit - forget all variables
+ *
+ * The memory goes back with the reset of the arena.
  */
 void
-var_exit(Var** head)
+var_exit(Vars* vars)
 {
-    Var* var = *head;
-
-    while(var != NULL) {
-	Var* next = var->next;
-
-	/* do the real work */
-	free(var->name);
-	free(var->value);
-	free(var);
-
-	var = next;
-    }
-
-    /* just to be shure */
-    *head = NULL;
+    memset(vars, 0, sizeof(Vars));
 }
@@ -15,22 +15,84 @@
 
 
 #include "types.h"
+#include "arena.h"
 
+
+/*
+ * The variables the wiki itself looks at.  They get a fixed slot, so
+ * looking them up needs neither hashing nor comparing.
+ */
+#define VAR_KEYS \
+    VAR_KEY(ACTION,		"action") \
+    VAR_KEY(CATEGORY,		"category") \
+    VAR_KEY(CUTEWIKI_AUTH,	"cutewiki-auth") \
+    VAR_KEY(CUTEWIKI_CATEGORY,	"cutewiki-category") \
+    VAR_KEY(CUTEWIKI_SEARCH,	"cutewiki-search") \
+    VAR_KEY(CUTEWIKI_USER,	"cutewiki-user") \
+    VAR_KEY(ERRORDSC,		"errordsc") \
+    VAR_KEY(ERRORMSG,		"errormsg") \
+    VAR_KEY(FULLSEARCH,		"fullsearch") \
+    VAR_KEY(GROUP,		"group") \
+    VAR_KEY(HIDDEN,		"hidden") \
+    VAR_KEY(LOGOFF,		"logoff") \
+    VAR_KEY(MODE,		"mode") \
+    VAR_KEY(PAGE,		"page") \
+    VAR_KEY(PAGETYPE,		"pagetype") \
+    VAR_KEY(PASSWORD,		"password") \
+    VAR_KEY(PRIVATE,		"private") \
+    VAR_KEY(PWRESET,		"pwreset") \
+    VAR_KEY(QUESTION,		"question") \
+    VAR_KEY(REV1,		"rev1") \
+    VAR_KEY(REV2,		"rev2") \
+    VAR_KEY(REVISION,		"revision") \
+    VAR_KEY(SEQNO,		"seqno") \
+    VAR_KEY(TEXT,		"text") \
+    VAR_KEY(TITLE,		"title") \
+    VAR_KEY(TOPIC,		"topic") \
+    VAR_KEY(USERID,		"userid") \
+    VAR_KEY(USERNAME,		"username")
+
+enum VarKeys {
+#define VAR_KEY(id, name)	VAR_##id,
+    VAR_KEYS
+#undef VAR_KEY
+    VAR_KNOWN			/* number of known variables */
+};
+
+
+/* one value of a variable, all values are kept in the order set */
 typedef struct Var_ Var;
 struct Var_ {
-    char	*name;
     char 	*value;
     Var 	*next;
 };
 
+/* all values set for one name */
+typedef struct {
+    char	*name;
+    unsigned int hash;
+    Var		*first;
+    Var		*last;
+} VarSlot;
+
+typedef struct {
+    VarSlot	known[VAR_KNOWN];	/* indexed by VAR_* */
+    VarSlot	*slots;			/* other names, open addressing */
+    int		mask;
+    int		used;
+} Vars;
+
 
 
-void 	var_set(Var**, char*, char*);
-void    var_del(Var** start, char* name);
-bool    var_get_bool(Var* start , char * name);
-int	var_get_int(Var* start, char * name);
-char*	var_get_val(Var* start, char * name);
-void 	var_exit(Var**);
+void 	var_set(Arena*, Vars*, char*, char*);
+void 	var_put(Arena*, Vars*, int, char*);
+void    var_del(Vars*, int);
+Var*	var_first(Vars*, int);
+Var*	var_find(Vars*, char*);
+bool    var_get_bool(Vars*, int);
+int	var_get_int(Vars*, int);
+char*	var_get_val(Vars*, int);
+void 	var_exit(Vars*);
 
 
 
@@ -18,26 +18,40 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/file.h>
+#include <sys/uio.h>
+#ifndef	__OS2__
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#endif
+#include <fcntl.h>
+#include <zlib.h>
 
 #include "types.h"
 #include "config.h"
 #include "svr.h"
 #include "http.h"
 #include "var.h"
+#include "fcgi.h"
+#include "trace.h"
 
 
 
 /*
- * http_to_utf - convert Latin1 to UTF-8-String
+ * http_to_utf - convert len chars of Latin1 to UTF-8-String
+ *
+ * Returns the length of the converted string.
  */
-void
-http_to_utf (char * dst, const char * src)
+int
+http_to_utf (char * dst, const char * src, int len)
 {
     const char *sptr = src;
+    const char *end = src + len;
     char *dptr = dst;
 
-    while (*sptr) {
+    while (sptr < end) {
         /* if 7 bit ASCII character, just copy */
         if ((unsigned char)*sptr < 0x80) {
             *dptr = *sptr;
@@ -53,6 +67,7 @@ http_to_utf (char * dst, const char * src)
         sptr++;
     }
     *dptr = '\0';  // end the new string
+    return dptr - dst;
 }
 
 
@@ -97,72 +112,615 @@ http_to_utf (const unsigned char *s)
 
 
 
-int
-http_read_char(httpd *server, char *cp)
+/*
+ * http_clock - seconds of a clock, that is never set back
+ */
+unsigned long
+http_clock(void)
 {
-    if (server->readBufRemain == 0) {
-        bzero(server->readBuf, HTTP_READ_BUF_LEN + 1);
-        server->readBufRemain =
-	    read(server->clientSock, server->readBuf, HTTP_READ_BUF_LEN);
-        if (server->readBufRemain < 1)
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+
+
+/*
+ * http_wait - wait until the socket of the request is ready
+ *
+ * A worker gives up, if the client is idle for the keep-alive timeout
+ * or the deadline of the connection has passed. Returns 1, if the
+ * socket is ready.
+ */
+static int
+http_wait(httpd *server, int events)
+{
+    httpConn	*conn = server->conn;
+    struct pollfd pfd;
+    long	left;
+    int		timeout;
+
+    timeout = server->keepAliveTimeout * 1000;
+    if (conn->deadline) {
+        left = (long) (conn->deadline - http_clock());
+        if (left <= 0)
             return 0;
-        server->readBuf[server->readBufRemain] = 0;
-        server->readBufPtr = server->readBuf;
+        if (left * 1000 < timeout)
+            timeout = left * 1000;
     }
-    *cp = *server->readBufPtr++;
-    server->readBufRemain--;
-    return(1);
+    pfd.fd = conn->sock;
+    pfd.events = events;
+    return poll(&pfd, 1, timeout) > 0;
 }
 
 
 
+/*
+ * http_read_body - get the next part of the request body
+ *
+ * The reactor has buffered the headers and as much of the body as fits
+ * into its buffer, the rest is read from the socket here.  Returns the
+ * number of bytes, 0 at the end of the body or -1 if the client went
+ * away.
+ */
 int
-http_read_line(httpd *server, char *buf, int len)
+http_read_body(httpd *server, char *buf, int len)
 {
-    char	curChar,
-    *dst;
-    int	count;
+    httpConn	*conn = server->conn;
+    int		got;
 
-    count = 0;
-    dst = buf;
-    while (count < len) {
-        if (http_read_char(server, &curChar) < 1)
-            return 0;
-        if (curChar == '\n') {
-            *dst = 0;
-            return(1);
+    if (server->readBufRemain > 0) {
+        if (len > server->readBufRemain)
+            len = server->readBufRemain;
+        memcpy(buf, server->readBufPtr, len);
+        server->readBufPtr += len;
+        server->readBufRemain -= len;
+        return len;
+    }
+    if (conn == NULL || conn->bodyPending <= 0)
+        return 0;
+    if (len > conn->bodyPending)
+        len = conn->bodyPending;
+    while ((got = read(conn->sock, buf, len)) < 0) {
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            break;
+        if (!http_wait(server, POLLIN))
+            break;
+    }
+    if (got <= 0) {
+        conn->broken = true;
+        return -1;
+    }
+    conn->bodyPending -= got;
+    return got;
+}
+
+
+
+/*
+ * http_send_out - send the queued response to a HTTP client
+ *
+ * A file given by http_send_file() follows the body and goes from
+ * the page cache to the socket without being copied, part by part
+ * for a range request.
+ */
+static int
+http_send_out(httpConn *conn)
+{
+    struct iovec iov[2];
+    ssize_t	len;
+    int		cnt;
+
+    while (conn->hdrSent < conn->hdrLen || conn->outSent < conn->outLen) {
+        cnt = 0;
+        if (conn->hdrSent < conn->hdrLen) {
+            iov[cnt].iov_base = conn->hdr + conn->hdrSent;
+            iov[cnt++].iov_len = conn->hdrLen - conn->hdrSent;
+        }
+        if (conn->outSent < conn->outLen) {
+            iov[cnt].iov_base = conn->out + conn->outSent;
+            iov[cnt++].iov_len = conn->outLen - conn->outSent;
         }
-        if (curChar == '\r') {
+        len = writev(conn->sock, iov, cnt);
+        if (len < 0 && errno == EINTR)
             continue;
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (len <= 0)
+            return -1;
+
+        if (conn->hdrSent < conn->hdrLen) {
+            cnt = conn->hdrLen - conn->hdrSent;
+            if (len < cnt) {
+                conn->hdrSent += len;
+                continue;
+            }
+            conn->hdrSent = conn->hdrLen;
+            len -= cnt;
         }
+        conn->outSent += len;
+    }
+
+#ifndef	__OS2__
+    while (conn->fileFd >= 0) {
+        httpPart *part = &conn->parts[conn->partNext];
+
+        if (part->headLen > 0)
+            len = send(conn->sock, conn->partHeads + part->head,
+                       part->headLen, part->off < part->end ? MSG_MORE : 0);
+        else if (part->off < part->end)
+            len = sendfile(conn->sock, conn->fileFd, &part->off,
+                           part->end - part->off);
         else {
-            *dst++ = curChar;
-            count++;
+            if (++conn->partNext >= conn->partCount)
+                http_close_file(conn);
+            continue;
+        }
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (len <= 0)
+            return -1;          /* the file was truncated meanwhile */
+
+        if (part->headLen > 0) {
+            part->head += len;
+            part->headLen -= len;
         }
     }
-    *dst = 0;
-    return(1);
+#endif
+    return 1;
 }
 
 
 
+/*
+ * http_flush - send as much of the queued response as possible
+ *
+ * A FastCGI connection gets it in records. Returns 1 if everything
+ * was sent, 0 if the socket is full and -1 on errors.
+ */
 int
-http_read_buf(httpd *server, char *buf, int len)
+http_flush(httpConn *conn)
 {
-    char	curChar,
-    *dst;
-    int	count;
+    TraceSpan	span;
+    int		result;
 
+    TRACE_BEGIN(&span, "http_flush", NULL);
+    if (conn->fcgi)
+        result = fcgi_flush(conn);
+    else
+        result = http_send_out(conn);
+    TRACE_END(&span);
+    return result;
+}
 
-    count = 0;
-    dst = buf;
-    while (count < len) {
-        if (http_read_char(server, &curChar) < 1)
-            return 0;
-        *dst++ = curChar;
-        count++;
+
+
+/*
+ * http_file_left - bytes of the file and its part headers still to send
+ */
+static off_t
+http_file_left(httpConn *conn)
+{
+    off_t	len = 0;
+    int		i;
+
+    if (conn->fileFd < 0)
+        return 0;
+    for (i = conn->partNext; i < conn->partCount; i++)
+        len += conn->parts[i].headLen + conn->parts[i].end - conn->parts[i].off;
+    return len;
+}
+
+
+
+/*
+ * http_reserve - make room for len more bytes of the response body
+ */
+static char *
+http_reserve(httpConn *conn, int len)
+{
+    if (conn->outLen + len > conn->outSize) {
+        char	*new;
+        int	size;
+
+        size = conn->outSize ? conn->outSize : HTTP_READ_BUF_LEN;
+        while (size < conn->outLen + len)
+            size *= 2;
+        new = realloc(conn->out, size);
+        if (new == NULL)
+            return NULL;
+        conn->out = new;
+        conn->outSize = size;
     }
-    return(1);
+    return conn->out + conn->outLen;
+}
+
+
+
+/*
+ * http_append - add protocol bytes to the body buffer
+ */
+static void
+http_append(httpConn *conn, const char *buf, int len)
+{
+    char	*dst;
+
+    dst = http_reserve(conn, len);
+    if (dst == NULL)
+        return;
+    memcpy(dst, buf, len);
+    conn->outLen += len;
+}
+
+
+
+/*
+ * http_open_chunk - start the next chunk of a chunked response
+ *
+ * The size is not known yet, so room for it is kept in front.
+ */
+static void
+http_open_chunk(httpConn *conn)
+{
+    conn->chunkStart = conn->outLen;
+    http_append(conn, "00000000\r\n", HTTP_CHUNK_HEAD);
+}
+
+
+
+/*
+ * http_seal_chunk - finish the current chunk of a chunked response
+ *
+ * The size of the very first chunk follows the header block.
+ */
+static void
+http_seal_chunk(httpConn *conn)
+{
+    char	head[HTTP_CHUNK_HEAD + 1];
+    int		size;
+
+    if (conn->chunkStart < 0) {
+        size = conn->outLen - conn->outSent;
+        conn->hdrLen += snprintf(conn->hdr + conn->hdrLen,
+                                 sizeof(conn->hdr) - conn->hdrLen,
+                                 "%x\r\n", size);
+    }
+    else {
+        size = conn->outLen - conn->chunkStart - HTTP_CHUNK_HEAD;
+        if (size == 0) {
+            conn->outLen = conn->chunkStart;    /* nothing to send */
+            return;
+        }
+        snprintf(head, sizeof(head), "%08x\r\n", size);
+        memcpy(conn->out + conn->chunkStart, head, HTTP_CHUNK_HEAD);
+    }
+    http_append(conn, "\r\n", 2);
+}
+
+
+
+/*
+ * http_compressible - find out, if a content type is worth compressing
+ */
+static bool
+http_compressible(const char *type)
+{
+    return (strncasecmp(type, "text/", 5) == 0 ||
+            strstr(type, "xml") != NULL ||
+            strstr(type, "javascript") != NULL);
+}
+
+
+
+/*
+ * http_start_deflate - decide about compression with the first byte
+ *
+ * Only dynamic text is compressed, bodies of a known length are sent
+ * as they are. Each worker keeps its compressor for all responses.
+ */
+static void
+http_start_deflate(httpd *server)
+{
+    int		enc, bits;
+
+    server->response.encoding = HTTP_ENC_NONE;
+    if (server->deflateLevel <= 0 || server->response.contentLength >= 0 ||
+        !http_compressible(server->response.contentType))
+        return;
+    server->response.vary = true;
+
+    if (server->request.acceptEncoding & HTTP_ENC_GZIP)
+        enc = HTTP_ENC_GZIP;
+    else if (server->request.acceptEncoding & HTTP_ENC_DEFLATE)
+        enc = HTTP_ENC_DEFLATE;
+    else
+        return;
+
+    if (server->zstream && server->zstreamEnc != enc) {
+        deflateEnd(server->zstream);
+        free(server->zstream);
+        server->zstream = NULL;
+    }
+    if (server->zstream == NULL) {
+        server->zstream = malloc(sizeof(z_stream));
+        if (server->zstream == NULL)
+            return;
+        bzero(server->zstream, sizeof(z_stream));
+        bits = (enc == HTTP_ENC_GZIP) ? 15 + 16 : 15;
+        if (deflateInit2(server->zstream, server->deflateLevel, Z_DEFLATED,
+                         bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(server->zstream);
+            server->zstream = NULL;
+            return;
+        }
+        server->zstreamEnc = enc;
+    }
+    else
+        deflateReset(server->zstream);
+    server->response.encoding = enc;
+}
+
+
+
+/*
+ * http_deflate - compress bytes into the body buffer
+ */
+static void
+http_deflate(httpd *server, const char *buf, int len, int flush)
+{
+    httpConn	*conn = server->conn;
+    z_stream	*zs = server->zstream;
+    char	*dst;
+    int		before = conn->outLen,
+    room = HTTP_READ_BUF_LEN * 4,
+    result;
+
+    zs->next_in = (Bytef *) buf;
+    zs->avail_in = len;
+    do {
+        dst = http_reserve(conn, room);
+        if (dst == NULL)
+            break;
+        zs->next_out = (Bytef *) dst;
+        zs->avail_out = room;
+        result = deflate(zs, flush);
+        conn->outLen += room - zs->avail_out;
+    } while (zs->avail_out == 0 || (flush == Z_FINISH && result == Z_OK));
+    server->response.length += conn->outLen - before;
+}
+
+
+
+#ifdef	__OS2__
+/*
+ * http_spill - keep the unsent body in memory, there is no sendfile()
+ */
+static bool
+http_spill(httpConn *conn)
+{
+    return true;
+}
+#else
+/*
+ * http_spill - move the unsent body to the spill file
+ *
+ * The file is opened with the first part. It is sent like a file of
+ * the response, when the response is complete. Returns false, if it
+ * can not be written.
+ */
+static bool
+http_spill(httpConn *conn)
+{
+    char	path[] = HTTP_SPILL_FILE;
+    char	*src;
+    int		len, done;
+
+    if (conn->spillFd < 0) {
+        conn->spillFd = mkstemp(path);
+        if (conn->spillFd < 0)
+            return false;
+        unlink(path);
+        conn->spillLen = 0;
+    }
+    src = conn->out + conn->outSent;
+    len = conn->outLen - conn->outSent;
+    while (len > 0) {
+        done = write(conn->spillFd, src, len);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return false;
+        src += done;
+        len -= done;
+        conn->spillLen += done;
+    }
+    conn->outLen = conn->outSent = 0;
+    return true;
+}
+#endif
+
+
+
+/*
+ * http_stream - send a part of a big response already
+ *
+ * When the first part goes out, the length of the body is not known.
+ * HTTP/1.1 clients get the body in chunks then, older ones see the
+ * connection closed at its end. The handler does not wait for the
+ * client, it runs with the handlers locked. What the socket does not
+ * take at once stays in memory up to HTTP_SPILL_LEN, the rest goes to
+ * a spill file and all after it as well. The reactor sends it, when
+ * the handler is done.
+ */
+static void
+http_stream(httpd *server)
+{
+    httpConn	*conn = server->conn;
+    int		result;
+
+    if (conn->hdrLen == 0) {
+        conn->chunked = (server->response.contentLength < 0 &&
+                         server->request.version >= 11 && conn->fcgi == NULL);
+        conn->chunkStart = -1;
+        conn->deadline = http_clock() + server->sendTimeout;
+        http_build_headers(server, server->response.contentLength);
+    }
+    if (server->request.method == HTTP_HEAD) {
+        /* the headers are all a HEAD gets */
+        conn->outLen = conn->outSent = conn->outKept = 0;
+        return;
+    }
+    /* let the browser show what it got so far */
+    if (server->response.encoding > HTTP_ENC_NONE)
+        http_deflate(server, NULL, 0, Z_SYNC_FLUSH);
+    if (conn->chunked)
+        http_seal_chunk(conn);
+
+    if (conn->spillFd >= 0)
+        result = http_spill(conn) ? 0 : -1;
+    else {
+        result = http_flush(conn);
+        if (result == 0 && conn->outLen - conn->outSent > HTTP_SPILL_LEN)
+            result = http_spill(conn) ? 0 : -1;
+    }
+    if (result < 0) {
+        conn->broken = true;    /* client is gone, drop the rest */
+        conn->outLen = conn->outSent = 0;
+        return;
+    }
+
+    conn->outLen -= conn->outSent;
+    memmove(conn->out, conn->out + conn->outSent, conn->outLen);
+    conn->outSent = 0;
+    conn->outKept = conn->outLen;
+    if (conn->chunked)
+        http_open_chunk(conn);
+}
+
+
+
+/*
+ * http_copy_body - start or stop copying the body as it is written
+ *
+ * The copy is taken before compression. It is left in server->copy
+ * until the next one starts.
+ */
+void
+http_copy_body(httpd *server, bool on)
+{
+    server->copying = on;
+    if (on)
+        server->copyLen = 0;
+}
+
+
+
+/*
+ * http_keep_copy - add bytes written to the copy of the body
+ */
+static void
+http_keep_copy(httpd *server, const char *buf, int len)
+{
+    char	*copy;
+    int		size;
+
+    if (server->copyLen < 0)
+        return;
+    if (server->copyLen + len > server->copySize) {
+        for (size = server->copySize ? server->copySize : HTTP_READ_BUF_LEN;
+             size < server->copyLen + len; size *= 2)
+            ;
+        copy = realloc(server->copy, size);
+        if (copy == NULL) {
+            server->copyLen = -1;
+            return;
+        }
+        server->copy = copy;
+        server->copySize = size;
+    }
+    memcpy(server->copy + server->copyLen, buf, len);
+    server->copyLen += len;
+}
+
+
+
+/*
+ * http_write - append bytes to the response body
+ *
+ * The body is sent as a whole after the request, only big responses
+ * are sent in parts when HTTP_FLUSH_LEN bytes are collected.
+ */
+void
+http_write(httpd *server, const char *buf, int len)
+{
+    httpConn	*conn = server->conn;
+    char	*dst;
+
+    if (conn == NULL || conn->broken || len <= 0)
+        return;
+    if (server->copying)
+        http_keep_copy(server, buf, len);
+    if (server->response.encoding == HTTP_ENC_UNKNOWN)
+        http_start_deflate(server);
+    if (server->response.encoding > HTTP_ENC_NONE)
+        http_deflate(server, buf, len, Z_NO_FLUSH);
+    else {
+        dst = http_reserve(conn, len);
+        if (dst == NULL)
+            return;
+        memcpy(dst, buf, len);
+        conn->outLen += len;
+        server->response.length += len;
+    }
+    if (conn->outLen >= conn->outKept + HTTP_FLUSH_LEN)
+        http_stream(server);
+}
+
+
+
+/*
+ * http_write_utf - append a Latin1 string to the body as UTF-8
+ */
+void
+http_write_utf(httpd *server, const char *str, int len)
+{
+    httpConn	*conn = server->conn;
+    char	*dst;
+
+    if (conn == NULL || conn->broken || len <= 0)
+        return;
+    if (server->response.encoding == HTTP_ENC_UNKNOWN)
+        http_start_deflate(server);
+    if (server->response.encoding > HTTP_ENC_NONE) {
+        if (server->utfSize < len * 2 + 1) {
+            dst = realloc(server->utfBuf, len * 2 + 1);
+            if (dst == NULL)
+                return;
+            server->utfBuf = dst;
+            server->utfSize = len * 2 + 1;
+        }
+        len = http_to_utf(server->utfBuf, str, len);
+        if (server->copying)
+            http_keep_copy(server, server->utfBuf, len);
+        http_deflate(server, server->utfBuf, len, Z_NO_FLUSH);
+    }
+    else {
+        dst = http_reserve(conn, len * 2 + 1);
+        if (dst == NULL)
+            return;
+        len = http_to_utf(dst, str, len);
+        if (server->copying)
+            http_keep_copy(server, dst, len);
+        conn->outLen += len;
+        server->response.length += len;
+    }
+    if (conn->outLen >= conn->outKept + HTTP_FLUSH_LEN)
+        http_stream(server);
 }
 
 
@@ -170,72 +728,301 @@ http_read_buf(httpd *server, char *buf, int len)
 static void
 http_get_timestr(httpd *server, char *ptr, time_t clock)
 {
-    struct 	tm *timePtr;
+    struct 	tm timeBuf;
 
     if (clock == 0)
         clock = time(NULL);
-    timePtr = gmtime((time_t*)&clock);
-    strftime(ptr, HTTP_TIME_STRING_LEN,"%a, %d %b %Y %T GMT",timePtr);
+    gmtime_r(&clock, &timeBuf);
+    strftime(ptr, HTTP_TIME_STRING_LEN,"%a, %d %b %Y %T GMT",&timeBuf);
+}
+
+
+
+/*
+ * http_keep_alive - decide, if the connection survives the response
+ *
+ * The client must want it and the end of the response must be known
+ * without closing the connection.
+ */
+static bool
+http_keep_alive(httpd *server, off_t contentLength, bool noBody)
+{
+    httpConn	*conn = server->conn;
+
+    /* the records tell the end, the front end decides */
+    if (conn->fcgi)
+        return conn->fcgi->keepConn && server->keepAliveMax > 0;
+    if (!server->request.keepAlive || conn->bodyPending > 0)
+        return false;
+    if (conn->requests >= server->keepAliveMax)
+        return false;
+    return (noBody || contentLength >= 0 || conn->chunked);
 }
 
 
 
+/*
+ * http_add_line - add a header line to the header block
+ */
+static void
+http_add_line(httpConn *conn, const char *line, int len)
+{
+    if (conn->hdrLen + len + 2 > HTTP_MAX_HEADERS * 4)
+        return;
+    memcpy(conn->hdr + conn->hdrLen, line, len);
+    conn->hdrLen += len;
+    conn->hdr[conn->hdrLen++] = '\r';
+    conn->hdr[conn->hdrLen++] = '\n';
+}
+
+
+
+/*
+ * http_build_headers - put together the header block of the response
+ *
+ * A contentLength of -1 means, that the length is not known.
+ */
 void
-http_send_headers(httpd *server, int contentLength, int modTime)
+http_build_headers(httpd *server, off_t contentLength)
 {
-    char	tmpBuf[80],
+    httpConn	*conn = server->conn;
+    char	line[HTTP_MAX_URL + 40],
     timeBuf[HTTP_TIME_STRING_LEN];
+    char	*cp, *end;
+    int		code;
+    bool	noBody;
+
+    code = atoi(server->response.response);
+    noBody = (code == 304 || code == 204 || (code >= 100 && code < 200));
+    conn->keepAlive = http_keep_alive(server, contentLength, noBody);
+    conn->hdrLen = 0;
+    conn->hdrSent = 0;
+
+    /* handlers set the response with or without the line end */
+    snprintf(line, sizeof(line),
+             conn->fcgi ? "Status: %.*s" : "HTTP/1.1 %.*s",
+             (int) strcspn(server->response.response, "\r\n"),
+             server->response.response);
+    http_add_line(conn, line, strlen(line));
 
+    /* added headers are kept with single line ends */
+    cp = server->response.headers;
+    while (*cp) {
+        end = cp + strcspn(cp, "\r\n");
+        if (end > cp)
+            http_add_line(conn, cp, end - cp);
+        cp = end;
+        while (*cp == '\r' || *cp == '\n')
+            cp++;
+    }
+
+    /* a FastCGI front end talks to the client on its own */
+    if (conn->fcgi == NULL) {
+        http_get_timestr(server, timeBuf, 0);
+        snprintf(line, sizeof(line), "Date: %s", timeBuf);
+        http_add_line(conn, line, strlen(line));
+        snprintf(line, sizeof(line), "Connection: %s",
+                 conn->keepAlive ? "keep-alive" : "close");
+        http_add_line(conn, line, strlen(line));
+    }
+    snprintf(line, sizeof(line), "Content-Type: %s",
+             server->response.contentType);
+    http_add_line(conn, line, strlen(line));
+
+    if (!noBody && contentLength >= 0) {
+        snprintf(line, sizeof(line), "Content-Length: %lld",
+                 (long long) contentLength);
+        http_add_line(conn, line, strlen(line));
+    }
+    else if (conn->chunked)
+        http_add_line(conn, "Transfer-Encoding: chunked", 26);
+    if (server->response.encoding > HTTP_ENC_NONE) {
+        snprintf(line, sizeof(line), "Content-Encoding: %s",
+                 server->response.encoding == HTTP_ENC_GZIP ?
+                 "gzip" : "deflate");
+        http_add_line(conn, line, strlen(line));
+    }
+    if (server->response.vary)
+        http_add_line(conn, "Vary: Accept-Encoding", 21);
+    if (server->response.modTime > 0) {
+        http_get_timestr(server, timeBuf, server->response.modTime);
+        snprintf(line, sizeof(line), "Last-Modified: %s", timeBuf);
+        http_add_line(conn, line, strlen(line));
+    }
+    http_add_line(conn, "", 0);
+}
+
+
+
+/*
+ * http_send_headers - fix the headers of the response
+ *
+ * The header block itself is sent together with the body, when the
+ * length of the whole response is known.
+ */
+void
+http_send_headers(httpd *server, off_t contentLength, int modTime)
+{
     if (server->response.headersSent)
         return;
 
     server->response.headersSent = true;
-    write(server->clientSock, "HTTP/1.0 ", 9);
-    write(server->clientSock, server->response.response,
-                   strlen(server->response.response));
-    write(server->clientSock, server->response.headers,
-                   strlen(server->response.headers));
-
-    http_get_timestr(server, timeBuf, 0);
-    write(server->clientSock,"Date: ", 6);
-    write(server->clientSock, timeBuf, strlen(timeBuf));
-    write(server->clientSock, "\n", 1);
-
-    write(server->clientSock, "Connection: close\n", 18);
-    write(server->clientSock, "Content-Type: ", 14);
-    write(server->clientSock, server->response.contentType,
-                   strlen(server->response.contentType));
-    write(server->clientSock, "\n", 1);
-
     if (contentLength > 0) {
-        write(server->clientSock, "Content-Length: ", 16);
-        snprintf(tmpBuf, sizeof(tmpBuf), "%d", contentLength);
-        write(server->clientSock, tmpBuf, strlen(tmpBuf));
-        write(server->clientSock, "\n", 1);
+        server->response.contentLength = contentLength;
+        server->response.modTime = modTime;
+    }
+}
+
+
+
+/*
+ * http_end_response - the response is complete
+ *
+ * Unless parts of it were sent already, the headers now get the
+ * exact length of the body. A chunked body gets its last chunk.
+ */
+void
+http_end_response(httpd *server)
+{
+    httpConn	*conn = server->conn;
+    off_t	len;
 
-        http_get_timestr(server, timeBuf, modTime);
-        write(server->clientSock, "Last-Modified: ", 15);
-        write(server->clientSock, timeBuf, strlen(timeBuf));
-        write(server->clientSock, "\n", 1);
+    if (conn == NULL || conn->broken)
+        return;
+    if (server->response.encoding > HTTP_ENC_NONE)
+        http_deflate(server, NULL, 0, Z_FINISH);
+    if (conn->hdrLen == 0) {
+        len = conn->outLen - conn->outSent + http_file_left(conn);
+        http_build_headers(server, len);
     }
-    write(server->clientSock, "\n", 1);
+    else if (conn->chunked && server->request.method != HTTP_HEAD) {
+        http_seal_chunk(conn);
+        http_append(conn, "0\r\n\r\n", 5);
+    }
+    if (conn->spillFd >= 0) {
+        /* the rest follows the spilled part */
+        if (!http_spill(conn)) {
+            conn->broken = true;
+            http_close_file(conn);
+            return;
+        }
+        conn->fileFd = conn->spillFd;
+        conn->spillFd = -1;
+        conn->parts[0].off = 0;
+        conn->parts[0].end = conn->spillLen;
+        conn->parts[0].headLen = 0;
+        conn->partCount = 1;
+        conn->partNext = 0;
+    }
+    if (server->request.method == HTTP_HEAD) {
+        /* same headers as for GET, but without the body */
+        conn->outLen = conn->outSent = conn->outKept = 0;
+        http_close_file(conn);
+    }
+    if (conn->fcgi)
+        conn->fcgi->ended = true;
+}
+
+
+
+/*
+ * http_parse_time - read a date in one of the formats of HTTP/1.1
+ *
+ * These are RFC 1123, RFC 850 and the one of asctime(). Returns 0,
+ * if the date can not be read.
+ */
+static time_t
+http_parse_time(const char *str)
+{
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    const char	*cp;
+    char	mon[4];
+    int		day, mo, year, hour, min, sec;
+    long	y, era, yoe, doy, doe;
+
+    cp = index(str, ' ');               /* skip the weekday */
+    if (cp == NULL)
+        return 0;
+    if (sscanf(cp, " %d %3s %d %d:%d:%d",
+               &day, mon, &year, &hour, &min, &sec) != 6 &&
+        sscanf(cp, " %d-%3s-%d %d:%d:%d",
+               &day, mon, &year, &hour, &min, &sec) != 6 &&
+        sscanf(cp, " %3s %d %d:%d:%d %d",
+               mon, &day, &hour, &min, &sec, &year) != 6)
+        return 0;
+    cp = strstr(months, mon);
+    if (cp == NULL || strlen(mon) != 3 || (cp - months) % 3 != 0)
+        return 0;
+    mo = (cp - months) / 3 + 1;
+    if (year < 100)
+        year += (year < 70) ? 2000 : 1900;
+
+    /* days since 1970, without depending on the timezone */
+    y = year - (mo <= 2);
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (mo + (mo > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return (time_t) (era * 146097 + doe - 719468) * 86400 +
+        hour * 3600 + min * 60 + sec;
 }
 
 
 
+/*
+ * http_check_modified - compare a time with If-Modified-Since
+ *
+ * Returns 0, if the client has the current version already.
+ */
 int
 http_check_modified(httpd *server, int modTime)
 {
-    char 	timeBuf[HTTP_TIME_STRING_LEN];
+    time_t	since;
+
+    if (*server->request.ifModified == 0)
+        return(1);
+    since = http_parse_time(server->request.ifModified);
+    if (since == 0 || modTime > since)
+        return(1);
+    return 0;
+}
+
+
+
+/*
+ * http_check_match - compare an entity tag with If-None-Match
+ *
+ * Like http_check_modified(), 0 means the client has it already.
+ */
+int
+http_check_match(httpd *server, char *etag)
+{
+    char	*match = server->request.ifNoneMatch;
 
-    http_get_timestr(server, timeBuf, modTime);
-    if (strcmp(timeBuf, server->request.ifModified) == 0)
+    if (*match == 0)
+        return(1);
+    if (strcmp(match, "*") == 0 || strstr(match, etag) != NULL)
         return 0;
     return(1);
 }
 
 
 
+/*
+ * http_check_cached - find out, if the client can use its own copy
+ *
+ * If-None-Match is asked before If-Modified-Since.
+ */
+int
+http_check_cached(httpd *server, char *etag, int modTime)
+{
+    if (*server->request.ifNoneMatch)
+        return http_check_match(server, etag);
+    return http_check_modified(server, modTime);
+}
+
+
+
 static unsigned char isAcceptable[96] =
 
 /* Overencodes */
@@ -294,13 +1081,24 @@ http_escape(char *str)
 
 
 
+/*
+ * http_send_file - send a file as the rest of the response body
+ *
+ * The file is only opened here, http_flush() sends it with sendfile()
+ * after everything else. So nothing may be written after it. When a
+ * part of the response went out already, the file is read into the
+ * body like any other output.
+ */
 void
 http_send_file(httpd *server, char *path)
 {
+    httpConn	*conn = server->conn;
     int	fd,
     len;
-    char	buf[HTTP_MAX_LEN];
+    char	buf[HTTP_READ_BUF_LEN * 16];
 
+    if (conn == NULL || conn->broken || conn->fileFd >= 0)
+        return;
 #ifdef	__OS2__
     fd = open(path,O_RDONLY|O_BINARY);
 #else
@@ -308,14 +1106,245 @@ http_send_file(httpd *server, char *path)
 #endif
     if (fd < 0)
 	return;
-    len = read(fd, buf, HTTP_MAX_LEN);
+#ifndef	__OS2__
+    {
+        struct 	stat sbuf;
+
+        if (conn->hdrLen == 0 && fstat(fd, &sbuf) == 0 &&
+            S_ISREG(sbuf.st_mode)) {
+            conn->fileFd = fd;
+            conn->parts[0].off = 0;
+            conn->parts[0].end = sbuf.st_size;
+            conn->parts[0].headLen = 0;
+            conn->partCount = 1;
+            conn->partNext = 0;
+            server->response.length += sbuf.st_size;
+            return;
+        }
+    }
+#endif
+    len = read(fd, buf, sizeof(buf));
     while (len > 0) {
-        server->response.length += len;
-        write(server->clientSock, buf, len);
-        len = read(fd, buf, HTTP_MAX_LEN);
+        http_write(server, buf, len);
+        len = read(fd, buf, sizeof(buf));
     }
     close(fd);
 }
 
 
 
+/*
+ * http_check_range - find out, if a Range request is to be answered
+ *
+ * Only GET asks for ranges. With If-Range, the client must still have
+ * the current version, given by its strong entity tag or its date.
+ */
+bool
+http_check_range(httpd *server, char *etag, int modTime)
+{
+    char	*ifRange = server->request.ifRange;
+
+    if (server->request.rangeCount == 0 ||
+        server->request.method != HTTP_GET)
+        return false;
+    if (*ifRange == 0)
+        return true;
+    if (*ifRange == '"')
+        return strcmp(ifRange, etag) == 0;
+    if (*ifRange == 'W' && ifRange[1] == '/')
+        return false;
+    return http_parse_time(ifRange) == modTime;
+}
+
+
+
+/*
+ * http_add_part - add a part of the file and its header
+ */
+static void
+http_add_part(httpConn *conn, off_t first, off_t last, int head, int headLen)
+{
+    httpPart	*part = &conn->parts[conn->partCount++];
+
+    part->off = first;
+    part->end = last;
+    part->head = head;
+    part->headLen = headLen;
+}
+
+
+
+#ifdef	__OS2__
+/*
+ * http_read_parts - put the parts into the body, there is no sendfile()
+ */
+static void
+http_read_parts(httpd *server)
+{
+    httpConn	*conn = server->conn;
+    httpPart	*part;
+    char	buf[HTTP_READ_BUF_LEN * 16];
+    int		len;
+
+    /* http_write() counts them again */
+    server->response.length -= http_file_left(conn);
+    for (part = conn->parts; part < conn->parts + conn->partCount; part++) {
+        if (part->headLen > 0)
+            http_write(server, conn->partHeads + part->head, part->headLen);
+        lseek(conn->fileFd, part->off, SEEK_SET);
+        while (part->off < part->end) {
+            len = sizeof(buf);
+            if (part->end - part->off < len)
+                len = part->end - part->off;
+            len = read(conn->fileFd, buf, len);
+            if (len <= 0)
+                break;
+            http_write(server, buf, len);
+            part->off += len;
+        }
+    }
+    http_close_file(conn);
+}
+#endif
+
+
+
+/*
+ * http_send_range - send the parts of a file asked for by Range
+ *
+ * Like http_send_file(), it is sent by http_flush() after the headers.
+ * A single range goes out as it is, several ones as a multipart body
+ * with a header for each part. Ranges beyond the end of the file are
+ * left out, if none remains the answer is 416.
+ */
+void
+http_send_range(httpd *server, char *path)
+{
+    httpConn	*conn = server->conn;
+    httpReq	*req = &server->request;
+    struct 	stat sbuf;
+    char	type[HTTP_MAX_URL],
+    buf[HTTP_MAX_URL + 80],
+    boundary[40];
+    off_t	first, last, length;
+    int		fd, i, len, size;
+
+    if (conn == NULL || conn->broken || conn->fileFd >= 0 || conn->hdrLen)
+        return;
+#ifdef	__OS2__
+    fd = open(path, O_RDONLY|O_BINARY);
+#else
+    fd = open(path, O_RDONLY);
+#endif
+    if (fd < 0)
+        return;
+    if (fstat(fd, &sbuf) < 0 || !S_ISREG(sbuf.st_mode)) {
+        close(fd);
+        return;
+    }
+
+    conn->partCount = conn->partNext = 0;
+    for (i = 0; i < req->rangeCount; i++) {
+        first = req->ranges[i].first;
+        last = req->ranges[i].last;
+        if (first < 0) {
+            first = (last < sbuf.st_size) ? sbuf.st_size - last : 0;
+            last = sbuf.st_size - 1;
+        }
+        else if (last < 0 || last >= sbuf.st_size)
+            last = sbuf.st_size - 1;
+        if (first <= last)
+            http_add_part(conn, first, last + 1, 0, 0);
+    }
+
+    if (conn->partCount == 0) {
+        close(fd);
+        svr_set_response(server, "416 Range Not Satisfiable\n");
+        snprintf(buf, sizeof(buf), "Content-Range: bytes */%lld",
+                 (long long) sbuf.st_size);
+        svr_add_header(server, buf);
+        http_send_headers(server, 0, 0);
+        return;
+    }
+
+    svr_set_response(server, "206 Partial Content\n");
+    conn->fileFd = fd;
+    if (conn->partCount == 1) {
+        snprintf(buf, sizeof(buf), "Content-Range: bytes %lld-%lld/%lld",
+                 (long long) conn->parts[0].off,
+                 (long long) conn->parts[0].end - 1,
+                 (long long) sbuf.st_size);
+        svr_add_header(server, buf);
+        length = conn->parts[0].end - conn->parts[0].off;
+        server->response.length += length;
+        http_send_headers(server, length, sbuf.st_mtime);
+#ifdef	__OS2__
+        http_read_parts(server);
+#endif
+        return;
+    }
+
+    /* every part gets its header, the last one ends the body */
+    strcpy(type, server->response.contentType);
+    snprintf(boundary, sizeof(boundary), "%08lx%08lx",
+             (unsigned long) sbuf.st_mtime, (unsigned long) random());
+    snprintf(buf, sizeof(buf), "multipart/byteranges; boundary=%s",
+             boundary);
+    svr_set_contenttype(server, buf);
+
+    size = (conn->partCount + 1) * (strlen(type) + sizeof(buf));
+    conn->partHeads = malloc(size);
+    if (conn->partHeads == NULL) {
+        http_close_file(conn);
+        svr_set_response(server, "500 Internal Server Error\n");
+        http_send_headers(server, 0, 0);
+        return;
+    }
+    len = 0;
+    length = 0;
+    for (i = 0; i < conn->partCount; i++) {
+        conn->parts[i].head = len;
+        conn->parts[i].headLen =
+            snprintf(conn->partHeads + len, size - len,
+                     "\r\n--%s\r\nContent-Type: %s\r\n"
+                     "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                     boundary, type, (long long) conn->parts[i].off,
+                     (long long) conn->parts[i].end - 1,
+                     (long long) sbuf.st_size);
+        len += conn->parts[i].headLen;
+        length += conn->parts[i].headLen +
+            conn->parts[i].end - conn->parts[i].off;
+    }
+    i = snprintf(conn->partHeads + len, size - len, "\r\n--%s--\r\n",
+                 boundary);
+    http_add_part(conn, 0, 0, len, i);
+    length += i;
+    server->response.length += length;
+    http_send_headers(server, length, sbuf.st_mtime);
+#ifdef	__OS2__
+    http_read_parts(server);
+#endif
+}
+
+
+
+/*
+ * http_close_file - forget the file of a response
+ */
+void
+http_close_file(httpConn *conn)
+{
+    if (conn->spillFd >= 0) {
+        close(conn->spillFd);
+        conn->spillFd = -1;
+    }
+    if (conn->fileFd < 0)
+        return;
+    close(conn->fileFd);
+    conn->fileFd = -1;
+    conn->partCount = conn->partNext = 0;
+    if (conn->partHeads) {
+        free(conn->partHeads);
+        conn->partHeads = NULL;
+    }
+}
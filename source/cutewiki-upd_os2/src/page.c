@@ -16,6 +16,7 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/resource.h>
+#include <pthread.h>
 
 #define PAGE_PRIVATE
 
@@ -27,6 +28,8 @@
 #include "user.h"
 #include "misc.h"
 #include "rcs.h"
+#include "trace.h"
+#include "pagecache.h"
 
 
 
@@ -34,6 +37,9 @@
 bool page_validate_group(Page*, Page*);
 bool page_save_meta(Page * page);
 
+/* readers change the loaded text, the code and the editor of a page */
+static pthread_mutex_t page_lock = PTHREAD_MUTEX_INITIALIZER;
+
 
 /*
  * page_get_datestring - get date as a (static) string
@@ -41,10 +47,10 @@ bool page_save_meta(Page * page);
 char*
 page_get_datestring (Page * page, char * datestring)
 {
-    struct tm * stime;
+    struct tm stime;
 
-    stime = localtime(&page->time);
-    strftime(datestring, MAX_DATELEN-1, "%A, %d. %b. %Y", stime);
+    localtime_r(&page->time, &stime);
+    strftime(datestring, MAX_DATELEN-1, "%A, %d. %b. %Y", &stime);
     datestring[MAX_DATELEN-1] = '\0';
 
     return datestring;
@@ -58,13 +64,13 @@ page_get_datestring (Page * page, char * datestring)
 char*
 page_get_timestring (Page * page, char * timestring)
 {
-    struct tm *    stime;
+    struct tm      stime;
 
-    stime = localtime(&page->time);
+    localtime_r(&page->time, &stime);
 #ifdef	__OS2__
-    strftime(timestring, MAX_TIMELEN-1, "%A,  %d. %b. %Y,  %H:%M", stime);
+    strftime(timestring, MAX_TIMELEN-1, "%A,  %d. %b. %Y,  %H:%M", &stime);
 #else
-    strftime(timestring, MAX_TIMELEN-1, "%A,  %d. %b. %Y,  %k:%M", stime);
+    strftime(timestring, MAX_TIMELEN-1, "%A,  %d. %b. %Y,  %k:%M", &stime);
 #endif
     timestring[MAX_TIMELEN-1] = '\0';
 
@@ -86,6 +92,7 @@ page_scan_links(Page* page)
     char*	text;
     size_t   	count;
     size_t     	max;
+    bool	dynamic;
 
     if (page == NULL || page->text == NULL)
         return;
@@ -96,13 +103,19 @@ page_scan_links(Page* page)
     count = 0;
     max = MAX_WIKIWORDS;
     links = calloc(max, sizeof(char*));
+    dynamic = false;
 
     text = page->text;
     while (*text) {
         if (isupper((unsigned char)*text)) {
 	    char * word;
+	    char * start = text;
 
-	    word = get_alnum(&text);
+	    /* the links outlive the request, so they are not parsed
+	     * into the arena */
+	    while (isalnum((unsigned char)*text) || *text == '_')
+		text++;
+	    word = strndup(start, text - start);
             if (is_wikiword(word)) {
                 size_t i;
 
@@ -135,6 +148,16 @@ page_scan_links(Page* page)
 	    }
 	}
 	else if  (*text == '[') {
+	    char * start = ++text;
+
+	    /* [RecentChanges] and [pages=...] change without the page,
+	     * see do_square() */
+	    while (isalnum((unsigned char)*text))
+		text++;
+	    if (isupper((unsigned char)*start) ||
+		(islower((unsigned char)*start) && *text == '='))
+		dynamic = true;
+
             /* step over all text in squares */
 	    while (*text && *text != ']' && *text != '\n')
 		text++;
@@ -147,6 +170,67 @@ page_scan_links(Page* page)
 
     page->links = links;
     page->linkcnt = count;
+    page->dynamic = dynamic;
+}
+
+
+
+/*
+ * page_is_dynamic - see, if the page shows more than its own text
+ */
+bool
+page_is_dynamic(Page * self)
+{
+    if (self == NULL)
+        return true;
+
+    return self->dynamic;
+}
+
+
+
+/*
+ * page_get_checksum - sum up, what a rendered page depends on
+ *
+ * Besides the page itself, this is what the reader may do with it
+ * and for each link, if there is such a page and how it is shown.
+ */
+unsigned int
+page_get_checksum(Page * self)
+{
+    char	buf[80];
+    unsigned int sum;
+    size_t	i;
+
+    snprintf(buf, sizeof(buf), "%d %ld %d %d %d %d %d",
+	     self->seqno, (long)self->time, self->flags, self->pagetype,
+	     page_is_seen(self), page_is_writable(self),
+	     page_is_edited(self));
+    sum = get_checksum(CHECKSUM_START, buf);
+    sum = get_checksum(sum, self->title);
+    sum = get_checksum(sum, page_get_ownername(self));
+    sum = get_checksum(sum, self->topic);
+    sum = get_checksum(sum, page_find_title(self->topic));
+    if (page_is_edited(self)) {
+	pthread_mutex_lock(&page_lock);
+	sum = get_checksum(sum, self->editor);
+	pthread_mutex_unlock(&page_lock);
+    }
+
+    for (i = 0; i < self->linkcnt; i++) {
+	Page * link = pagelist_find_page(self->links[i]);
+
+	sum = get_checksum(sum, self->links[i]);
+	if (link == NULL) {
+	    sum = get_checksum(sum, NULL);
+	    continue;
+	}
+	snprintf(buf, sizeof(buf), "%d %d",
+		 page_is_seen(link), link->pagetype);
+	sum = get_checksum(sum, buf);
+	sum = get_checksum(sum, link->title);
+    }
+    return sum;
 }
 
 
@@ -309,10 +393,15 @@ page_is_hidden(Page * self)
 bool
 page_is_edited(Page * self)
 {
+    time_t edittime;
+
     if (self == NULL)
 	return true;
 
-    if (self->edittime > time(NULL) - 60 * WIKI_EDITTIMEOUT)
+    pthread_mutex_lock(&page_lock);
+    edittime = self->edittime;
+    pthread_mutex_unlock(&page_lock);
+    if (edittime > time(NULL) - 60 * WIKI_EDITTIMEOUT)
         return true;
 
     return false;
@@ -467,7 +556,7 @@ page_get_topic(Page * self)
 /*
  * page_set_editor - set the editor of the page
  *
- * Also set the time we start editing
+ * Also set the time we start editing, and tell the other processes.
  */
 void
 page_set_editor(Page * self, char * editor)
@@ -475,21 +564,34 @@ page_set_editor(Page * self, char * editor)
     if (self == NULL || editor == NULL)
         return;
 
+    pthread_mutex_lock(&page_lock);
     free(self->editor);
     self->editor = strdup(editor);
     self->edittime = time(NULL);
+    pagelist_note_editor(self);
+    pthread_mutex_unlock(&page_lock);
 }
 
 
 
 /*
  * Return the actual editor of the page
+ *
+ * A reader gets a copy, another one may set the editor meanwhile.
  */
 char *
 page_get_editor(Page * self)
 {
-    if (self != NULL && self->editor)
-        return self->editor;
+    char * editor = NULL;
+
+    if (self != NULL) {
+        pthread_mutex_lock(&page_lock);
+        if (self->editor)
+            editor = arena_strdup(&server->arena, self->editor);
+        pthread_mutex_unlock(&page_lock);
+    }
+    if (editor)
+        return editor;
 
 #if GERMAN
     return "UnbekannterEditor";
@@ -610,6 +712,61 @@ page_get_text(Page * self)
 
 
 
+/*
+ * page_swap_code - give the page other code, call with page_lock
+ *
+ * The page holds the new code, the old one is returned to be freed.
+ */
+static ParseCode *
+page_swap_code(Page * self, ParseCode * code)
+{
+    ParseCode * old = self->code;
+
+    if (code)
+	parse_hold_code(code);
+    self->code = code;
+    return old;
+}
+
+
+
+/*
+ * page_set_code - keep the parsed text with the page
+ *
+ * The code is one block of memory, NULL forgets it. The caller keeps
+ * its own hold on the code.
+ */
+void
+page_set_code(Page * self, ParseCode * code)
+{
+    ParseCode * old;
+
+    pthread_mutex_lock(&page_lock);
+    old = page_swap_code(self, code);
+    pthread_mutex_unlock(&page_lock);
+    parse_free_code(old);
+}
+
+
+
+/*
+ * page_get_code - get the parsed text, to be given up by parse_free_code()
+ */
+ParseCode *
+page_get_code(Page * self)
+{
+    ParseCode * code;
+
+    pthread_mutex_lock(&page_lock);
+    code = self->code;
+    if (code)
+	parse_hold_code(code);
+    pthread_mutex_unlock(&page_lock);
+    return code;
+}
+
+
+
 /*
  *
  */
@@ -676,6 +833,9 @@ page_new (const char* name, int flags)
 	self->pagetype = PT_NORMAL;
 	self->editor = NULL;
 	self->edittime = 0;
+	self->dynamic = false;
+	self->code = NULL;
+	self->textusers = 0;
     }
 
     return self;
@@ -716,6 +876,7 @@ page_free(Page* page)
     free(page->password);
     free(page->topic);
     free(page->editor);
+    parse_free_code(page->code);
     free(page);
 
     return true;
@@ -755,13 +916,14 @@ page_del(Page* page)
         for (i = 0; list[i] != NULL; i++) {
 	    Page * other = list[i];
 
-            if (other->group == page->group) {
+            if (other->group == page) {
                 other->group = NULL;
                 page_save_meta(other);
             }
 	}
 
         /* now really delete the page itself */
+        pagelist_note_deleted(page->name);
         return page_del_force(page);
     }
 
@@ -770,71 +932,70 @@ page_del(Page* page)
 
 
 
-bool
-page_input_meta(Page* page, FILE* file)
+/*
+ * page_input_meta_line - take over a line of meta info
+ */
+static void
+page_input_meta_line(Page* page, const char* buf)
 {
-    char buf[1024];
-    bool retval = false;
+    char key[1024];
+    char val[1024];
 
-    /* set standards, if no meta info available */
-    page->flags &= ~PF_PRIVATE;
-    page->flags &= ~PF_HIDDEN;
-    page->time = time(NULL);
-
-    if (file) {
-        /* read the meta info line by line */
-        while( fgets(buf, (int)sizeof(buf), file) ) {
-            char key[1024];
-            char val[1024];
-
-            sscanf (buf, " %[a-z0-9] : %[^\n]", key, val);
+    if (sscanf (buf, " %[a-z0-9] : %[^\n]", key, val) != 2)
+        return;
 
-            if (!strncmp(key, "title", 5)) {
-                page->title = strdup(val);
-            }
-            else if (!strncmp(key, "owner", 5)) {
-                page->owner = strdup(val);
-            }
-            else if (!strncmp(key, "time", 4)) {
-                page->time = (time_t)atol(val);
-            }
+    if (!strncmp(key, "title", 5)) {
+        page->title = strdup(val);
+    }
+    else if (!strncmp(key, "owner", 5)) {
+        page->owner = strdup(val);
+    }
+    else if (!strncmp(key, "time", 4)) {
+        page->time = (time_t)atol(val);
+    }
 #if USERID
-	    else if (!strncmp(key, "userid", 6)) {
-		user_set_userid(page, strdup(val));
-	    }
+    else if (!strncmp(key, "userid", 6)) {
+        user_set_userid(page, strdup(val));
+    }
 #endif
-            else if (!strncmp(key, "password", 8)) {
-                page->password = strdup(val);
-		page->pagetype = PT_USER;
-            }
-            else if (!strncmp(key, "topic", 5)) {
-                page->topic = strdup(val);
-            }
-            else if (!strncmp(key, "group", 5)) {
-                page->group = pagelist_find_page(val);
-            }
-            else if (!strncmp(key, "pagetype", 8)) {
-                if (!strncmp(val, "homepage", 8))
-                    page->pagetype = PT_USER;
-                else if (!strncmp(val, "grouppage", 9))
-                    page->pagetype = PT_GROUP;
-                else if (!strncmp(val, "category", 8))
-                    page->pagetype = PT_CATEGORY;
-                else
-                    page->pagetype = PT_NORMAL;
-            }
-            else if (!strncmp(key, "private", 7)) {
-                if (!strncmp(val, "yes", 3))
-                    page->flags |= PF_PRIVATE;
-            }
-            else if (!strncmp(key, "hidden", 6)) {
-                if (!strncmp(val, "yes", 3))
-                    page->flags |= PF_HIDDEN;
-            }
-        }
-        retval = true;
+    else if (!strncmp(key, "password", 8)) {
+        page->password = strdup(val);
+        page->pagetype = PT_USER;
+    }
+    else if (!strncmp(key, "topic", 5)) {
+        page->topic = strdup(val);
+    }
+    else if (!strncmp(key, "group", 5)) {
+        page->group = pagelist_find_page(val);
+    }
+    else if (!strncmp(key, "pagetype", 8)) {
+        if (!strncmp(val, "homepage", 8))
+            page->pagetype = PT_USER;
+        else if (!strncmp(val, "grouppage", 9))
+            page->pagetype = PT_GROUP;
+        else if (!strncmp(val, "category", 8))
+            page->pagetype = PT_CATEGORY;
+        else
+            page->pagetype = PT_NORMAL;
+    }
+    else if (!strncmp(key, "private", 7)) {
+        if (!strncmp(val, "yes", 3))
+            page->flags |= PF_PRIVATE;
     }
+    else if (!strncmp(key, "hidden", 6)) {
+        if (!strncmp(val, "yes", 3))
+            page->flags |= PF_HIDDEN;
+    }
+}
+
+
 
+/*
+ * page_default_meta - fill in, what the meta info did not tell
+ */
+static void
+page_default_meta(Page* page)
+{
     if (page->title == NULL)
         page->title = make_spaced_title(page->name);
 
@@ -845,7 +1006,29 @@ page_input_meta(Page* page, FILE* file)
         page->owner = strdup("UnknownAuthor");
 #endif
     }
+}
+
 
+
+bool
+page_input_meta(Page* page, FILE* file)
+{
+    char buf[1024];
+    bool retval = false;
+
+    /* set standards, if no meta info available */
+    page->flags &= ~PF_PRIVATE;
+    page->flags &= ~PF_HIDDEN;
+    page->time = time(NULL);
+
+    if (file) {
+        /* read the meta info line by line */
+        while( fgets(buf, (int)sizeof(buf), file) )
+            page_input_meta_line(page, buf);
+        retval = true;
+    }
+
+    page_default_meta(page);
     return retval;
 }
 
@@ -959,14 +1142,21 @@ page_save_meta(Page * page)
     FILE*	file;
     char	fn[MAX_PATH];
 
+    char	tmp[MAX_PATH + 4];
+
     /* save page's meta information */
     page_get_metafilename(page, fn);
-    file = fopen(fn, "w");
+    snprintf(tmp, sizeof(tmp), "%s.new", fn);
+    file = fopen(tmp, "w");
     if (!file)
         return false;
 
     page_output_meta(page, file);
     fclose(file);
+    rename(tmp, fn);
+
+    /* the other processes have to read the page again */
+    pagelist_note_saved(page);
 
     return true;
 }
@@ -974,27 +1164,99 @@ page_save_meta(Page * page)
 
 
 /*
- * page_load_text - load the text of a page from file
+ * page_output_index - write a page into the index of all pages
  *
- * set loaded flag, if we did load the text in this function. We later
- * need this to prevent a page's text beeing freed, while the page
- * itself is beeing displayed at that moment.
+ * Next to the meta info it holds, what is only known after reading
+ * the text or while the wiki runs.
  */
 bool
-page_load_text(Page* page, bool* loaded)
+page_output_index(Page * page, FILE* file)
+{
+    size_t i;
+
+    fprintf(file, "page: %s %d %d\n", page->name, page->seqno,
+            (int)page->dynamic);
+    page_output_meta(page, file);
+    if (page->editor)
+        fprintf(file, "editor: %ld %s\n", (long)page->edittime, page->editor);
+    for (i = 0; i < page->linkcnt; i++)
+        fprintf(file, "link: %s\n", page->links[i]);
+    fprintf(file, "end:\n");
+
+    return !ferror(file);
+}
+
+
+
+/*
+ * page_input_index - read the next page of the index
+ *
+ * All pages must be in the list already, so their groups are found.
+ * Returns NULL at the end or if the index is broken.
+ */
+Page *
+page_input_index(FILE* file)
+{
+    char	buf[1024];
+    char	name[MAX_WIKINAME];
+    char	editor[MAX_WIKINAME];
+    int		seqno, dynamic;
+    long	when;
+    size_t	max;
+    Page *	page;
+
+    if (fgets(buf, (int)sizeof(buf), file) == NULL ||
+        sscanf(buf, "page: %255s %d %d", name, &seqno, &dynamic) != 3)
+        return NULL;
+    page = pagelist_find_page(name);
+    if (page == NULL)
+        return NULL;
+
+    page->seqno = seqno;
+    page->dynamic = dynamic;
+    page->flags &= ~(PF_PRIVATE | PF_HIDDEN);
+    free(page->title);
+    page->title = NULL;
+
+    max = MAX_WIKIWORDS;
+    page->links = calloc(max, sizeof(char*));
+    page->linkcnt = 0;
+    while (fgets(buf, (int)sizeof(buf), file)) {
+        buf[strcspn(buf, "\n")] = '\0';
+        if (!strcmp(buf, "end:")) {
+            page_default_meta(page);
+            return page;
+        }
+        if (!strncmp(buf, "link: ", 6)) {
+            if (page->linkcnt == max) {
+                max *= 2;
+                page->links = realloc(page->links, max * sizeof(char*));
+            }
+            page->links[page->linkcnt++] = strdup(buf + 6);
+        }
+        else if (sscanf(buf, "editor: %ld %255s", &when, editor) == 2) {
+            page->editor = strdup(editor);
+            page->edittime = when;
+        }
+        else
+            page_input_meta_line(page, buf);
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * page_read_text - read the text of a page from its file
+ */
+static bool
+page_read_text(Page* page)
 {
     char filename[MAX_PATH];
     FILE *file;
     size_t len;
 
-    /* is page already loaded? */
-    if (page->text) {
-        *loaded = false;
-	return true;
-    }
-    *loaded = true;
-
-    /* load page's text */
     page_get_textfilename(page, filename);
     file = fopen(filename, "r");
     if (file != NULL) {
@@ -1026,6 +1288,46 @@ page_load_text(Page* page, bool* loaded)
 
 
 
+/*
+ * page_load_text - load the text of a page from file
+ *
+ * set loaded flag, if we did load the text in this function. We later
+ * need this to prevent a page's text beeing freed, while the page
+ * itself is beeing displayed at that moment.
+ *
+ * Readers load the same page at the same time, the text is freed by
+ * the last of them.
+ */
+bool
+page_load_text(Page* page, bool* loaded)
+{
+    TraceSpan span;
+    bool done = true;
+
+    pthread_mutex_lock(&page_lock);
+
+    /* is page already loaded and kept? */
+    if (page->text && page->textusers == 0) {
+        pthread_mutex_unlock(&page_lock);
+        *loaded = false;
+	return true;
+    }
+
+    /* load page's text */
+    if (page->text == NULL) {
+        TRACE_BEGIN(&span, "page_load_text", page->name);
+        done = page_read_text(page);
+        TRACE_END(&span);
+    }
+    if (done)
+        page->textusers++;
+    *loaded = done;
+    pthread_mutex_unlock(&page_lock);
+    return done;
+}
+
+
+
 /*
  * page_unload_text - save the text of a page to file
  *
@@ -1039,38 +1341,96 @@ page_load_text(Page* page, bool* loaded)
 bool
 page_unload_text(Page * page, bool loaded)
 {
-    
+    pthread_mutex_lock(&page_lock);
+    if (page->textusers > 0 && loaded)
+	loaded = --page->textusers == 0;
     if (page->text && loaded) {
 	if (page_has_changed(page)) {
 	    FILE*	file;
 	    char	filename[MAX_PATH];
+	    char	tmp[MAX_PATH + 4];
 
-	    /* now save page's text */
+	    /* now save page's text, readers see the old or the new one */
 	    page_get_textfilename(page, filename);
+	    snprintf(tmp, sizeof(tmp), "%s.new", filename);
 
-	    file = fopen(filename, "w");
-	    if (!file)
+	    file = fopen(tmp, "w");
+	    if (!file) {
+		pthread_mutex_unlock(&page_lock);
 		return false;
+	    }
 
 	    page->flags &= ~PF_CHANGED;
 	    page->time = time(NULL);
 
 	    fwrite(page->text, 1, strlen(page->text), file);
 	    fclose(file);
+	    rename(tmp, filename);
 
 	    /* now update info about reverse links */
 	    page_scan_links(page);
+	    parse_free_code(page_swap_code(page, NULL));
 
 	}
 	free(page->text);
 	page->text = NULL;
     }
+    pthread_mutex_unlock(&page_lock);
 
     return true;
 }
 
 
 
+/*
+ * page_get_textsize - get the memory taken by the loaded text
+ */
+size_t
+page_get_textsize(Page * page)
+{
+    size_t size = 0;
+
+    pthread_mutex_lock(&page_lock);
+    if (page->text)
+	size = strlen(page->text) + 1;
+    pthread_mutex_unlock(&page_lock);
+    return size;
+}
+
+
+
+/*
+ * page_reload - read a page again, that another process did change
+ */
+void
+page_reload(Page * self, int seqno)
+{
+    bool loaded;
+
+    free(self->title);
+    free(self->owner);
+    free(self->password);
+    free(self->topic);
+    self->title = self->owner = self->password = self->topic = NULL;
+    self->group = NULL;
+    self->pagetype = PT_NORMAL;
+    self->seqno = seqno;
+    self->edittime = 0;
+    pagecache_drop(self->name);
+    page_set_code(self, NULL);
+    if (!page_load_meta(self))
+        page_input_meta(self, NULL);
+
+    free(self->text);
+    self->text = NULL;
+    if (page_load_text(self, &loaded)) {
+        page_scan_links(self);
+        page_unload_text(self, loaded);
+    }
+}
+
+
+
 /*
  * page_print_page
  */
@@ -1115,6 +1475,7 @@ page_edit(const char* name, const char* title, const char* text,
 	page = pagelist_insert_page(name, 0);
     else if (!page_is_saveable(page, seqno))
 	return false;
+    pagecache_drop(name);
 
     if (title != NULL && strlen(title) > 0) {
 	free(page->title);
@@ -24,13 +24,29 @@
 #include <arpa/inet.h> 
 #include <netdb.h>
 #include <sys/socket.h> 
+#include <sys/un.h>
 #include <netdb.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef	__OS2__
+#include <poll.h>
+#else
+#include <sys/epoll.h>
+#endif
+#include <sys/time.h>
+#include <zlib.h>
 
 #include "config.h"
 #include "svr.h"
 #include "http.h"
 #include "request.h"
+#include "cache.h"
+#include "fcgi.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
 #include "types.h"
 
 #ifdef	__OS2__
@@ -39,8 +55,155 @@
 
 
 
+#ifdef	__OS2__
+/*
+ * OS/2 has no epoll. The few calls the reactor makes are done with
+ * poll() over a table of the watched sockets, with the same one-shot
+ * rule. Only the reactor thread uses it, so it takes no lock.
+ */
+#define	EPOLLIN		POLLIN
+#define	EPOLLOUT	POLLOUT
+#define	EPOLLONESHOT	0x40000000
+#define	EPOLL_CTL_ADD	1
+#define	EPOLL_CTL_DEL	2
+#define	EPOLL_CTL_MOD	3
+#define	EPOLL_CLOEXEC	0
+
+struct epoll_event {
+    unsigned int events;
+    union {
+	void	*ptr;
+	int	fd;
+    } data;
+};
+
+static struct pollfd *svr_pollfds;	/* fd is -1 while not armed */
+static struct epoll_event *svr_pollevs;
+static int	*svr_pollsocks;
+static int	svr_pollcount = 0;
+static int	svr_pollsize = 0;
+
+
+
+static int
+epoll_create1(int flags)
+{
+    return 0;
+}
+
+
+
+static int
+epoll_ctl(int epfd, int op, int fd, struct epoll_event * ev)
+{
+    int		i;
+
+    for (i = 0; i < svr_pollcount; i++)
+	if (svr_pollsocks[i] == fd)
+	    break;
+    if (op == EPOLL_CTL_DEL) {
+	if (i < svr_pollcount) {
+	    svr_pollcount--;
+	    svr_pollfds[i] = svr_pollfds[svr_pollcount];
+	    svr_pollevs[i] = svr_pollevs[svr_pollcount];
+	    svr_pollsocks[i] = svr_pollsocks[svr_pollcount];
+	}
+	return 0;
+    }
+    if (i == svr_pollcount) {
+	if (svr_pollcount == svr_pollsize) {
+	    int	size = svr_pollsize ? svr_pollsize * 2 : 64;
+	    void *fds, *evs, *socks;
+
+	    fds = realloc(svr_pollfds, size * sizeof(struct pollfd));
+	    if (fds)
+		svr_pollfds = fds;
+	    evs = realloc(svr_pollevs, size * sizeof(struct epoll_event));
+	    if (evs)
+		svr_pollevs = evs;
+	    socks = realloc(svr_pollsocks, size * sizeof(int));
+	    if (socks)
+		svr_pollsocks = socks;
+	    if (fds == NULL || evs == NULL || socks == NULL)
+		return -1;
+	    svr_pollsize = size;
+	}
+	svr_pollcount++;
+	svr_pollsocks[i] = fd;
+    }
+    svr_pollfds[i].fd = fd;
+    svr_pollfds[i].events = ev->events & (POLLIN | POLLOUT);
+    svr_pollfds[i].revents = 0;
+    svr_pollevs[i] = *ev;
+    return 0;
+}
+
+
+
+static int
+epoll_wait(int epfd, struct epoll_event * events, int max, int timeout)
+{
+    int		i, n = 0;
+
+    if (poll(svr_pollfds, svr_pollcount, timeout) <= 0)
+	return 0;
+    for (i = 0; i < svr_pollcount && n < max; i++) {
+	if (svr_pollfds[i].fd < 0 || svr_pollfds[i].revents == 0)
+	    continue;
+	/* errors show up, when the socket is read or written */
+	events[n].events = svr_pollfds[i].events;
+	events[n++].data = svr_pollevs[i].data;
+	if (svr_pollevs[i].events & EPOLLONESHOT)
+	    svr_pollfds[i].fd = -1;
+    }
+    return n;
+}
+#endif
+
+
+
 /* Global variables for wiki settings */
-httpd	*server;        /* this is our webserver instance */
+__thread httpd	*server;        /* this worker's webserver instance */
+
+/* C handlers share the wiki's global state: readers run together,
+ * a handler changing it runs alone */
+static pthread_rwlock_t svr_handler_lock = PTHREAD_RWLOCK_INITIALIZER;
+static __thread bool svr_writing;	/* this thread holds the write side */
+
+#define SVR_MAX_EVENTS	64
+#define SVR_CLIENT_SLOTS	256
+
+#define SVR_CLIENT_BUSY	"HTTP/1.0 503 Service Unavailable\r\n" \
+			"Connection: close\r\nContent-Length: 0\r\n\r\n"
+
+/* number of open connections of a client address */
+struct svr_client {
+    unsigned int addr;
+    int		count;
+    struct svr_client *next;
+};
+
+/*
+ * The reactor owns all connections while they are read or written.
+ * Only connections with a complete request are queued for the
+ * workers, which give them back after processing.
+ */
+struct http_reactor {
+    int		epollFd;
+    int		wakeFd[2];		/* workers hand back connections */
+    pthread_t	thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    httpConn	*readyHead;		/* requests waiting for a worker */
+    httpConn	*readyTail;
+    httpConn	*done;			/* responses waiting to be sent */
+    httpConn	*conns;			/* all connections of the reactor */
+    int		connCount;
+    bool	stopping;		/* no new connections are taken */
+    httpd	*server;		/* the settings */
+    TimerWheel	timers;			/* the deadlines of the connections */
+    struct svr_client *clients[SVR_CLIENT_SLOTS];
+};
 
 
 
@@ -99,13 +262,98 @@ svr_encode_url(char * str)
     return(new);
 }
 
-httpd *
-svr_new(char * host, int port)
+/*
+ * svr_open_port - bind a listening socket to the port
+ *
+ * A shared port may be bound by several processes at once. With a
+ * backlog of 0 the port is only taken, but nobody listens on it.
+ */
+static int
+svr_open_port(char * host, int port, bool shared, int backlog)
 {
-    httpd	*new;
     int	sock, opt;
     struct  sockaddr_in     addr;
 
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock  < 0)
+        return(-1);
+#ifdef SO_REUSEADDR
+    opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char*)&opt,sizeof(int));
+#endif
+#ifdef SO_REUSEPORT
+    opt = 1;
+    if (shared)
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char*)&opt,sizeof(int));
+#endif
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (host == HTTP_ANY_ADDR) {
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    }
+    else {
+        addr.sin_addr.s_addr = inet_addr(host);
+    }
+    addr.sin_port = htons((u_short)port);
+    if (bind(sock,(struct sockaddr *)&addr,sizeof(addr)) <0) {
+        close(sock);
+        return(-1);
+    }
+    if (backlog > 0)
+        listen(sock, backlog);
+
+    /* the reactor accepts until the backlog is empty */
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    return(sock);
+}
+
+
+
+/*
+ * svr_open_local - listen on a Unix socket
+ *
+ * A socket left behind by a process before is replaced. Like the
+ * port, it is open for every user of the host.
+ */
+static int
+svr_open_local(char * path, int backlog)
+{
+    struct  sockaddr_un     addr;
+    int	sock;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return(-1);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return(-1);
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(sock, backlog) < 0) {
+        close(sock);
+        return(-1);
+    }
+    chmod(path, 0666);
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    return(sock);
+}
+
+
+
+/*
+ * svr_new - create a server on a port
+ *
+ * The socket is HTTP_OWN_PORT to listen on the port, HTTP_SHARED_PORT
+ * to only take it for worker processes calling svr_share_port(), or
+ * a listening socket inherited from the process running before.
+ */
+httpd *
+svr_new(char * host, int port, int sock)
+{
+    httpd	*new;
+
     /*
      ** Create the handle and setup it's basic config
      */
@@ -126,87 +374,1073 @@ svr_new(char * host, int port)
      ** Setup the socket
      */
 
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock  < 0) {
+    if (sock == HTTP_OWN_PORT)
+        sock = svr_open_port(new->host, port, false, 128);
+    else if (sock == HTTP_SHARED_PORT)
+        sock = svr_open_port(new->host, port, true, 0);
+    else
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    new->serverSock = sock;
+    if (new->serverSock < 0) {
         free(new);
         return(NULL);
     }
-#ifdef SO_REUSEADDR
-    opt = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char*)&opt,sizeof(int));
+    new->keepAliveTimeout = HTTP_KEEPALIVE_TIMEOUT;
+    new->keepAliveMax = HTTP_KEEPALIVE_MAX;
+    new->headerTimeout = HTTP_HEADER_TIMEOUT;
+    new->bodyTimeout = HTTP_BODY_TIMEOUT;
+    new->sendTimeout = HTTP_SEND_TIMEOUT;
+    new->clientMax = HTTP_CLIENT_MAX;
+    new->deflateLevel = HTTP_DEFLATE_LEVEL;
+    new->startTime = time(NULL);
+    return(new);
+}
+
+
+
+/*
+ * svr_new_fcgi - create a FastCGI server on a Unix socket
+ *
+ * The socket is HTTP_OWN_PORT or HTTP_SHARED_PORT to listen on the
+ * path, worker processes inherit it. Or it is the socket of the
+ * process running before.
+ */
+httpd *
+svr_new_fcgi(char * path, int sock)
+{
+    httpd	*new;
+
+    if (sock == HTTP_OWN_PORT || sock == HTTP_SHARED_PORT)
+        sock = svr_open_local(path, 128);
+    if (sock < 0)
+        return(NULL);
+    new = svr_new(HTTP_ANY_ADDR, 0, sock);
+    if (new == NULL) {
+        close(sock);
+        return(NULL);
+    }
+    new->fcgiPath = strdup(path);
+    return(new);
+}
+
+
+
+/*
+ * svr_copy_settings - take over the settings of the master
+ */
+static void
+svr_copy_settings(httpd * new, httpd * master)
+{
+    new->keepAliveTimeout = master->keepAliveTimeout;
+    new->keepAliveMax = master->keepAliveMax;
+    new->headerTimeout = master->headerTimeout;
+    new->bodyTimeout = master->bodyTimeout;
+    new->sendTimeout = master->sendTimeout;
+    new->clientMax = master->clientMax;
+    new->cacheMaxAge = master->cacheMaxAge;
+    new->deflateLevel = master->deflateLevel;
+    new->sync = master->sync;
+    new->behind = master->behind;
+    new->generation = master->generation;
+}
+
+
+
+/*
+ * svr_clone - create a request context for a worker thread
+ *
+ * The clone shares the listening socket, the registered content and
+ * the logs of the given server, but has its own request, response,
+ * variables and buffers.
+ */
+httpd *
+svr_clone(httpd * master)
+{
+    httpd	*new;
+
+    new = malloc(sizeof(httpd));
+    if (new == NULL)
+        return(NULL);
+    bzero(new, sizeof(httpd));
+    new->port = master->port;
+    new->serverSock = master->serverSock;
+    new->clientSock = -1;
+    new->reactor = master->reactor;
+    new->startTime = master->startTime;
+    svr_copy_settings(new, master);
+    strncpy(new->fileBasePath, master->fileBasePath, HTTP_MAX_URL);
+    new->content = master->content;
+    new->routes = master->routes;
+    new->routeList = master->routeList;
+    new->routeMask = master->routeMask;
+    new->routeCount = master->routeCount;
+    new->accessLog = master->accessLog;
+    new->errorLog = master->errorLog;
+    new->clone = true;
+    return(new);
+}
+
+/*
+ * svr_share_port - listen on the port together with other processes
+ *
+ * Each process has an own socket, the kernel spreads the connections
+ * over them.
+ */
+int
+svr_share_port(httpd * server)
+{
+    /* the Unix socket of the master is used by all */
+    if (server->fcgiPath)
+        return (server->serverSock < 0) ? -1 : 0;
+    svr_close_port(server);
+    server->serverSock = svr_open_port(server->host, server->port, true, 128);
+    return (server->serverSock < 0) ? -1 : 0;
+}
+
+
+
+/*
+ * svr_close_port - stop listening
+ */
+void
+svr_close_port(httpd * server)
+{
+    if (server->serverSock >= 0)
+        close(server->serverSock);
+    server->serverSock = -1;
+}
+
+
+
+/*
+ * svr_stop - let the connections finish, but take no new ones
+ *
+ * The reactor closes the socket, the connections are closed after
+ * their next response. svr_connections() tells, how many are still
+ * open.
+ */
+void
+svr_stop(httpd * server)
+{
+    struct http_reactor *reactor = server->reactor;
+
+    server->keepAliveMax = 0;
+    svr_reconfigure(server);
+    pthread_mutex_lock(&reactor->lock);
+    reactor->stopping = true;
+    pthread_mutex_unlock(&reactor->lock);
+    write(reactor->wakeFd[1], "", 1);
+}
+
+
+
+int
+svr_connections(httpd * server)
+{
+    return server->reactor ? server->reactor->connCount : 0;
+}
+
+
+
+void
+svr_del(httpd * server)
+{
+    if (server == NULL)
+        return;
+
+    if (server->clone) {
+        if (server->zstream) {
+            deflateEnd(server->zstream);
+            free(server->zstream);
+        }
+        free(server->utfBuf);
+        free(server->copy);
+        arena_exit(&server->arena);
+        free(server);
+        return;
+    }
+
+    if (server->host)
+        free(server->host);
+    free(server->fcgiPath);
+
+    free(server);
+    server = NULL;
+}
+
+
+
+/*
+ * svr_client_slot - find the counter of a client address
+ */
+static struct svr_client **
+svr_client_slot(struct http_reactor * reactor, unsigned int addr)
+{
+    struct svr_client **slot;
+
+    slot = &reactor->clients[(addr * 2654435761u) >> 24];
+    while (*slot && (*slot)->addr != addr)
+        slot = &(*slot)->next;
+    return slot;
+}
+
+
+
+/*
+ * svr_client_add - count a new connection of a client
+ *
+ * Returns false, if the client has too many connections open.
+ */
+static bool
+svr_client_add(struct http_reactor * reactor, unsigned int addr)
+{
+    struct svr_client **slot = svr_client_slot(reactor, addr);
+    int		max = reactor->server->clientMax;
+
+    if (*slot == NULL) {
+        *slot = malloc(sizeof(struct svr_client));
+        if (*slot == NULL)
+            return false;
+        (*slot)->addr = addr;
+        (*slot)->count = 0;
+        (*slot)->next = NULL;
+    }
+    if (max > 0 && (*slot)->count >= max)
+        return false;
+    (*slot)->count++;
+    return true;
+}
+
+
+
+/*
+ * svr_client_del - a connection of a client was closed
+ */
+static void
+svr_client_del(struct http_reactor * reactor, unsigned int addr)
+{
+    struct svr_client **slot = svr_client_slot(reactor, addr);
+    struct svr_client *client = *slot;
+
+    if (client && --client->count <= 0) {
+        *slot = client->next;
+        free(client);
+    }
+}
+
+
+
+/*
+ * svr_conn_close - forget a connection
+ */
+static void
+svr_conn_close(struct http_reactor * reactor, httpConn * conn)
+{
+    timer_del(&conn->timer);
+    if (conn->fcgi)
+        fcgi_del(conn->fcgi);
+    else
+        svr_client_del(reactor, conn->addr);
+    reactor->connCount--;
+    if (conn->prevConn)
+        conn->prevConn->nextConn = conn->nextConn;
+    else
+        reactor->conns = conn->nextConn;
+    if (conn->nextConn)
+        conn->nextConn->prevConn = conn->prevConn;
+
+#ifdef	__OS2__
+    epoll_ctl(reactor->epollFd, EPOLL_CTL_DEL, conn->sock, NULL);
 #endif
-    new->serverSock = sock;
-    bzero(&addr, sizeof(addr));
-    addr.sin_family = AF_INET;
-    if (new->host == HTTP_ANY_ADDR) {
-        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    close(conn->sock);
+    http_close_file(conn);
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+}
+
+
+
+/*
+ * svr_conn_arm - wait for the next event of a connection
+ */
+static void
+svr_conn_arm(struct http_reactor * reactor, httpConn * conn,
+             int events, int op)
+{
+    struct epoll_event ev;
+
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    epoll_ctl(reactor->epollFd, op, conn->sock, &ev);
+}
+
+
+
+/*
+ * svr_conn_abort - drop a connection without a farewell
+ *
+ * The reset spares the socket the time in TIME_WAIT.
+ */
+static void
+svr_conn_abort(struct http_reactor * reactor, httpConn * conn)
+{
+    struct linger lng;
+
+    lng.l_onoff = 1;
+    lng.l_linger = 0;
+    setsockopt(conn->sock, SOL_SOCKET, SO_LINGER, &lng, sizeof(lng));
+    svr_conn_close(reactor, conn);
+}
+
+
+
+/*
+ * svr_conn_timeout - a connection missed its deadline
+ */
+static void
+svr_conn_timeout(Timer * timer, void * arg)
+{
+    struct http_reactor *reactor = arg;
+    httpConn *conn = timer->data;
+
+    if (conn->waiting == HTTP_WAIT_IDLE)
+        svr_conn_close(reactor, conn);
+    else
+        svr_conn_abort(reactor, conn);
+}
+
+
+
+/*
+ * svr_conn_watch - set the deadline for the part still to be read
+ *
+ * The client has headerTimeout seconds for the headers and bodyTimeout
+ * for the body, more data does not move them.  A persistent connection
+ * may be idle for keepAliveTimeout between the requests.
+ */
+static void
+svr_conn_watch(struct http_reactor * reactor, httpConn * conn)
+{
+    httpd	*server = reactor->server;
+    int		waiting, timeout;
+
+    if (conn->inLen == 0 && conn->requests > 0) {
+        waiting = HTTP_WAIT_IDLE;
+        timeout = server->keepAliveTimeout;
+    }
+    else if (conn->headLen == 0) {
+        waiting = HTTP_WAIT_HEADER;
+        timeout = server->headerTimeout;
+    }
+    else {
+        waiting = HTTP_WAIT_BODY;
+        timeout = server->bodyTimeout;
+    }
+    if (waiting == conn->waiting && timer_pending(&conn->timer))
+        return;
+    conn->waiting = waiting;
+    timer_add(&reactor->timers, &conn->timer, http_clock() + timeout);
+}
+
+
+
+/*
+ * svr_conn_complete - check, if the buffered request is complete
+ *
+ * Returns the length of the request with its body, 0 if more data is
+ * needed and -1 if the request is too large.  A body too big for the
+ * buffer is not waited for, the worker reads the bodyPending bytes
+ * left from the socket.
+ */
+static int
+svr_conn_complete(httpConn * conn)
+{
+    char	*cp, *last;
+    int	bodyLen;
+
+    conn->bodyPending = 0;
+    last = conn->in + conn->inLen;
+    if (conn->headLen == 0) {
+        /* look for the empty line ending the headers */
+        cp = conn->in + conn->scanned;
+        while ((cp = memchr(cp, '\n', last - cp)) != NULL) {
+            cp++;
+            if (cp < last && *cp == '\n') {
+                conn->headLen = cp + 1 - conn->in;
+                break;
+            }
+            if (cp + 1 < last && cp[0] == '\r' && cp[1] == '\n') {
+                conn->headLen = cp + 2 - conn->in;
+                break;
+            }
+        }
+        if (conn->headLen == 0) {
+            conn->scanned = conn->inLen > 2 ? conn->inLen - 2 : 0;
+            return (conn->inLen >= HTTP_MAX_LEN) ? -1 : 0;
+        }
+    }
+
+    /* the headers are complete, how much body is announced? */
+    bodyLen = 0;
+    cp = conn->in;
+    last = conn->in + conn->headLen;
+    while ((cp = memchr(cp, '\n', last - cp)) != NULL) {
+        cp++;
+        if (strncasecmp(cp, "Content-Length:", 15) == 0) {
+            bodyLen = atoi(cp + 15);
+            break;
+        }
+    }
+    if (bodyLen < 0 || bodyLen > HTTP_MAX_BODY)
+        return -1;
+    if (conn->inLen >= conn->headLen + bodyLen)
+        return conn->headLen + bodyLen;
+    if (conn->headLen + bodyLen >= HTTP_MAX_LEN) {
+        conn->bodyPending = conn->headLen + bodyLen - conn->inLen;
+        return conn->inLen;
+    }
+    return 0;
+}
+
+
+
+/*
+ * svr_conn_read - read what the client has sent so far
+ *
+ * Returns -1, if the connection was closed or broken.
+ */
+static int
+svr_conn_read(httpConn * conn)
+{
+    int	len;
+
+    /* keep a byte free to terminate the request */
+    while (1) {
+        if (conn->inLen + 1 >= conn->inSize) {
+            char *new;
+
+            if (conn->inSize >= HTTP_MAX_LEN)
+                return 0;       /* svr_conn_complete() refuses it */
+            new = realloc(conn->in, conn->inSize * 2);
+            if (new == NULL)
+                return -1;
+            conn->in = new;
+            conn->inSize *= 2;
+        }
+        len = read(conn->sock, conn->in + conn->inLen,
+                   conn->inSize - conn->inLen - 1);
+        if (len > 0) {
+            conn->inLen += len;
+            continue;
+        }
+        if (len == 0)
+            return -1;
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        return -1;
+    }
+}
+
+
+
+/*
+ * svr_conn_ready - hand a complete request to the workers
+ */
+static void
+svr_conn_ready(struct http_reactor * reactor, httpConn * conn)
+{
+    /* the worker keeps the deadline of a body read from the socket */
+    timer_del(&conn->timer);
+    conn->deadline = 0;
+    if (conn->bodyPending > 0)
+        conn->deadline = http_clock() + reactor->server->bodyTimeout;
+
+    conn->state = HTTP_CONN_BUSY;
+    conn->keepAlive = false;
+    conn->requests++;
+    conn->next = NULL;
+    pthread_mutex_lock(&reactor->lock);
+    if (reactor->readyTail)
+        reactor->readyTail->next = conn;
+    else
+        reactor->readyHead = conn;
+    reactor->readyTail = conn;
+    pthread_cond_signal(&reactor->ready);
+    pthread_mutex_unlock(&reactor->lock);
+}
+
+
+
+/*
+ * svr_conn_dispatch - queue the buffered request, if it is complete
+ */
+static void
+svr_conn_dispatch(struct http_reactor * reactor, httpConn * conn)
+{
+    int	len;
+
+    len = conn->fcgi ? fcgi_complete(conn) : svr_conn_complete(conn);
+    if (len < 0) {
+        svr_conn_close(reactor, conn);
+        return;
+    }
+    if (len == 0) {
+        svr_conn_watch(reactor, conn);
+        svr_conn_arm(reactor, conn, EPOLLIN, EPOLL_CTL_MOD);
+        return;
+    }
+    conn->reqLen = len;
+    svr_conn_ready(reactor, conn);
+}
+
+
+
+/*
+ * svr_conn_input - the client sent data
+ */
+static void
+svr_conn_input(struct http_reactor * reactor, httpConn * conn)
+{
+    if ((conn->fcgi ? fcgi_read(conn) : svr_conn_read(conn)) < 0) {
+        svr_conn_close(reactor, conn);
+        return;
+    }
+    svr_conn_dispatch(reactor, conn);
+}
+
+
+
+/*
+ * svr_conn_next - prepare a persistent connection for the next request
+ *
+ * Pipelined requests may already wait in the input buffer.
+ */
+static void
+svr_conn_next(struct http_reactor * reactor, httpConn * conn)
+{
+    conn->inLen -= conn->reqLen;
+    memmove(conn->in, conn->in + conn->reqLen, conn->inLen);
+    conn->reqLen = 0;
+    conn->headLen = 0;
+    conn->scanned = 0;
+
+    /* do not keep the buffer of a big response for an idle client */
+    conn->hdrLen = 0;
+    conn->hdrSent = 0;
+    conn->outLen = 0;
+    conn->outSent = 0;
+    conn->outKept = 0;
+    conn->chunked = false;
+    conn->broken = false;
+    http_close_file(conn);
+    if (conn->outSize > HTTP_READ_BUF_LEN * 16) {
+        free(conn->out);
+        conn->out = NULL;
+        conn->outSize = 0;
+    }
+
+    conn->state = HTTP_CONN_READ;
+    svr_conn_dispatch(reactor, conn);
+}
+
+
+
+/*
+ * svr_conn_output - the socket can take more of the response
+ */
+static void
+svr_conn_output(struct http_reactor * reactor, httpConn * conn)
+{
+    switch (http_flush(conn)) {
+    case 0:
+        svr_conn_arm(reactor, conn, EPOLLOUT, EPOLL_CTL_MOD);
+        break;
+    case 1:
+        if (conn->keepAlive && !conn->broken) {
+            svr_conn_next(reactor, conn);
+            break;
+        }
+        /* fall through */
+    default:
+        svr_conn_close(reactor, conn);
+        break;
+    }
+}
+
+
+
+/*
+ * svr_accept - take all pending connections from the backlog
+ */
+static void
+svr_accept(struct http_reactor * reactor, httpd * server)
+{
+    struct  sockaddr_in     addr;
+    socklen_t  addrLen;
+    httpConn *conn;
+    int	sock;
+
+    while (1) {
+        addrLen = sizeof(addr);
+        sock = accept(server->serverSock, (struct sockaddr *)&addr, &addrLen);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;             /* EAGAIN: backlog is empty */
+        }
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+        /* one client must not take all the connections, the FastCGI
+         * front end passes on the requests of all */
+        if (server->fcgiPath == NULL &&
+            !svr_client_add(reactor, addr.sin_addr.s_addr)) {
+            write(sock, SVR_CLIENT_BUSY, strlen(SVR_CLIENT_BUSY));
+            close(sock);
+            continue;
+        }
+        conn = malloc(sizeof(httpConn));
+        if (conn != NULL) {
+            bzero(conn, sizeof(httpConn));
+            if (server->fcgiPath && (conn->fcgi = fcgi_new()) == NULL) {
+                free(conn);
+                conn = NULL;
+            }
+        }
+        if (conn == NULL) {
+            if (server->fcgiPath == NULL)
+                svr_client_del(reactor, addr.sin_addr.s_addr);
+            close(sock);
+            continue;
+        }
+        conn->sock = sock;
+        conn->addr = addr.sin_addr.s_addr;
+        conn->timer.data = conn;
+        conn->fileFd = -1;
+        conn->spillFd = -1;
+        conn->state = HTTP_CONN_READ;
+        reactor->connCount++;
+        conn->nextConn = reactor->conns;
+        if (reactor->conns)
+            reactor->conns->prevConn = conn;
+        reactor->conns = conn;
+        conn->inSize = HTTP_READ_BUF_LEN;
+        conn->in = malloc(conn->inSize);
+        if (conn->in == NULL) {
+            svr_conn_close(reactor, conn);
+            continue;
+        }
+        /* FastCGI passes the address of the client with the request */
+        if (conn->fcgi ||
+            inet_ntop(AF_INET, &addr.sin_addr, conn->client_ip,
+                      HTTP_IP_ADDR_LEN) == NULL)
+            *conn->client_ip = 0;
+        svr_conn_watch(reactor, conn);
+        svr_conn_arm(reactor, conn, EPOLLIN, EPOLL_CTL_ADD);
+    }
+}
+
+
+
+/*
+ * svr_unlisten - take the last connections and close the socket
+ *
+ * Idle persistent connections stay until their timeout, closing them
+ * now might lose a request already on the way.
+ */
+static void
+svr_unlisten(struct http_reactor * reactor, httpd * server)
+{
+    svr_accept(reactor, server);
+    epoll_ctl(reactor->epollFd, EPOLL_CTL_DEL, server->serverSock, NULL);
+    svr_close_port(server);
+}
+
+
+
+/*
+ * svr_reactor - the event loop driving all connections
+ */
+static void *
+svr_reactor(void * arg)
+{
+    httpd	*server = (httpd *) arg;
+    struct http_reactor *reactor = server->reactor;
+    struct epoll_event events[SVR_MAX_EVENTS];
+    httpConn *conn, *next;
+    char	buf[64];
+    bool	stopping;
+    int	i, n;
+
+    while (1) {
+        n = epoll_wait(reactor->epollFd, events, SVR_MAX_EVENTS, 1000);
+        for (i = 0; i < n; i++) {
+            conn = events[i].data.ptr;
+            if (conn == NULL) {
+                svr_accept(reactor, server);
+                continue;
+            }
+            if (conn == (httpConn *) reactor) {
+                /* workers have finished some requests */
+                while (read(reactor->wakeFd[0], buf, sizeof(buf)) > 0)
+                    ;
+                pthread_mutex_lock(&reactor->lock);
+                next = reactor->done;
+                reactor->done = NULL;
+                stopping = reactor->stopping;
+                pthread_mutex_unlock(&reactor->lock);
+                if (stopping && server->serverSock >= 0)
+                    svr_unlisten(reactor, server);
+                while ((conn = next) != NULL) {
+                    next = conn->next;
+                    conn->state = HTTP_CONN_WRITE;
+                    conn->waiting = HTTP_WAIT_SEND;
+                    timer_add(&reactor->timers, &conn->timer, conn->deadline);
+                    svr_conn_output(reactor, conn);
+                }
+                continue;
+            }
+            if (conn->state == HTTP_CONN_READ)
+                svr_conn_input(reactor, conn);
+            else if (conn->state == HTTP_CONN_WRITE)
+                svr_conn_output(reactor, conn);
+        }
+        timer_run(&reactor->timers, http_clock(), svr_conn_timeout, reactor);
+    }
+    return NULL;
+}
+
+
+
+/*
+ * The registered directories are compiled into a hash table when the
+ * server starts. It holds a route for every directory and one for
+ * every named entry, which is not hidden by a wildcard registered
+ * later. Both are keyed by their full path.
+ */
+#define	SVR_FNV_BASIS	2166136261u
+#define	SVR_FNV_PRIME	16777619u
+
+static unsigned int
+svr_route_hash(const char * key, int len)
+{
+    unsigned int hash = SVR_FNV_BASIS;
+
+    while (len-- > 0)
+        hash = (hash ^ (unsigned char) *key++) * SVR_FNV_PRIME;
+    return hash;
+}
+
+
+
+/*
+ * svr_add_route - put a route into the hash table
+ */
+static httpRoute *
+svr_add_route(httpd * server, char * key, bool isDir)
+{
+    httpRoute	*route;
+    int		len = strlen(key);
+    unsigned int hash = svr_route_hash(key, len), i;
+
+    for (i = hash & server->routeMask; server->routes[i].key;
+         i = (i + 1) & server->routeMask) {
+        route = &server->routes[i];
+        if (route->isDir == isDir && route->len == len &&
+            memcmp(route->key, key, len) == 0)
+            return route;
+    }
+    route = &server->routes[i];
+    route->key = strdup(key);
+    route->len = len;
+    route->hash = hash;
+    route->isDir = isDir;
+    server->routeList[server->routeCount++] = route;
+    return route;
+}
+
+
+
+/*
+ * svr_count_routes - count the directories and entries below a directory
+ */
+static int
+svr_count_routes(httpDir * dir)
+{
+    httpDir	*child;
+    httpContent	*entry;
+    int		count = 1;
+
+    for (entry = dir->entries; entry; entry = entry->next)
+        count++;
+    for (child = dir->children; child; child = child->next)
+        count += svr_count_routes(child);
+    return count;
+}
+
+
+
+/*
+ * svr_compile_dir - add the routes of a directory and its children
+ *
+ * The entries are taken in the order the old lookup searched them:
+ * the first wildcard hides all entries behind it.
+ */
+static void
+svr_compile_dir(httpd * server, httpDir * dir, char * path)
+{
+    char	key[HTTP_MAX_URL];
+    httpRoute	*route, *named;
+    httpContent	*entry;
+    httpDir	*child;
+
+    route = svr_add_route(server, *path ? path : "/", true);
+    for (entry = dir->entries; entry; entry = entry->next) {
+        if (entry->type == SVR_HANDLE_WILDCARD ||
+            entry->type == SVR_HANDLE_C_WILDCARD) {
+            route->entry = entry;
+            break;
+        }
+        if (entry->indexFlag && route->index == NULL)
+            route->index = entry;
+        if (entry->name && *entry->name) {
+            snprintf(key, HTTP_MAX_URL, "%s/%s", path, entry->name);
+            named = svr_add_route(server, key, false);
+            if (named->entry == NULL)
+                named->entry = entry;
+        }
+    }
+    for (child = dir->children; child; child = child->next) {
+        snprintf(key, HTTP_MAX_URL, "%s/%s", path, child->name);
+        svr_compile_dir(server, child, key);
+    }
+}
+
+
+
+static int
+svr_compare_routes(const void * a, const void * b)
+{
+    return strcmp((*(httpRoute **) a)->key, (*(httpRoute **) b)->key);
+}
+
+
+
+/*
+ * svr_compile_routes - build the route table of the registered content
+ *
+ * Content must be registered before the server is started.
+ */
+static int
+svr_compile_routes(httpd * server)
+{
+    int		count, size, i;
+
+    count = svr_count_routes(server->content);
+    for (size = 16; size < count * 2; size *= 2)
+        ;
+    server->routes = calloc(size, sizeof(httpRoute));
+    server->routeList = calloc(count, sizeof(httpRoute *));
+    if (server->routes == NULL || server->routeList == NULL)
+        return(-1);
+    server->routeMask = size - 1;
+    server->routeCount = 0;
+    svr_compile_dir(server, server->content, "");
+    qsort(server->routeList, server->routeCount, sizeof(httpRoute *),
+          svr_compare_routes);
+    for (i = 0; i < server->routeCount; i++)
+        if (server->routeList[i]->entry || server->routeList[i]->index)
+            server->routeList[i]->metrics =
+                metrics_route(server->routeList[i]->key);
+    return(0);
+}
+
+
+
+/*
+ * svr_lookup_route - find a route by its hash
+ */
+static httpRoute *
+svr_lookup_route(httpd * server, const char * key, int len,
+                 unsigned int hash, bool isDir)
+{
+    httpRoute	*route;
+    unsigned int i;
+
+    for (i = hash & server->routeMask; server->routes[i].key;
+         i = (i + 1) & server->routeMask) {
+        route = &server->routes[i];
+        if (route->hash == hash && route->isDir == isDir &&
+            route->len == len && memcmp(route->key, key, len) == 0)
+            return route;
+    }
+    return NULL;
+}
+
+
+
+/*
+ * svr_find_route - find the content for a request path
+ *
+ * One pass over the path gives the hash of the whole path and of its
+ * directory. The name of the entry is left in the path.
+ */
+httpContent *
+svr_find_route(httpd * server, char * path, char ** entryName)
+{
+    httpRoute	*route;
+    httpContent *entry;
+    unsigned int hash = SVR_FNV_BASIS, dirHash = 0;
+    char	*cp, *last = NULL;
+    int		dirLen = 0;
+
+    for (cp = path; *cp; cp++) {
+        if (*cp == '/') {
+            last = cp;
+            dirLen = cp - path;
+            dirHash = hash;
+            if (cp == path) {
+                dirLen = 1;     /* the root directory is "/" */
+                dirHash = (hash ^ '/') * SVR_FNV_PRIME;
+            }
+        }
+        hash = (hash ^ (unsigned char) *cp) * SVR_FNV_PRIME;
     }
+    if (last == NULL || server->routes == NULL)
+        return NULL;
+    *entryName = last + 1;
+
+    route = svr_lookup_route(server, path, cp - path, hash, false);
+    if (route)
+        entry = route->entry;
     else {
-        addr.sin_addr.s_addr = inet_addr(new->host);
-    }
-    addr.sin_port = htons((u_short)new->port);
-    if (bind(sock,(struct sockaddr *)&addr,sizeof(addr)) <0) {
-        close(sock);
-        free(new);
-        return(NULL);
+        route = svr_lookup_route(server, path, dirLen, dirHash, true);
+        if (route == NULL)
+            return NULL;
+        if (**entryName == 0 && route->index)
+            entry = route->index;
+        else
+            entry = route->entry;
+        if (entry == NULL)
+            return NULL;
     }
-    listen(sock, 128);
-    new->startTime = time(NULL);
-    return(new);
+    __sync_fetch_and_add(&route->hits, 1);
+    server->response.content = entry;
+    server->response.route = route;
+    return entry;
 }
 
+
+
+/*
+ * svr_foreach_route - tell the number of requests of all routes
+ */
 void
-svr_del(httpd * server)
+svr_foreach_route(httpd * server, void (*function)(char *, unsigned long))
 {
-    if (server == NULL)
-        return;
+    int		i;
 
-    if (server->host)
-        free(server->host);
-
-    free(server);
-    server = NULL;
+    for (i = 0; i < server->routeCount; i++)
+        if (server->routeList[i]->entry || server->routeList[i]->index)
+            (function)(server->routeList[i]->key,
+                       server->routeList[i]->hits);
 }
 
 
 
+/*
+ * svr_start - start the reactor thread of a server
+ */
 int
-svr_get_connection(httpd * server, struct timeval *timeout)
+svr_start(httpd * server)
 {
-    int	result;
-    fd_set	fds;
-    struct  sockaddr_in     addr;
-    socklen_t  addrLen;
-    char	*ipaddr;
+    struct http_reactor *reactor;
+    struct epoll_event ev;
+
+    reactor = malloc(sizeof(struct http_reactor));
+    if (reactor == NULL)
+        return(-1);
+    bzero(reactor, sizeof(struct http_reactor));
+    if (svr_compile_routes(server) < 0) {
+        free(reactor);
+        return(-1);
+    }
+    pthread_mutex_init(&reactor->lock, NULL);
+    pthread_cond_init(&reactor->ready, NULL);
+    reactor->server = server;
+    timer_init(&reactor->timers, http_clock());
+    reactor->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epollFd < 0 || pipe(reactor->wakeFd) < 0) {
+        free(reactor);
+        return(-1);
+    }
+    fcntl(reactor->wakeFd[0], F_SETFL, O_NONBLOCK);
+    fcntl(reactor->wakeFd[1], F_SETFL, O_NONBLOCK);
+
+    /* the listening socket and the wakeup pipe have no connection */
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, server->serverSock, &ev);
+    ev.data.ptr = reactor;
+    epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, reactor->wakeFd[0], &ev);
+
+    server->reactor = reactor;
+    if (log_start() < 0 ||
+        pthread_create(&reactor->thread, NULL, svr_reactor, server) != 0) {
+        server->reactor = NULL;
+        return(-1);
+    }
+    return(0);
+}
 
-    FD_ZERO(&fds);
-    FD_SET(server->serverSock, &fds);
-    result = 0;
-    while(result == 0) {
-        struct timeval timo;
 
-        timo.tv_sec = timeout->tv_sec;
-        timo.tv_usec = timeout->tv_usec;
 
-        result = select(server->serverSock + 1, &fds, 0, 0, &timo);
-        if (result < 0)
-            return(-1);
-        if (timeout != 0 && result == 0)
+/*
+ * svr_get_connection - wait for a connection with a complete request
+ */
+int
+svr_get_connection(httpd * server, struct timeval *timeout)
+{
+    struct http_reactor *reactor = server->reactor;
+    struct timespec until;
+    httpConn *conn;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeout->tv_sec;
+    until.tv_nsec += timeout->tv_usec * 1000;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&reactor->lock);
+    while (reactor->readyHead == NULL) {
+        if (pthread_cond_timedwait(&reactor->ready, &reactor->lock,
+                                   &until) == ETIMEDOUT) {
+            pthread_mutex_unlock(&reactor->lock);
             return(0);
-        if (result > 0)
-            break;
+        }
     }
-    bzero(&addr, sizeof(addr));
-    addrLen = sizeof(addr);
-    server->clientSock = accept(server->serverSock,(struct sockaddr *)&addr,
-                                &addrLen);
-    ipaddr = inet_ntoa(addr.sin_addr);
-    if (ipaddr)
-        strncpy(server->client_ip, ipaddr, HTTP_IP_ADDR_LEN);
-    else
-        *server->client_ip = 0;
-    server->readBufRemain = 0;
-    server->readBufPtr = NULL;
+    conn = reactor->readyHead;
+    reactor->readyHead = conn->next;
+    if (reactor->readyHead == NULL)
+        reactor->readyTail = NULL;
+    if (server->generation != reactor->server->generation)
+        svr_copy_settings(server, reactor->server);
+    pthread_mutex_unlock(&reactor->lock);
+
+    server->conn = conn;
+    server->clientSock = conn->sock;
+    strncpy(server->client_ip, conn->client_ip, HTTP_IP_ADDR_LEN);
+    server->readBufPtr = conn->in;
+    server->readBufRemain = conn->reqLen;
+
+    /* the request is parsed in place, the byte behind it may belong
+     * to a pipelined request */
+    conn->saved = conn->in[conn->reqLen];
+    conn->in[conn->reqLen] = 0;
 
     return(1);
 }
@@ -216,7 +1450,7 @@ svr_get_connection(httpd * server, struct timeval *timeout)
 int
 svr_read_request(httpd * server)
 {
-    static char req[HTTP_MAX_LEN];
+    TraceSpan span;
     int retval;
 
     /* Setup for a standard response */
@@ -226,66 +1460,201 @@ svr_read_request(httpd * server)
     strcpy(server->response.response,"200 Output Follows\n");
     server->response.headersSent = false;
     server->response.utf8 = true;
-
-    retval = request_read(server, req);
-    if (retval != 0) {
-	write(server->clientSock, HTTP_METHOD_ERROR,
-	      strlen(HTTP_METHOD_ERROR));
-	write(server->clientSock, req, strlen(req));
+    server->response.length = 0;
+    server->response.contentLength = -1;
+    server->response.encoding = HTTP_ENC_UNKNOWN;
+    server->response.vary = false;
+    server->response.modTime = 0;
+    server->response.route = NULL;
+
+    TRACE_BEGIN(&span, "request_read", NULL);
+    retval = request_read(server);
+    TRACE_END(&span);
+    if (retval == -1) {
+	svr_set_response(server, "501 Not Implemented");
+	http_write(server, HTTP_METHOD_ERROR, strlen(HTTP_METHOD_ERROR));
 	svr_write_errorlog(server,LEVEL_ERROR,
 			   "Invalid method received");
     }
+    else if (retval == -3) {
+	svr_set_response(server, "501 Not Implemented");
+	http_write(server, HTTP_ENCODING_ERROR, strlen(HTTP_ENCODING_ERROR));
+	svr_write_errorlog(server,LEVEL_ERROR,
+			   "Transfer-Encoding received");
+    }
+    else if (retval < 0) {
+	svr_write_errorlog(server,LEVEL_ERROR,
+			   "Request body incomplete");
+    }
     return retval;
 }
 
 
 
+/*
+ * svr_lock_handlers - wait until a handler may run
+ *
+ * A reader shares the state with the other readers, any other handler
+ * runs alone. Before, the sync function takes over the changes, other
+ * processes made to the shared state. A reader only takes the write
+ * side for it, if there are any.
+ */
+static void
+svr_lock_handlers(httpd * server, httpContent * entry)
+{
+    if (entry->reader) {
+        pthread_rwlock_rdlock(&svr_handler_lock);
+        if (server->sync == NULL || !(server->behind)())
+            return;
+        pthread_rwlock_unlock(&svr_handler_lock);
+    }
+    svr_lock(server);
+    if (server->sync)
+        (server->sync)();
+    if (entry->reader) {
+        svr_unlock(server);
+        pthread_rwlock_rdlock(&svr_handler_lock);
+    }
+}
+
+
+
+/*
+ * svr_lock_writes - let a reader change the shared state after all
+ *
+ * The read side is given up for the write side, others may change the
+ * state in between. So the reader must look up again, what it needs.
+ */
 void
-svr_process_request(httpd * server)
+svr_lock_writes(httpd * server)
 {
-    char	dirName[HTTP_MAX_URL];
-    char 	entryName[HTTP_MAX_URL];
-    char 	*cp;
-    httpDir	*dir;
-    httpContent *entry;
+    if (svr_writing)
+        return;
+    pthread_rwlock_unlock(&svr_handler_lock);
+    svr_lock(server);
+    if (server->sync)
+        (server->sync)();
+}
 
-    server->response.length = 0;
-    strncpy(dirName, server->request.path, HTTP_MAX_URL);
 
-    cp = rindex(dirName, '/');
-    if (cp == NULL) {
-        printf("Invalid request path '%s'\n",dirName);
+
+/*
+ * svr_lock - keep the handlers from running
+ *
+ * The shared state of the wiki may be changed until svr_unlock().
+ */
+void
+svr_lock(httpd * server)
+{
+    pthread_rwlock_wrlock(&svr_handler_lock);
+    svr_writing = true;
+}
+
+
+
+/*
+ * svr_unlock - let the handlers run again, either side is given up
+ */
+void
+svr_unlock(httpd * server)
+{
+    svr_writing = false;
+    pthread_rwlock_unlock(&svr_handler_lock);
+}
+
+
+
+/*
+ * svr_set_sync - set the function taking over changes of others
+ *
+ * The function behind tells, if there are any, without changing the
+ * state.
+ */
+void
+svr_set_sync(httpd * server, void (*sync)(), bool (*behind)())
+{
+    server->sync = sync;
+    server->behind = behind;
+}
+
+
+
+/*
+ * svr_set_reader - mark a handler, that only reads the shared state
+ *
+ * Readers run at the same time. Without a name, the handler of the
+ * directory is marked.
+ */
+void
+svr_set_reader(httpd * server, char * dir, char * name)
+{
+    httpDir	*dirPtr;
+    httpContent *entry;
+
+    dirPtr = svr_find_dir(server, dir, HTTP_FALSE);
+    if (dirPtr == NULL)
         return;
+    for (entry = dirPtr->entries; entry; entry = entry->next) {
+        if (name == NULL ? entry->type == SVR_HANDLE_C_WILDCARD :
+            entry->name && strcmp(entry->name, name) == 0)
+            entry->reader = true;
     }
-    strncpy(entryName, cp + 1, HTTP_MAX_URL);
-    if (cp != dirName)
-        *cp = 0;
-    else
-        *(cp+1) = 0;
+}
 
-    dir = svr_find_dir(server, dirName, HTTP_FALSE);
-    if (dir == NULL) {
-        svr_send_err404(server);
-        svr_write_accesslog(server);
+
+
+/*
+ * svr_reconfigure - pass changed settings on to the worker threads
+ *
+ * Each worker takes them over before its next request.
+ */
+void
+svr_reconfigure(httpd * server)
+{
+    struct http_reactor *reactor = server->reactor;
+
+    if (reactor == NULL) {
+        server->generation++;
         return;
     }
-    entry = svr_find_content(server, dir, entryName);
+    pthread_mutex_lock(&reactor->lock);
+    server->generation++;
+    pthread_mutex_unlock(&reactor->lock);
+}
+
+
+
+/*
+ * svr_handle_request - find the content of a request and answer it
+ */
+static void
+svr_handle_request(httpd * server)
+{
+    char 	*entryName;
+    httpContent *entry;
+
+    server->response.length = 0;
+    entry = svr_find_route(server, server->request.path, &entryName);
     if (entry == NULL) {
         svr_send_err404(server);
-        svr_write_accesslog(server);
         return;
     }
 
     if (entry->preload) {
-        if ((entry->preload)(server) < 0) {
-            svr_write_accesslog(server);
+        int result;
+
+        svr_lock_handlers(server, entry);
+        result = (entry->preload)(server);
+        svr_unlock(server);
+        if (result < 0)
             return;
-        }
     }
     switch(entry->type) {
     case SVR_HANDLE_C_FUNCT:
     case SVR_HANDLE_C_WILDCARD:
+        svr_lock_handlers(server, entry);
         (entry->function)(server);
+        svr_unlock(server);
         break;
 
     case SVR_HANDLE_STATIC:
@@ -302,16 +1671,117 @@ svr_process_request(httpd * server)
         }
         break;
     }
-    svr_write_accesslog(server);
 }
 
+
+
+void
+svr_process_request(httpd * server)
+{
+    TraceSpan	span;
+
+    TRACE_BEGIN(&span, "svr_process_request", server->request.path);
+    svr_handle_request(server);
+    TRACE_END(&span);
+}
+
+/*
+ * svr_end_request - give the connection back to the reactor
+ *
+ * The reactor sends the response as the socket becomes writable.
+ */
 void
 svr_end_request(httpd * server)
 {
+    struct http_reactor *reactor = server->reactor;
+    httpConn *conn = server->conn;
+    long	usec;
+
+    http_end_response(server);
+    if (conn->hdrSent == 0)
+        conn->deadline = http_clock() + server->sendTimeout;
+    usec = metrics_since(&server->request.started);
+    metrics_request(server->response.route ?
+                    server->response.route->metrics : NULL,
+                    atoi(server->response.response), usec,
+                    server->response.length);
+    svr_write_accesslog(server, usec);
     var_exit(&server->variables);
-    shutdown(server->clientSock,2);
-    close(server->clientSock);
+    arena_reset(&server->arena);
     request_clear(server);
+    server->conn = NULL;
+    server->clientSock = -1;
+    conn->in[conn->reqLen] = conn->saved;
+
+    pthread_mutex_lock(&reactor->lock);
+    conn->next = reactor->done;
+    reactor->done = conn;
+    pthread_mutex_unlock(&reactor->lock);
+    write(reactor->wakeFd[1], "", 1);
+}
+
+
+
+/*
+ * svr_set_keepalive - set the limits for persistent connections
+ *
+ * A maximum of 0 requests switches persistent connections off.
+ */
+void
+svr_set_keepalive(httpd * server, int timeout, int maxRequests)
+{
+    server->keepAliveTimeout = timeout;
+    server->keepAliveMax = maxRequests;
+}
+
+
+
+/*
+ * svr_set_limits - protect the server from slow or greedy clients
+ *
+ * A client gets the timeouts in seconds to send the headers and the
+ * body of a request and to take the response. It may have clientMax
+ * connections open at once, 0 allows any number.
+ */
+void
+svr_set_limits(httpd * server, int headerTimeout, int bodyTimeout,
+               int sendTimeout, int clientMax)
+{
+    server->headerTimeout = headerTimeout;
+    server->bodyTimeout = bodyTimeout;
+    server->sendTimeout = sendTimeout;
+    server->clientMax = clientMax;
+}
+
+
+
+/*
+ * svr_set_cache - keep small static files in memory
+ *
+ * Files of the directories registered afterwards are loaded into up
+ * to size bytes of memory. Clients may use their copies for maxAge
+ * seconds before asking again.
+ */
+void
+svr_set_cache(httpd * server, int size, int maxAge)
+{
+    cache_init(size);
+    server->cacheMaxAge = maxAge;
+}
+
+
+
+/*
+ * svr_set_compression - set the zlib level for dynamic text
+ *
+ * Level 0 sends all responses uncompressed.
+ */
+void
+svr_set_compression(httpd * server, int level)
+{
+    if (level > 9)
+        level = 9;
+    server->deflateLevel = level;
 }
 
 
@@ -398,6 +1868,7 @@ svr_register_dir(httpd * server, char * dir, int (*preload)(), char *path)
         snprintf(entry->path, HTTP_MAX_URL, "%s/%s",
                  server->fileBasePath, path);
     }
+    cache_load_dir(entry->path);
     return(0);
 }
 
@@ -477,15 +1948,23 @@ svr_send_headers(httpd * server)
     svr_send_headers(server);
 }
 
+/*
+ * The headers are fixed with the first output, like they were sent
+ * then. Later changes are ignored.
+ */
 void
 svr_set_response(httpd * server, char * msg)
 {
+    if (server->response.headersSent)
+        return;
     strncpy(server->response.response, msg, HTTP_MAX_URL);
 }
 
 void
 svr_set_contenttype(httpd * server, char * type)
 {
+    if (server->response.headersSent)
+        return;
     strncpy(server->response.contentType, type, HTTP_MAX_URL);
 }
 
@@ -493,6 +1972,10 @@ svr_set_contenttype(httpd * server, char * type)
 void
 svr_add_header(httpd * server, char * msg)
 {
+    if (server->response.headersSent)
+        return;
+    if (strlen(server->response.headers) + strlen(msg) + 2 > HTTP_MAX_HEADERS)
+        return;
     strcat(server->response.headers, msg);
     if (msg[strlen(msg) - 1] != '\n')
         strcat(server->response.headers, "\n");
@@ -531,20 +2014,22 @@ svr_use_utf8 (bool val)
 void
 svr_puts(httpd *server, const char *msg)
 {
-    int len;
-    const char * dst;
-    char buf[HTTP_MAX_LEN];
+    svr_write(server, msg, strlen(msg));
+}
 
-    if (server->response.utf8) {
-	http_to_utf(buf, msg);
-	dst = buf;
-    } else
-	dst = msg;
 
-    len = strlen(dst);
-    server->response.length += len;
+
+/*
+ * svr_write - send len chars of a string
+ */
+void
+svr_write(httpd *server, const char *msg, int len)
+{
     http_send_headers(server, 0, 0);
-    write( server->clientSock, dst, len);
+    if (server->response.utf8)
+	http_write_utf(server, msg, len);
+    else
+	http_write(server, msg, len);
 }
 
 
@@ -553,24 +2038,33 @@ void
 svr_printf(httpd *server, char *fmt, ...)
 {
     va_list	args;
-    char	tmp[HTTP_MAX_LEN];
-    char	buf[HTTP_MAX_LEN*2];
+    char	tmp[HTTP_READ_BUF_LEN];
     char*       dst;
+    int		len;
 
     va_start(args, fmt);
-    vsnprintf(tmp, HTTP_MAX_LEN, fmt, args);
+    len = vsnprintf(tmp, sizeof(tmp), fmt, args);
     va_end(args);
 
-    if (server->response.utf8) {
-	http_to_utf(buf, tmp);
-	dst = buf;      /* take the converted utf8-string */
+    /* only long output needs the heap */
+    dst = tmp;
+    if (len >= sizeof(tmp)) {
+	dst = malloc(len + 1);
+	if (dst == NULL)
+	    return;
+	va_start(args, fmt);
+	vsnprintf(dst, len + 1, fmt, args);
+	va_end(args);
     }
-    else
-        dst = tmp;      /* take the converted utf8-string */
 
-    server->response.length += strlen(dst);
     http_send_headers(server, 0, 0);
-    write( server->clientSock, dst, strlen(dst));
+    if (server->response.utf8)
+	http_write_utf(server, dst, len);
+    else
+	http_write(server, dst, len);
+
+    if (dst != tmp)
+	free(dst);
 }
 
 
@@ -578,23 +2072,16 @@ svr_printf(httpd *server, char *fmt, ...)
 void
 svr_putc(httpd *server, char ch)
 {
-    if (server->response.utf8) {
-        char src[2];
-	char buf[4];    /* max bytes for utf8 encoded character */
-
-        src[0] = ch;
-        src[1] = '\0';
+    char	buf[2];
 
-        http_to_utf(buf, src);
-        server->response.length += strlen(buf);
-        http_send_headers(server, 0, 0);
-        write( server->clientSock, buf, strlen(buf));
-    }
-    else {
-        server->response.length += 1;
-        http_send_headers(server, 0, 0);
-        write( server->clientSock, &ch, 1);
+    http_send_headers(server, 0, 0);
+    if (server->response.utf8 && (unsigned char) ch >= 0x80) {
+	buf[0] = (0xc0 | ((unsigned char) ch >> 6));
+	buf[1] = (0x80 | (ch & 0x3f));
+	http_write(server, buf, 2);
     }
+    else
+	http_write(server, &ch, 1);
 }
 
 
@@ -642,12 +2129,12 @@ svr_force_auth(httpd * server, char * realm)
 httpDir *
 svr_find_dir(httpd * server, char * dir, int createFlag)
 {
-    char	buffer[HTTP_MAX_URL], *curDir;
+    char	buffer[HTTP_MAX_URL], *curDir, *last;
     httpDir	*curItem, *curChild;
 
     strncpy(buffer, dir, HTTP_MAX_URL);
     curItem = server->content;
-    curDir = strtok(buffer,"/");
+    curDir = strtok_r(buffer, "/", &last);
     while(curDir)
     {
         curChild = curItem->children;
@@ -673,7 +2160,7 @@ svr_find_dir(httpd * server, char * dir, int createFlag)
             }
         }
         curItem = curChild;
-        curDir = strtok(NULL,"/");
+        curDir = strtok_r(NULL, "/", &last);
     }
     return(curItem);
 }
@@ -716,6 +2203,7 @@ svr_send_static(httpd * server, char * data)
 {
     if (http_check_modified(server,server->startTime) == 0) {
         svr_send_err304(server);
+        return;
     }
     http_send_headers(server, strlen(data), server->startTime);
     svr_puts(server, data);
@@ -723,34 +2211,163 @@ svr_send_static(httpd * server, char * data)
 
 
 
-void
-svr_send_file(httpd * server, char * path)
+/* content types of files by their suffix */
+static struct {
+    char	*suffix;
+    char	*type;
+} svr_mime_types[] = {
+    { "html",	"text/html" },
+    { "htm",	"text/html" },
+    { "css",	"text/css" },
+    { "txt",	"text/plain" },
+    { "xml",	"text/xml" },
+    { "rss",	"application/rss+xml" },
+    { "js",	"application/javascript" },
+    { "gif",	"image/gif" },
+    { "jpg",	"image/jpeg" },
+    { "jpeg",	"image/jpeg" },
+    { "png",	"image/png" },
+    { "ico",	"image/x-icon" },
+    { "bmp",	"image/bmp" },
+    { "svg",	"image/svg+xml" },
+    { "tif",	"image/tiff" },
+    { "tiff",	"image/tiff" },
+    { "xbm",	"image/xbm" },
+    { "pdf",	"application/pdf" },
+    { "rtf",	"application/rtf" },
+    { "ps",	"application/postscript" },
+    { "doc",	"application/msword" },
+    { "xls",	"application/vnd.ms-excel" },
+    { "ppt",	"application/vnd.ms-powerpoint" },
+    { "odt",	"application/vnd.oasis.opendocument.text" },
+    { "ods",	"application/vnd.oasis.opendocument.spreadsheet" },
+    { "zip",	"application/zip" },
+    { "gz",	"application/x-gzip" },
+    { "tgz",	"application/x-gzip" },
+    { "tar",	"application/x-tar" },
+    { "mp3",	"audio/mpeg" },
+    { "ogg",	"audio/ogg" },
+    { "wav",	"audio/x-wav" },
+    { "mpg",	"video/mpeg" },
+    { "mpeg",	"video/mpeg" },
+    { "mp4",	"video/mp4" },
+    { "avi",	"video/x-msvideo" },
+    { NULL,	NULL }
+};
+
+
+
+/*
+ * svr_mime_type - find the content type of a file
+ */
+static char *
+svr_mime_type(char * path)
 {
     char	*suffix;
-    struct 	stat sbuf;
+    int		i;
 
     suffix = rindex(path, '.');
-    if (suffix != NULL) {
-        if (strcasecmp(suffix,".gif") == 0)
-            strcpy(server->response.contentType,"image/gif");
-        if (strcasecmp(suffix,".jpg") == 0)
-            strcpy(server->response.contentType,"image/jpeg");
-        if (strcasecmp(suffix,".xbm") == 0)
-            strcpy(server->response.contentType,"image/xbm");
-        if (strcasecmp(suffix,".png") == 0)
-            strcpy(server->response.contentType,"image/png");
-    }
-    if (stat(path, &sbuf) < 0) {
-        svr_send_err404(server);
-        return;
+    if (suffix == NULL || index(suffix, '/') != NULL)
+        return "application/octet-stream";
+    for (i = 0; svr_mime_types[i].suffix; i++)
+        if (strcasecmp(suffix + 1, svr_mime_types[i].suffix) == 0)
+            return svr_mime_types[i].type;
+    return "application/octet-stream";
+}
+
+
+
+/*
+ * svr_add_fileheaders - describe a static file in the headers
+ *
+ * The entity tag changes with every new version of the file. A client
+ * that sends it back with If-None-Match only gets a 304.
+ */
+void
+svr_add_fileheaders(httpd * server, char * type, char * etag, char * encoding)
+{
+    char	buf[HTTP_MAX_URL];
+
+    svr_set_contenttype(server, type);
+    snprintf(buf, HTTP_MAX_URL, "ETag: %s", etag);
+    svr_add_header(server, buf);
+    svr_add_header(server, "Accept-Ranges: bytes");
+    if (server->cacheMaxAge > 0) {
+        snprintf(buf, HTTP_MAX_URL, "Cache-Control: max-age=%d",
+                 server->cacheMaxAge);
+        svr_add_header(server, buf);
     }
-    if (http_check_modified(server,sbuf.st_mtime) == 0) {
+    if (encoding) {
+        snprintf(buf, HTTP_MAX_URL, "Content-Encoding: %s", encoding);
+        svr_add_header(server, buf);
+        svr_add_header(server, "Vary: Accept-Encoding");
+    }
+}
+
+
+
+/*
+ * svr_send_disk - send a file, that is not in the cache
+ *
+ * Returns -1, if there is no such file.
+ */
+static int
+svr_send_disk(httpd * server, char * path, char * type, char * encoding)
+{
+    struct 	stat sbuf;
+    char	etag[CACHE_ETAG_LEN];
+
+    if (stat(path, &sbuf) < 0 || !S_ISREG(sbuf.st_mode))
+        return -1;
+    cache_etag(etag, &sbuf);
+    svr_add_fileheaders(server, type, etag, encoding);
+
+    if (http_check_cached(server, etag, sbuf.st_mtime) == 0) {
         svr_send_err304(server);
     }
+    else if (http_check_range(server, etag, sbuf.st_mtime)) {
+        http_send_range(server, path);
+    }
     else {
         http_send_headers(server, sbuf.st_size, sbuf.st_mtime);
         http_send_file(server, path);
     }
+    return 0;
+}
+
+
+
+/*
+ * svr_send_file - send a file of a static directory
+ *
+ * Small files come from the cache. Clients taking gzip get the
+ * compressed variant name.gz instead, if there is one. Range requests
+ * are answered from the disk.
+ */
+void
+svr_send_file(httpd * server, char * path)
+{
+    char	*type = svr_mime_type(path);
+    char	gzPath[HTTP_MAX_URL];
+    int		result;
+
+    if ((server->request.acceptEncoding & HTTP_ENC_GZIP) &&
+        strlen(path) + 4 <= HTTP_MAX_URL) {
+        snprintf(gzPath, HTTP_MAX_URL, "%s.gz", path);
+        result = -1;
+        if (server->request.rangeCount == 0)
+            result = cache_send(server, gzPath, type, "gzip");
+        if (result == 0 ||
+            (result < 0 && svr_send_disk(server, gzPath, type, "gzip") == 0))
+            return;
+    }
+    result = -1;
+    if (server->request.rangeCount == 0)
+        result = cache_send(server, path, type, NULL);
+    if (result == 0 ||
+        (result < 0 && svr_send_disk(server, path, type, NULL) == 0))
+        return;
+    svr_send_err404(server);
 }
 
 
@@ -759,11 +2376,10 @@ svr_send_binary(httpd * server, char * data, int len)
 {
     if (http_check_modified(server,server->startTime) == 0) {
         svr_send_err304(server);
+        return;
     }
-    server->response.length += len;
     http_send_headers(server, 0, 0);
-    //http_send_headers(server, server->startTime, len);
-    write(server->clientSock, data, len);
+    http_write(server, data, len);
 }
 
 
@@ -771,8 +2387,7 @@ svr_send_binary(httpd * server, char * data, int len)
 void
 svr_send_text(httpd * server, char * msg)
 {
-    server->response.length += strlen(msg);
-    write(server->clientSock,msg,strlen(msg));
+    http_write(server, msg, strlen(msg));
 }
 
 
@@ -814,51 +2429,43 @@ svr_send_err404(httpd * server)
     svr_send_text(server, "</BODY></HTML>\n");
 }
 
+/*
+ * svr_write_accesslog - log the request with its duration
+ *
+ * The duration in microseconds and the bytes of the response follow
+ * the usual fields.
+ */
 void
-svr_write_accesslog(httpd * server)
+svr_write_accesslog(httpd * server, long usec)
 {
-    char	dateBuf[30];
-    struct 	tm *timePtr;
-    time_t	clock;
-    int	responseCode;
-
+    char	head[HTTP_IP_ADDR_LEN + 8];
 
     if (server->accessLog == NULL)
         return;
 
-    clock = time(NULL);
-    timePtr = localtime(&clock);
-    strftime(dateBuf, 30, "%d/%b/%Y:%T %Z",  timePtr);
-    responseCode = atoi(server->response.response);
-    fprintf(server->accessLog, "%s - - [%s] %s \"%s\" %d %d\n",
-            server->client_ip, dateBuf, request_get_methodname(server),
-            server->request.path, responseCode,
-            server->response.length);
-    fflush(server->accessLog);
+    snprintf(head, sizeof(head), "%s - - ", server->client_ip);
+    log_line(server->accessLog, LOG_ACCESS, head,
+             "%s \"%s\" %d %lld %ld",
+             request_get_methodname(server), server->request.path,
+             atoi(server->response.response),
+             (long long) server->response.length,
+             usec);
 }
 
 void
 svr_write_errorlog(httpd * server, char * level, char * message)
 {
-    char	dateBuf[30];
-    struct 	tm *timePtr;
-    time_t	clock;
-
     if (server->errorLog == NULL)
 	return;
 
-    clock = time(NULL);
-    timePtr = localtime(&clock);
-    strftime(dateBuf, 30, "%a %b %d %T %Y",  timePtr);
     if (*server->client_ip != 0) {
-        fprintf(server->errorLog, "[%s] [%s] [client %s] %s\n",
-                dateBuf, level, server->client_ip, message);
+        log_line(server->errorLog, LOG_ERROR, "", "[%s] [client %s] %s",
+                 level, server->client_ip, message);
     }
     else {
-        fprintf(server->errorLog, "[%s] [%s] %s\n",
-                dateBuf, level, message);
+        log_line(server->errorLog, LOG_ERROR, "", "[%s] %s",
+                 level, message);
     }
-    fflush(server->accessLog);
 }
 
 